@@ -11,6 +11,38 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "camera.h" // Camera class
+#include "mesh.h"   // Procedural mesh generation and level of detail selection
+#include "simplify.h" // Automatic level of detail generation
+#include "culling.h"  // Bounding volumes and frustum culling
+#include "hiz.h"      // Software occlusion culling
+#include "parallel.h" // Parallel loops
+#include "scenegraph.h" // Transform hierarchy
+#include "transforms.h" // SIMD model and normal matrix composition
+#include "triplebuffer.h" // Lock-free hand-off of simulation snapshots
+#include "options.h"      // Config file and command-line settings
+#include "pacer.h"        // Frame rate cap and pacing
+#include "resolution.h"   // Dynamic resolution scaling
+#include "framebuffer.h"  // Framebuffer size tracking
+#include "png.h"          // PNG encoding
+#include "stream.h"       // Raw frame streaming to an encoder or shared memory
+#include "shadow.h"       // Shadow atlas layout and caching
+#include "lights.h"       // Clustered point lights
+#include "lightmap.h"     // Lightmap unwrapping and baking
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 
 using namespace std; // Standard namespace
@@ -20,6 +52,16 @@ using namespace std; // Standard namespace
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+// Same as GLSL with an extension the shader requires
+#ifndef GLSL_EXTENSION
+#define GLSL_EXTENSION(Version, Extension, Source) "#version " #Version " core \n#extension " #Extension " : require \n" #Source
+#endif
+
+// Shader code appended to a source starting with GLSL, for the parts shared by several programs
+#ifndef GLSL_CHUNK
+#define GLSL_CHUNK(Source) #Source
+#endif
+
 // Unnamed namespace
 namespace
 {
@@ -29,15 +71,40 @@ namespace
     const int WINDOW_WIDTH = 1400;
     const int WINDOW_HEIGHT = 800;
 
+    // Number of levels of detail generated for the pencil, finest first
+    const int PENCIL_LOD_COUNT = 4;
+    // Sides of the pencil body and nib at each level: cylindrical up close, hexagonal and then triangular further away
+    const int PENCIL_LOD_SEGMENTS[PENCIL_LOD_COUNT] = { 24, 12, 6, 3 };
+    // Smallest projected radius (in pixels) each level is used at
+    const float PENCIL_LOD_MIN_RADIUS[PENCIL_LOD_COUNT] = { 150.0f, 50.0f, 15.0f, 0.0f };
+    // Largest projected geometric error (in pixels) allowed when picking a generated level of detail
+    const float LOD_MAX_PIXEL_ERROR = 1.0f;
+
+    // Stores the GL data relative to one indexed level of detail
+    struct GLLodLevel
+    {
+        GLuint vao;         // Handle for the vertex array object, 0 for a level drawn from the mesh pool
+        GLuint vbo;         // Handle for the vertex buffer object
+        GLuint ebo;         // Handle for the element buffer object
+        GLsizei nIndices;   // Number of indices of the level
+        float error;        // Geometric deviation from the finest level, in object units
+        Bounds bounds;      // Bounding box and sphere of the level in object space
+        GLuint firstIndex;  // Location of the level in the mesh pool
+        GLint baseVertex;
+    };
+
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
-        GLuint vaoBP;         // Handle for the vertex array object - Body of the pencil
-        GLuint vboBP;         // Handle for the vertex buffer object - Body of the pencil
         GLuint nVertices;     // Number of indices of the mesh
 
-        GLuint vaoNP;       // Handle for the vertex array object - Nib of the pencil
-        GLuint vboNP;       // Handle for the vertex buffer object - Nib of the pencil
+        std::vector<GLLodLevel> cubeLod;        // Generated levels of detail - Cube shared by the desk objects
+
+        GLLodLevel bodyLod[PENCIL_LOD_COUNT];   // Levels of detail - Body of the pencil
+        GLLodLevel nibLod[PENCIL_LOD_COUNT];    // Levels of detail - Nib of the pencil
+
+        GLLodLevel pool;    // Every level above in a single set of buffers, for multi-draw indirect
+        MeshData poolData;  // CPU copy of the pool, from which the static batches are baked
 
         GLuint vaoPL;       // Handle for the vertex array object - Plane of the scene
         GLuint vboPL;       //Handle for the vertex buffer object - PLane of the scene
@@ -61,6 +128,189 @@ namespace
     // Shader program
     GLuint gObjectsProgramId;
     GLuint gLampProgramId;
+    GLuint gDepthProgramId;
+    GLuint gIndirectProgramId;      // Objects shader reading per-draw data from a storage buffer
+    GLuint gIndirectDepthProgramId; // Depth pre-pass program of the indirect path
+
+    // Settings from lightplane.cfg and the command line
+    const char* const OPTIONS_FILE = "lightplane.cfg";
+    Options gOptions;
+
+    // Frame pacing: the render loop waits for each frame's turn instead of running flat out
+    const double DEFAULT_TARGET_FPS = 60.0;
+    FramePacer gFramePacer;
+
+    // Size of the window's framebuffer, which the projection and the render targets follow
+    FramebufferManager gFramebuffer;
+
+    // Dynamic resolution: the scene is drawn into an offscreen target at a fraction of the window size,
+    // picked from the GPU time of earlier frames, then scaled up to the window
+    struct SceneTarget
+    {
+        GLuint fbo;
+        GLuint color;       // Texture read by the anti-aliasing and upscale passes
+        GLuint depth;       // Renderbuffer
+        int width;          // Allocated size, the framebuffer's unless a resize is still settling
+        int height;
+        int drawnWidth;     // Part drawn this frame
+        int drawnHeight;
+        int samples;        // Samples per pixel of the multisampled buffers, 0 without MSAA
+        GLuint msaaFbo;     // Drawn into under MSAA, then resolved into color
+        GLuint msaaColor;
+        GLuint msaaDepth;
+    };
+    SceneTarget gSceneTarget = {};
+    bool gDynamicResolution = true;
+    ResolutionController gResolution;
+    bool gSharpenUpscale = true;        // Sharpening upscale rather than plain bilinear
+    float gUpscaleSharpness = 0.25f;
+    GLuint gUpscaleProgramId;
+    GLuint gFullscreenVao = 0;          // Holds no buffers; fullscreen passes make their triangle from gl_VertexID
+
+    // Anti-aliasing, applied to the scene target before the upscale. MSAA resolves the multisampled
+    // buffers with a blit; FXAA and SMAA are post-processes writing into gAntiAliased, SMAA through an
+    // edge and a blend weight texture on the way.
+    enum AntiAliasing
+    {
+        AA_NONE,
+        AA_MSAA,
+        AA_FXAA,
+        AA_SMAA,
+        AA_MODE_COUNT
+    };
+    const char* const AA_MODE_NAMES[AA_MODE_COUNT] = { "none", "msaa", "fxaa", "smaa" };
+
+    struct PostTarget
+    {
+        GLuint fbo;
+        GLuint texture;
+    };
+    AntiAliasing gAntiAliasing = AA_NONE;
+    int gMsaaSamples = 4;
+    PostTarget gAntiAliased = {};
+    PostTarget gSmaaEdges = {};
+    PostTarget gSmaaWeights = {};
+    GLuint gFxaaProgramId;
+    GLuint gSmaaEdgesProgramId;
+    GLuint gSmaaWeightsProgramId;
+    GLuint gSmaaBlendProgramId;
+
+    // Deferred shading, the alternative to shading the objects as they are drawn: they write their albedo
+    // and octahedral-encoded normal to a G-buffer instead, and one fullscreen pass lights every pixel once,
+    // however many objects were drawn over it. The G-buffer has a single sample, which leaves out MSAA.
+    // Lightmapped shading keeps the forward path for the movable objects only, and draws the immovable
+    // ones with the lighting baked into a lightmap, looked up rather than computed.
+    enum Shading
+    {
+        SHADING_FORWARD,
+        SHADING_DEFERRED,
+        SHADING_LIGHTMAPPED,
+        SHADING_MODE_COUNT
+    };
+    const char* const SHADING_MODE_NAMES[SHADING_MODE_COUNT] = { "forward", "deferred", "lightmapped" };
+
+    struct GBuffer
+    {
+        GLuint fbo;
+        GLuint albedo;      // RGBA8
+        GLuint normal;      // RG16, octahedral encoding
+        GLuint depth;       // Texture, read back into positions by the lighting pass
+    };
+    Shading gShading = SHADING_FORWARD;
+    GBuffer gGBuffer = {};
+    GLuint gGBufferProgramId;
+    GLuint gIndirectGBufferProgramId;
+    GLuint gDeferredLightingProgramId;
+
+    // GPU time of a pass, from a ring of timer queries read a few frames after they were issued so the
+    // GPU is never waited on. Each query keeps a value describing the frame it timed.
+    const unsigned int GPU_TIMER_QUERIES = 4;
+    struct GpuTimer
+    {
+        GLuint queries[GPU_TIMER_QUERIES];
+        float tags[GPU_TIMER_QUERIES];
+        bool pending[GPU_TIMER_QUERIES];
+        unsigned int frame;
+        bool active;            // Whether the current frame is being timed
+        double seconds;         // Latest result, and the tag of the frame it timed
+        float tag;
+        double total;           // Results added up since the title last showed their average
+        unsigned int samples;
+    };
+    GpuTimer gSceneTimer = {};          // Tagged with the resolution scale
+    GpuTimer gAntiAliasingTimer = {};
+
+    // Framebuffer the upscale pass writes the finished frame into, the window's unless rendering offscreen
+    GLuint gOutputFbo = 0;
+
+    // Asynchronous readback: frames are copied into a ring of persistently mapped pixel buffers, with a
+    // fence per buffer telling when its copy has landed. Pixels are only looked at a few frames later, so
+    // the GPU is never waited on; a buffer is reused once whoever took its pixels releases it, which may
+    // happen on another thread.
+    const unsigned int READBACK_BUFFERS = 4;
+    enum ReadbackState
+    {
+        READBACK_FREE,
+        READBACK_COPYING,
+        READBACK_TAKEN
+    };
+    struct ReadbackSlot
+    {
+        GLuint buffer;
+        const unsigned char* pixels;    // Bottom row first, RGBA
+        GLsync fence;
+        std::atomic<int> state;
+        int tag;                        // Given with the frame, such as its index
+    };
+    struct Readback
+    {
+        ReadbackSlot slots[READBACK_BUFFERS];
+        int width;
+        int height;
+        unsigned int next;              // Frames queued so far; the next one goes to slot next % READBACK_BUFFERS
+        unsigned int oldest;            // Oldest frame still copying
+        unsigned int lost;              // Frames whose copy could not be waited for, never handed to onReady
+        std::function<void(unsigned int slot)> onReady;  // Takes the pixels of a slot, and releases it when done
+    };
+
+    // Capture: screenshots and frame sequences are read back from the back buffer through a readback
+    // ring and encoded on background threads, so capturing never holds up a frame
+    struct CaptureRequest
+    {
+        std::string path;   // PNG written, unless there is a callback to hand the pixels to instead
+        std::function<void(const unsigned char* pixels, int width, int height)> callback;
+    };
+    const unsigned int CAPTURE_ENCODER_THREADS = 2;
+    Readback gCapture;
+    CaptureRequest gCaptureRequests[READBACK_BUFFERS];  // Request served by the frame in each buffer
+    std::deque<CaptureRequest> gCaptureQueue;           // Requests waiting for a frame
+    std::unique_ptr<TaskQueue> gCaptureEncoders;        // Started by the first capture
+    std::string gCapturePrefix = "capture";
+    bool gRecording = false;            // Every frame is captured, as a numbered sequence
+    unsigned int gRecordedFrames = 0;
+    unsigned int gDroppedFrames = 0;    // Frames of the sequence that found every buffer busy
+
+    // Streaming sends every frame, raw, to an encoder process or a shared-memory ring. Frames are read
+    // back like captures, and a single writer thread keeps them in order.
+    FrameStream gStream;
+    Readback gStreamReadback;
+    PostTarget gStreamTarget;               // Frames scaled to the stream size, which the window may have left
+    std::unique_ptr<TaskQueue> gStreamWriter;
+    bool gStreamBlocking = false;           // A consumer that is behind holds up rendering, rather than losing frames
+    double gStreamFps = 60.0;               // Rate of the stream's clock, which an encoder takes the frames at
+    double gStreamStart = -1.0;             // Time of the first frame streamed, negative before it
+    int gStreamLastFrame = -1;              // Tick of the clock last sent to an encoder, kept by the writer thread
+    std::atomic<unsigned int> gStreamFrames(0);
+    std::atomic<unsigned int> gStreamDropped(0);
+
+    // Batch mode renders a file of camera poses to PNG images, offscreen and without the update thread
+    struct BatchPose
+    {
+        glm::vec3 position;
+        float yaw;
+        float pitch;
+        float zoom;
+    };
 
     // camera
     Camera gCamera(glm::vec3(0.0f, 2.0f, 17.0f));
@@ -68,9 +318,58 @@ namespace
     float gLastY = WINDOW_HEIGHT / 2.0f;
     bool gFirstMouse = true;
 
-    // timing
-    float gDeltaTime = 0.0f; // time between current frame and last frame
-    float gLastFrame = 0.0f;
+    // Simulation: a fixed-step update thread owns the camera and the local transforms of the scene objects,
+    // and publishes a snapshot of them after every step. Each frame draws the last two states of the latest
+    // snapshot blended by the time elapsed since, so motion runs at the same speed and stays smooth
+    // whatever the frame rate. The camera is the exception: it is drawn at the newest state with the input
+    // the update thread has not applied yet on top, so input shows in the very next frame.
+    const double UPDATE_STEP = 1.0 / 120.0;     // Seconds simulated per step
+    const double UPDATE_MAX_LAG = 0.25;         // After a longer stall the missed steps are dropped, not caught up
+
+    // Local transform of a scene object, as given to the scene graph
+    struct ObjectPose
+    {
+        glm::vec3 translation;
+        glm::quat rotation;
+        glm::vec3 scale;
+    };
+
+    // Input gathered on the main thread, where GLFW delivers it. Mouse offsets and scrolling are running
+    // totals that are never reset: a step records the totals it took in, and what is past them is pending.
+    struct InputState
+    {
+        bool moving[DOWNWARD + 1];              // Held movement keys, indexed by Camera_Movement
+        double mouseX;                          // Mouse offsets and scrolling since the start
+        double mouseY;
+        double scroll;
+        float pencilRoll;                       // -1, 0 or 1, as the keys rolling the pencil are held
+    };
+    std::mutex gInputMutex;
+    InputState gInput = {};
+
+    struct SceneSnapshot
+    {
+        double time;                            // When the current state is due, on the glfwGetTime clock
+        Camera camera;
+        InputState appliedInput;                // Input totals the camera has taken in
+        std::vector<ObjectPose> previousObjects;
+        std::vector<ObjectPose> objects;
+    };
+    TripleBuffer<SceneSnapshot> gSnapshots;
+
+    std::thread gUpdateThread;
+    std::atomic<bool> gUpdateRunning(false);
+    Camera gUpdateCamera;                       // Simulation state, owned by the update thread while it runs
+    InputState gUpdateInput = {};               // Input totals the steps have taken in so far
+    std::vector<ObjectPose> gUpdateObjects;
+
+    // The pencil rolls across the desk while J or K is held; nothing else in the scene moves
+    const int PENCIL_NODE = 0;                  // The pencil body in UCreateScene; the nib follows as its child
+    const int DESK_NODE = 2;
+    const float PENCIL_ROLL_SPEED = 1.5f;       // World units per second
+    glm::vec3 gPencilAxis;                      // Long axis of the pencil, which it turns about as it rolls
+    glm::vec3 gPencilRollDirection;             // Along the desk, square to the long axis
+    float gPencilRadius = 1.0f;
 
     //Light Color, Position, and Scale
     glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
@@ -80,6 +379,207 @@ namespace
     //Object color
     glm::vec3 gObjectColor(1.0f, 0.2f, 0.0f);
 
+    // Near and far clipping planes of the camera
+    const float CAMERA_NEAR = 0.1f;
+    const float CAMERA_FAR = 100.0f;
+
+    // Meshes the scene objects can be drawn with
+    enum SceneMesh
+    {
+        SCENE_MESH_CUBE,            // Generated chain of the desk cube
+        SCENE_MESH_PENCIL_BODY,     // Procedural levels of the pencil body
+        SCENE_MESH_PENCIL_NIB       // Procedural levels of the pencil nib
+    };
+
+    // Placement and appearance of an object drawn with the objects shader
+    struct SceneObject
+    {
+        const char* name;
+        SceneMesh mesh;
+        GLuint* textureId;          // Global holding the texture id, so objects can be declared before textures load
+        int parent;                 // Index of the object it is attached to, listed before it, or -1
+        glm::vec3 scale;            // Placement in world space when the scene is created
+        float rotationAngle;        // Angle and axis passed to glm::rotate
+        glm::vec3 rotationAxis;
+        glm::vec3 translation;
+        bool occluder;              // Rasterized into the Hi-Z buffer to hide the objects behind it
+        bool movable;               // Transformed every frame; immovable objects can be baked into static batches
+    };
+
+    // Objects drawn with the objects shader, in submission order
+    std::vector<SceneObject> gSceneObjects;
+    // Transform hierarchy of the objects, one node per object at the same index
+    SceneGraph gSceneGraph;
+    // Per-frame data of the objects, parallel to gSceneObjects
+    std::vector<glm::mat4> gObjectModels;
+    CullingSet gObjectBounds;                   // World-space boxes
+    std::vector<unsigned char> gObjectVisible;  // Frustum and Hi-Z test results
+    std::vector<unsigned int> gDrawOrder;       // Visible objects, nearest first
+    std::vector<float> gObjectDepth;            // View-space depth of each box center, the sort key
+
+    // Frame preparation (transforms, culling, sort keys, packets) runs as jobs of FRAME_JOB_GRAIN objects
+    // on the job system; a scene smaller than that is prepared on the GL thread without any hand-off
+    const unsigned int FRAME_JOB_GRAIN = 1024;
+    std::vector<std::vector<unsigned int>> gJobDrawLists;  // Drawable objects found by each job, merged into gDrawOrder
+
+    // Everything the GL thread needs to draw one object of gDrawOrder, built by the packet jobs
+    struct RenderPacket
+    {
+        GLsizei indexCount;
+        GLuint firstIndex;          // Location of the level in the mesh pool
+        GLint baseVertex;
+        GLuint texture;
+        GLuint query;               // Occlusion query the draw is conditional on, 0 for none
+        const glm::mat4* model;
+    };
+    std::vector<RenderPacket> gRenderPackets;
+
+    // Counters of the last rendered frame
+    struct FrameStats
+    {
+        unsigned int drawn;     // Draws submitted to the GPU: objects drawn one by one, and batches
+        unsigned int culled;    // Draws skipped for being outside the frustum
+        unsigned int occluded;  // Objects hidden behind the occluders in the Hi-Z buffer
+    };
+    FrameStats gFrameStats = { 0, 0, 0 };
+
+    // Software occlusion culling: the occluders are rasterized on the CPU into a small depth buffer
+    // and every other object's box is tested against its Hi-Z pyramid before any draw is submitted
+    bool gHiZCulling = true;
+    HiZBuffer gHiZBuffer;
+    const unsigned int HIZ_TEST_BATCH = 256;    // Boxes tested per parallel task
+
+    // Depth pre-pass: the objects first lay down depth with a trivial program, then the Phong pass
+    // runs with an equal depth test so every visible pixel is shaded once
+    bool gDepthPrePass = false;
+
+    // Multi-draw indirect: each pass submits every visible object with one glMultiDrawElementsIndirect
+    // call, and the shaders fetch the object's data from a storage buffer with gl_DrawIDARB
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // Per-object data, laid out as the DrawData struct of the indirect shaders (std430)
+    struct DrawData
+    {
+        glm::mat4 model;
+        glm::mat4 normalMatrix;     // Upper 3x3 used
+        GLuint material;            // Layer of the object's texture in the material array
+        GLuint padding[3];
+        glm::vec4 boundsCenter;     // World-space box, tested by the GPU culling pass
+        glm::vec4 boundsExtent;
+    };
+
+    const GLsizei MATERIAL_ARRAY_SIZE = 1024;   // Texels along each side of a layer of the material array
+
+    bool gIndirectDrawSupported = false;    // Needs GL_ARB_shader_draw_parameters for gl_DrawIDARB
+    bool gIndirectDraw = false;
+    GLuint gIndirectBuffer = 0;
+    std::vector<DrawElementsIndirectCommand> gDrawCommands;
+    std::vector<GLuint*> gMaterialTextures;     // Texture of each material, copied to the layer of the same index
+    GLuint gMaterialArray = 0;                  // Textures of the materials, one layer each, for the indirect path
+    std::vector<GLuint> gObjectMaterials;       // Material of each scene object
+    std::vector<GLuint> gDrawRemap;             // Object of each command, in draw order
+    GLuint gDrawRemapBuffer = 0;
+
+    // World transforms of the objects in structure-of-arrays form. Every frame they are composed into
+    // the model and normal matrices of the DrawData entries, written straight into a persistently mapped
+    // buffer; gObjectModels stays the CPU copy used for culling and LOD selection.
+    TransformStore gObjectTransforms;
+    // The mapped buffer holds one region of DrawData per frame in flight, and a fence per region keeps
+    // the CPU from writing over data the GPU has not read yet
+    const unsigned int DRAW_DATA_REGIONS = 3;
+    GLuint gDrawDataBuffer = 0;
+    char* gDrawDataMapped = nullptr;
+    GLsizeiptr gDrawDataRegionSize = 0;
+    GLsync gDrawDataFences[DRAW_DATA_REGIONS] = {};
+    unsigned int gDrawDataRegion = 0;
+    // A region only needs the matrices of the objects that changed since it was last written
+    unsigned int gTransformUpdate = 0;                          // Count of UUpdateObjectTransforms calls
+    std::vector<unsigned int> gObjectChangedUpdate;             // Update that last changed each object
+    unsigned int gDrawDataWrittenUpdate[DRAW_DATA_REGIONS] = {}; // Update each region was last written at
+
+    // GPU culling: a compute pass tests the box of the object of every command against the frustum and a
+    // draw distance, and clears the commands of the others for the indirect path. The boxes live in DrawData,
+    // so only those of objects that moved are written.
+
+    const float GPU_CULL_MAX_DISTANCE = CAMERA_FAR;
+    const GLuint GPU_CULL_GROUP_SIZE = 64;      // local_size_x of the compute shader
+
+    bool gGpuCulling = false;
+    bool gDrawCountSupported = false;           // glMultiDrawElementsIndirectCountARB reads the count from the GPU
+    GLuint gCullProgramId;
+    GLuint gDrawCountBuffer = 0;                // Draw count, then the number of visible candidates
+    GLuint gDrawCountReadback = 0;              // Copy of gDrawCountBuffer read by the CPU a frame or more later
+    GLsync gDrawCountFence = 0;                 // Signaled once the copy has landed
+    unsigned int gGpuVisibleCount = 0;          // Last visible count read back
+
+    // Static batching: immovable objects are baked into world space at load time, merged per material,
+    // and drawn with one call per batch instead of one per object. Every desk object has a texture of its
+    // own, so here batches save no draws and --static-batching leaves them off by default.
+    struct StaticBatch
+    {
+        GLLodLevel mesh;            // World-space vertices; bounds are world-space too
+        GLuint* textureId;
+    };
+    bool gStaticBatching = false;
+    std::vector<StaticBatch> gStaticBatches;
+
+    // Lightmaps (lightmap.h): the immovable objects are unwrapped into one lightmap, whose lighting is baked
+    // offline or loaded from the file of an earlier bake. They are merged per material like the static
+    // batches, with their lightmap coordinates in a vertex buffer of their own.
+    struct LightmapBatch
+    {
+        GLLodLevel mesh;            // World-space vertices
+        GLuint uv2Vbo;              // Lightmap coordinates, attribute 3
+        GLuint* textureId;
+    };
+    const GLuint LIGHTMAP_TEXTURE_UNIT = 9;     // After the shadow atlas
+    std::vector<LightmapBatch> gLightmapBatches;
+    GLuint gLightmap = 0;                       // RGBA8, lighting divided by LIGHTMAP_RANGE
+    int gLightmapSize = 512;                    // Texels along each side
+    GLuint gLightmapProgramId;
+
+    // Hardware occlusion culling: each object's bounding box is tested with a query against the depth of
+    // the occluders, and the object is then drawn under conditional rendering on that query's result
+    bool gOcclusionCulling = false;
+    std::vector<GLuint> gOcclusionQueries;      // One query object per scene object
+    std::vector<unsigned char> gOcclusionIssued; // Whether the query was issued this frame
+
+    // Shadows of the light, from an atlas of shadow maps around it (shadow.h). The immovable objects are
+    // drawn into the static layer once; each frame only the faces a movable object moved through are
+    // restored from it and get the movable objects drawn over them.
+    const GLuint SHADOW_TEXTURE_UNIT = 8;                       // Clear of the units of the object textures
+    const float SHADOW_SLOPE_BIAS = 2.0f;                       // glPolygonOffset while drawing the shadow maps
+    const float SHADOW_CONSTANT_BIAS = 4.0f;
+    bool gShadows = true;
+    int gShadowTileSize = 1024;                 // Texels along each side of a face
+    GLuint gShadowAtlas = 0;                    // Depth texture sampled with comparisons
+    GLuint gShadowFbo = 0;
+    ShadowCache gShadowCache;
+    Frustum gShadowFaceFrusta[SHADOW_FACES];
+    glm::mat4 gShadowFaceViewProjections[SHADOW_FACES];
+    glm::mat4 gShadowMatrices[SHADOW_FACES];    // World space to the atlas coordinates and depth of each face
+    unsigned int gShadowFacesDrawn = 0;         // Faces drawn since the title last showed the count
+
+    // Clustered lighting: small point lights around the desk, on top of the main light (lights.h). The
+    // lights, and the light lists the job system builds for the clusters every frame, go to storage
+    // buffers; a fragment only shades with the lights of its cluster, whatever their total count.
+    const float POINT_LIGHT_HEIGHT = 0.6f;      // Above the desk
+    const float POINT_LIGHT_INTENSITY = 0.8f;
+    std::vector<PointLight> gPointLights;
+    float gPointLightRadius = 1.5f;
+    bool gPointLightsChanged = false;           // The light buffer has to be uploaded again
+    LightClusters gLightClusters;
+    GLuint gPointLightBuffer = 0;
+    GLuint gClusterBuffer = 0;
+    GLuint gClusterLightBuffer = 0;
+
 }
 
 /* User-defined Function prototypes to:
@@ -90,15 +590,102 @@ namespace
 bool UInitialize(int, char* [], GLFWwindow** window);
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
+void UStartUpdateThread();
+void UStopUpdateThread();
+void UUpdateLoop(double startTime);
+void UUpdateStep(float step);
+void UApplySnapshot(double now);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void UCreateMesh(GLMesh& mesh);
 void UDestroyMesh(GLMesh& mesh);
+void UCreateLodLevel(const MeshData& data, float error, GLLodLevel& level, MeshData* pool);
+void UDestroyLodLevel(GLLodLevel& level);
+void UDrawLodLevel(const GLLodLevel& level);
+int USelectPencilLod(const glm::mat4& model, float localRadius);
+int USelectChainLod(const std::vector<GLLodLevel>& levels, const glm::mat4& model);
 bool UCreateTexture(const char* filename, GLuint& textureId);
 void UDestroyTexture(GLuint textureId);
 void URender();
+void URenderScene();
+void UCreateScene();
+void UDestroyScene();
+const GLLodLevel& USelectObjectLod(const SceneObject& object, const glm::mat4& model, int pencilLod);
+void UReportFrameStats();
+void UCreateSceneTarget(int width, int height, int samples);
+void UDestroySceneTarget();
+void UCreateGBuffer(int width, int height);
+void UDestroyGBuffer();
+void UDrawDeferredLighting(const glm::mat4& view, const glm::mat4& projection);
+void UCreatePostTarget(PostTarget& target, GLenum format, int width, int height);
+void UDestroyPostTarget(PostTarget& target);
+void UDestroyRenderTargets();
+void UUpdateRenderTargets(double now);
+void UCreateGpuTimer(GpuTimer& timer);
+void UDestroyGpuTimer(GpuTimer& timer);
+bool UReadGpuTimer(GpuTimer& timer);
+void UBeginGpuTimer(GpuTimer& timer, float tag);
+void UEndGpuTimer(GpuTimer& timer);
+void UBeginScenePass();
+void UDrawPostPass(GLuint programId, const PostTarget& target, GLuint texture0, GLuint texture1);
+GLuint UApplyAntiAliasing();
+void UEndScenePass();
+void UCreateReadback(Readback& readback, int width, int height);
+void UDestroyReadback(Readback& readback);
+bool UReadbackFrame(Readback& readback, GLuint fbo, int tag, bool block);
+void UCollectReadbacks(Readback& readback, bool waitForOldest);
+void UReleaseReadback(Readback& readback, unsigned int slot);
+bool UReadbackIdle(const Readback& readback);
+void UCaptureScreenshot(const std::string& path);
+void UCaptureNextFrame(std::function<void(const unsigned char* pixels, int width, int height)> callback);
+void UFinishCaptures();
+void UCaptureFrame();
+void UEncodeCapture(unsigned int slot);
+bool UStartStream(int width, int height, bool blockByDefault);
+void UStreamFrame(GLuint fbo, int width, int height, double time);
+void UStopStream();
+bool ULoadBatchPoses(const std::string& path, std::vector<BatchPose>& poses);
+bool URunBatch(const std::string& posesPath);
+bool UKeyPressedOnce(GLFWwindow* window, int key);
+void UCreateShadowAtlas();
+void UDestroyShadowAtlas();
+void UUpdateShadows();
+void UDrawShadowCasters(int face, ShadowLayer layer, bool movable, GLint modelLoc);
+void UScatterPointLights(unsigned int count);
+void UUpdateLightClusters(const glm::mat4& view, const glm::mat4& projection);
+void URenderOcclusionQueries(const glm::mat4& view, const glm::mat4& projection, int pencilLod);
+void UCullOccludedObjects(const glm::mat4& viewProjection);
+void USortDrawOrder(const glm::mat4& view);
+void UBuildRenderPackets(int pencilLod);
+void UDrawSceneObjects(GLint modelLoc, bool textured);
+void UUploadDrawCommands();
+void UCreateDrawDataBuffer();
+void UDestroyDrawDataBuffer();
+void UCreateMaterialArray();
+void UWriteDrawData();
+void UFenceDrawData();
+void UDrawSceneObjectsIndirect();
+void UCullOnGpu(const Frustum& frustum);
+void UDispatchGpuCulling(const Frustum& frustum, const glm::vec3& cameraPosition, GLuint commandCount);
+bool UReadGpuCullingCount(unsigned int& visible);
+bool UCheckGpuCulling();
+bool UCheckCapture();
+void UUpdateObjectTransforms();
+void UCreateStaticBatches();
+void UDrawStaticBatches(const Frustum& frustum, GLint modelLoc, bool textured);
+MeshData UObjectWorldMesh(size_t object);
+bool UBatchesImmovableObjects();
+bool UDrawnAlone(size_t object);
+void UCountFrameDraws(const Frustum& frustum, bool gpuCulling);
+glm::vec3 UAverageTextureColor(GLuint textureId);
+bool UCreateLightmaps(bool bake);
+void UDestroyLightmaps();
+void UDrawLightmapBatches(const Frustum& frustum, GLint modelLoc, bool textured);
+GLint UUseObjectsProgram(GLuint programId, const glm::mat4& view, const glm::mat4& projection);
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+bool UCreateShaderProgram(const std::vector<const char*>& vtxShaderSources, const std::vector<const char*>& fragShaderSources, GLuint& programId);
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId);
 void UDestroyShaderProgram(GLuint programId);
 
 
@@ -113,6 +700,8 @@ out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate;
 
+invariant gl_Position; // Must match the depth pre-pass exactly for the equal depth test
+
 //Uniform / Global variables for the  transform matrices
 uniform mat4 model;
 uniform mat4 view;
@@ -130,159 +719,1064 @@ void main()
 );
 
 
-/* Objects Fragment Shader Source Code*/
-const GLchar* pyramidFragmentShaderSource = GLSL(440,
+/* Objects Vertex Shader Source Code - Multi-draw indirect*/
+const GLchar* indirectVertexShaderSource = GLSL_EXTENSION(440, GL_ARB_shader_draw_parameters,
 
-in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+layout(location = 2) in vec2 textureCoordinate;
+
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+out vec2 vertexTextureCoordinate;
+flat out uint vertexMaterial; // Texture of the draw
+
+invariant gl_Position; // Must match the depth pre-pass exactly for the equal depth test
+
+// Data of every scene object, indexed by object
+struct DrawData
+{
+    mat4 model;
+    mat4 normalMatrix;
+    uvec4 material;
+    vec4 boundsCenter;
+    vec4 boundsExtent;
+};
+layout(std430, binding = 0) readonly buffer DrawDataBuffer
+{
+    DrawData draws[];
+};
+// Object drawn by each command, in draw order
+layout(std430, binding = 4) readonly buffer DrawRemapBuffer
+{
+    uint drawRemap[];
+};
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    uint objectIndex = drawRemap[gl_DrawIDARB];
+    mat4 model = draws[objectIndex].model;
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+
+    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+    vertexNormal = mat3(draws[objectIndex].normalMatrix) * normal; // Precomputed on the CPU
+    vertexTextureCoordinate = textureCoordinate;
+    vertexMaterial = draws[objectIndex].material.x;
+}
+);
+
+
+/* Objects Fragment Shader texture lookup - one texture per draw call*/
+const GLchar* objectTextureShaderSource = GLSL(440,
+
+uniform sampler2D uTexture; // Useful when working with multiple textures
+
+vec4 UObjectTexture(vec2 uv)
+{
+    return texture(uTexture, uv);
+}
+);
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+
+/* Objects Fragment Shader texture lookup - Multi-draw indirect*/
+const GLchar* indirectTextureShaderSource = GLSL(440,
+
+flat in uint vertexMaterial;
+uniform sampler2DArray uMaterials; // One layer per material; the layer may differ between invocations
+
+vec4 UObjectTexture(vec2 uv)
+{
+    return texture(uMaterials, vec3(uv, float(vertexMaterial)));
+}
+);
+
+
+/* Ambient light, shared by the Phong lighting below and the lightmapped shading, which adds it to the
+   baked lighting*/
+const GLchar* ambientShaderSource = GLSL_CHUNK(
+
+const float ambientStrength = 0.9f; // Ambient or global lighting strength
+);
+
+
+/* Lighting of the objects, shared by the forward and deferred paths. The forward fragment shader and the
+   deferred lighting pass append it to their inputs and call UPhong with the surface they have.*/
+const GLchar* lightingShaderSource = GLSL_CHUNK(
 
 // Uniform / Global variables for object color, light color, light position, and camera/view position
 uniform vec3 objectColor;
 uniform vec3 lightColor;
 uniform vec3 lightPos;
 uniform vec3 viewPosition;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform vec2 uvScale;
 
-void main()
+uniform sampler2DShadow uShadowAtlas; // Faces of the light, each in its own tile
+uniform mat4 shadowMatrices[6]; // World space to the atlas coordinates and depth of each face
+uniform vec2 shadowTexel; // Size of an atlas texel in texture coordinates
+uniform bool shadowsEnabled;
+
+// Point lights, and the lights reaching each cluster of the view frustum as offsets into clusterLights
+struct PointLight
+{
+    vec4 positionRadius;
+    vec4 color;
+};
+layout(std430, binding = 5) readonly buffer PointLightBuffer
+{
+    PointLight pointLights[];
+};
+layout(std430, binding = 6) readonly buffer ClusterBuffer
+{
+    uvec2 clusters[]; // Offset and count
+};
+layout(std430, binding = 7) readonly buffer ClusterLightBuffer
+{
+    uint clusterLights[];
+};
+uniform int pointLightCount;
+uniform vec2 clusterScale; // Tiles per pixel
+uniform ivec3 clusterGrid; // Columns, rows and slices
+uniform vec2 clusterSlicing; // Slice of the log of the view depth, as scale and bias
+uniform vec2 clusterDepthRange; // Near and far planes of the projection
+
+// Fraction of the light reaching a surface point. The face the light sees it through is the one along the
+// major axis of the direction from the light; 3x3 comparisons around it are averaged, each filtered bilinearly.
+float UShadow(vec3 surface, vec3 normal)
+{
+    if (!shadowsEnabled)
+        return 1.0;
+
+    vec3 fromLight = surface - lightPos;
+    vec3 axis = abs(fromLight);
+    int face = 0;
+    if (axis.x >= axis.y && axis.x >= axis.z)
+        face = fromLight.x > 0.0 ? 0 : 1;
+    else if (axis.y >= axis.z)
+        face = fromLight.y > 0.0 ? 2 : 3;
+    else
+        face = fromLight.z > 0.0 ? 4 : 5;
+
+    // Moved off the surface along its normal by about a texel, which grows with the distance to the light
+    vec3 position = surface + normal * (0.003 * length(fromLight));
+    vec4 coordinates = shadowMatrices[face] * vec4(position, 1.0);
+    coordinates.xyz /= coordinates.w;
+    if (coordinates.z >= 1.0)
+        return 1.0;
+
+    float lit = 0.0;
+    for (int y = -1; y <= 1; ++y)
+    {
+        for (int x = -1; x <= 1; ++x)
+            lit += texture(uShadowAtlas, vec3(coordinates.xy + vec2(x, y) * shadowTexel, coordinates.z));
+    }
+    return lit / 9.0;
+}
+
+// Diffuse and specular light of the point lights listed for the cluster of the current pixel, at window
+// depth windowDepth. Each light fades out smoothly at its radius, where the clusters stop listing it.
+vec3 UPointLights(vec3 surface, vec3 normal, vec3 viewDir, float windowDepth)
+{
+    if (pointLightCount == 0)
+        return vec3(0.0);
+
+    float depthNear = clusterDepthRange.x;
+    float depthFar = clusterDepthRange.y;
+    float depth = 2.0 * depthNear * depthFar / (depthFar + depthNear - (2.0 * windowDepth - 1.0) * (depthFar - depthNear));
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterScale), clusterGrid.xy - 1);
+    int slice = clamp(int(log(depth) * clusterSlicing.x + clusterSlicing.y), 0, clusterGrid.z - 1);
+    uvec2 cluster = clusters[(slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x];
+
+    vec3 light = vec3(0.0);
+    for (uint i = 0u; i < cluster.y; ++i)
+    {
+        PointLight pointLight = pointLights[clusterLights[cluster.x + i]];
+        vec3 toLight = pointLight.positionRadius.xyz - surface;
+        float distanceRatio = length(toLight) / pointLight.positionRadius.w;
+        float falloff = clamp(1.0 - distanceRatio * distanceRatio, 0.0, 1.0);
+        vec3 lightDirection = normalize(toLight);
+        float impact = max(dot(normal, lightDirection), 0.0);
+        float specularComponent = pow(max(dot(viewDir, reflect(-lightDirection, normal)), 0.0), 16.0);
+        light += falloff * falloff * (impact + 0.9 * specularComponent) * pointLight.color.rgb;
+    }
+    return light;
+}
+
+// Lit color of a surface point of the given albedo, with a unit normal
+vec3 UPhong(vec3 surface, vec3 norm, vec3 albedo, float windowDepth)
 {
     /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
 
     //Calculate Ambient lighting*/
-    float ambientStrength = 0.9f; // Set ambient or global lighting strength
     vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
 
     //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
+    vec3 lightDirection = normalize(lightPos - surface); // Calculate distance (light direction) between light source and fragments/pixels on cube
     float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
     vec3 diffuse = impact * lightColor; // Generate diffuse light color
 
     //Calculate Specular lighting*/
     float specularIntensity = 0.9f; // Set specular light strength
     float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
+    vec3 viewDir = normalize(viewPosition - surface); // Calculate view direction
     vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
     //Calculate specular component
     float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
     vec3 specular = specularIntensity * specularComponent * lightColor;
 
+    // Calculate phong result; shadows keep the direct light of the main light only
+    return (ambient + UShadow(surface, norm) * (diffuse + specular) + UPointLights(surface, norm, viewDir, windowDepth)) * albedo;
+}
+);
+
+
+/* Objects Fragment Shader Source Code, appended to one of the texture lookups above and the lighting*/
+const GLchar* pyramidFragmentShaderSource = GLSL_CHUNK(
+
+in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+in vec2 vertexTextureCoordinate;
+
+out vec4 fragmentColor; // For outgoing cube color to the GPU
+
+uniform vec2 uvScale;
+
+void main()
+{
     // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    vec4 textureColor = UObjectTexture(vertexTextureCoordinate * uvScale);
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+    vec3 phong = UPhong(vertexFragmentPos, normalize(vertexNormal), textureColor.xyz, gl_FragCoord.z);
 
     fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
 }
 );
 
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+/* Lightmapped Vertex Shader Source Code: immovable objects, with their second texture coordinates*/
+const GLchar* lightmapVertexShaderSource = GLSL(440,
 
-        //Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+layout(location = 0) in vec3 position;
+layout(location = 2) in vec2 textureCoordinate;
+layout(location = 3) in vec2 lightmapCoordinate;
+
+out vec2 vertexTextureCoordinate;
+out vec2 vertexLightmapCoordinate;
+
+invariant gl_Position; // Must match the depth pre-pass exactly for the equal depth test
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    gl_Position = projection * view * model * vec4(position, 1.0f);
+    vertexTextureCoordinate = textureCoordinate;
+    vertexLightmapCoordinate = lightmapCoordinate;
 }
 );
 
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+/* Lightmapped Fragment Shader Source Code, appended to the texture lookup of one texture per draw call.
+   The ambient light is the one of the Phong shader, from the shared chunk; the rest of the lighting comes
+   from the lightmap.*/
+const GLchar* lightmapFragmentShaderSource = GLSL_CHUNK(
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+in vec2 vertexTextureCoordinate;
+in vec2 vertexLightmapCoordinate;
+
+out vec4 fragmentColor;
+
+uniform vec3 lightColor;
+uniform vec2 uvScale;
+uniform sampler2D uLightmap;
+uniform float lightmapRange; // Lighting stored as 1 in the lightmap
 
 void main()
 {
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+    vec4 textureColor = UObjectTexture(vertexTextureCoordinate * uvScale);
+    vec3 baked = texture(uLightmap, vertexLightmapCoordinate).rgb * lightmapRange;
+
+    fragmentColor = vec4((ambientStrength * lightColor + baked) * textureColor.xyz, 1.0);
 }
 );
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
+
+/* Octahedral normal encoding of the G-buffer: the unit sphere is folded onto an octahedron, then flattened
+   onto a square, so two channels keep a normal at about the same precision everywhere.*/
+const GLchar* octahedralShaderSource = GLSL_CHUNK(
+
+// Unit normal to [0, 1] squared
+vec2 UEncodeNormal(vec3 normal)
 {
-    for (int j = 0; j < height / 2; ++j)
-    {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+    vec2 folded = normal.xy / (abs(normal.x) + abs(normal.y) + abs(normal.z));
+    if (normal.z < 0.0)
+        folded = (1.0 - abs(folded.yx)) * vec2(folded.x >= 0.0 ? 1.0 : -1.0, folded.y >= 0.0 ? 1.0 : -1.0);
+    return folded * 0.5 + 0.5;
+}
 
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
-    }
+vec3 UDecodeNormal(vec2 encoded)
+{
+    vec2 folded = encoded * 2.0 - 1.0;
+    vec3 normal = vec3(folded, 1.0 - abs(folded.x) - abs(folded.y));
+    float fold = max(-normal.z, 0.0);
+    normal.xy += vec2(normal.x >= 0.0 ? -fold : fold, normal.y >= 0.0 ? -fold : fold);
+    return normalize(normal);
 }
+);
 
 
-int main(int argc, char* argv[])
-{
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+/* G-buffer Fragment Shader Source Code, appended to one of the texture lookups above and the octahedral
+   encoding. Depth is the only position kept; the lighting pass rebuilds the rest from it.*/
+const GLchar* gbufferFragmentShaderSource = GLSL_CHUNK(
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+in vec3 vertexNormal;
+in vec3 vertexFragmentPos;
+in vec2 vertexTextureCoordinate;
 
-    // Create the shader program
-    if (!UCreateShaderProgram(pyramidVertexShaderSource, pyramidFragmentShaderSource, gObjectsProgramId))
-        return EXIT_FAILURE;
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
+layout(location = 0) out vec4 gbufferAlbedo;
+layout(location = 1) out vec2 gbufferNormal;
 
-    // Load texture
-    const char* texFilename = "resources/textures/pencilBody.jpg";
-    if (!UCreateTexture(texFilename, gTextureIdBody))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    texFilename = "resources/textures/penNib.png";
-    if (!UCreateTexture(texFilename, gTextureIdHead))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    texFilename = "resources/textures/Scene.png";
-    if (!UCreateTexture(texFilename, gTextureIdPlane))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    texFilename = "resources/textures/keyboard.png";
-    if (!UCreateTexture(texFilename, gTextureIdKeyboard))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    texFilename = "resources/textures/brownPaper.jpg";
-    if (!UCreateTexture(texFilename, gTextureIdPaper))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    texFilename = "resources/textures/book.jpg";
-    if (!UCreateTexture(texFilename, gTextureIdNotebook))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+uniform vec2 uvScale;
 
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gObjectsProgramId);
-    // We set the texture as texture unit 0
+void main()
+{
+    gbufferAlbedo = vec4(UObjectTexture(vertexTextureCoordinate * uvScale).rgb, 1.0);
+    gbufferNormal = UEncodeNormal(normalize(vertexNormal));
+}
+);
+
+
+/* Deferred Lighting Fragment Shader inputs, followed by the octahedral encoding, the lighting and the pass*/
+const GLchar* deferredInputShaderSource = GLSL(440,
+
+uniform sampler2D uAlbedo;
+uniform sampler2D uNormal;
+uniform sampler2D uDepth;
+uniform vec2 drawnSize; // Pixels of the scene target drawn this frame
+uniform mat4 inverseViewProjection;
+);
+
+
+/* Deferred Lighting Fragment Shader Source Code: a fullscreen pass lighting each pixel of the G-buffer once*/
+const GLchar* deferredLightingFragmentShaderSource = GLSL_CHUNK(
+
+out vec4 fragmentColor;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(uDepth, texel, 0).r;
+    if (depth == 1.0)
+        discard; // Nothing drawn; the background stays as cleared
+
+    vec4 surface = inverseViewProjection * vec4(gl_FragCoord.xy / drawnSize * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 albedo = texelFetch(uAlbedo, texel, 0).rgb;
+    vec3 normal = UDecodeNormal(texelFetch(uNormal, texel, 0).rg);
+
+    fragmentColor = vec4(UPhong(surface.xyz / surface.w, normal, albedo, depth), 1.0);
+}
+);
+
+/* Depth Pre-pass Vertex Shader Source Code*/
+const GLchar* depthVertexShaderSource = GLSL(440,
+
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+invariant gl_Position; // Same clip coordinates as the objects shader, bit for bit
+
+//Uniform / Global variables for the  transform matrices
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Same expression as the objects shader
+}
+);
+
+
+/* Depth Pre-pass Fragment Shader Source Code*/
+const GLchar* depthFragmentShaderSource = GLSL(440,
+
+void main()
+{
+    // Only depth is written
+}
+);
+
+/* Depth Pre-pass Vertex Shader Source Code - Multi-draw indirect*/
+const GLchar* indirectDepthVertexShaderSource = GLSL_EXTENSION(440, GL_ARB_shader_draw_parameters,
+
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+invariant gl_Position; // Same clip coordinates as the indirect objects shader, bit for bit
+
+struct DrawData
+{
+    mat4 model;
+    mat4 normalMatrix;
+    uvec4 material;
+    vec4 boundsCenter;
+    vec4 boundsExtent;
+};
+layout(std430, binding = 0) readonly buffer DrawDataBuffer
+{
+    DrawData draws[];
+};
+// Object drawn by each command, in draw order
+layout(std430, binding = 4) readonly buffer DrawRemapBuffer
+{
+    uint drawRemap[];
+};
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    mat4 model = draws[drawRemap[gl_DrawIDARB]].model;
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Same expression as the indirect objects shader
+}
+);
+
+/* GPU Culling Compute Shader Source Code*/
+const GLchar* cullComputeShaderSource = GLSL(440,
+
+layout(local_size_x = 64) in;
+
+struct DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+// Data of every scene object, as in the indirect shaders; only the box is read
+struct DrawData
+{
+    mat4 model;
+    mat4 normalMatrix;
+    uvec4 material;
+    vec4 boundsCenter;
+    vec4 boundsExtent;
+};
+layout(std430, binding = 0) readonly buffer DrawDataBuffer
+{
+    DrawData draws[];
+};
+// Commands in draw order, tested in place
+layout(std430, binding = 2) buffer DrawCommandBuffer
+{
+    DrawCommand commands[];
+};
+layout(std430, binding = 3) buffer DrawCountBuffer
+{
+    uint drawCount;     // Read by glMultiDrawElementsIndirectCountARB
+    uint visibleCount;  // Read back for the frame counters
+};
+// Object drawn by each command, in draw order
+layout(std430, binding = 4) readonly buffer DrawRemapBuffer
+{
+    uint drawRemap[];
+};
+
+uniform vec4 frustumPlanes[6]; // Same planes as UExtractFrustum, inside where positive
+uniform vec3 cameraPosition;
+uniform float maxDistance;
+uniform uint commandCount;
+
+bool UVisible(vec3 center, vec3 extent)
+{
+    // Box against each plane, as UBoxInFrustum
+    for (int plane = 0; plane < 6; ++plane)
+    {
+        vec4 p = frustumPlanes[plane];
+        if (dot(p.xyz, center) + p.w + dot(abs(p.xyz), extent) < 0.0)
+            return false;
+    }
+
+    // Distance from the camera to the nearest point of the box
+    vec3 outside = max(abs(cameraPosition - center) - extent, vec3(0.0));
+    return dot(outside, outside) <= maxDistance * maxDistance;
+}
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= commandCount)
+        return;
+
+    uint object = drawRemap[i];
+    if (!UVisible(draws[object].boundsCenter.xyz, draws[object].boundsExtent.xyz))
+    {
+        commands[i].instanceCount = 0u;
+        return;
+    }
+
+    // Each command keeps its own slot, so the front-to-back order of the CPU sort survives. The count only
+    // trims the slots after the last visible one; culled slots before it have instanceCount 0.
+    atomicMax(drawCount, i + 1u);
+    atomicAdd(visibleCount, 1u);
+}
+);
+
+
+/* Lamp Shader Source Code*/
+const GLchar* lampVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+        //Uniform / Global variables for the  transform matrices
+    uniform mat4 model;
+    uniform mat4 view;
+    uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+}
+);
+
+
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+
+void main()
+{
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+}
+);
+
+/* Fullscreen Pass Vertex Shader Source Code*/
+const GLchar* fullscreenVertexShaderSource = GLSL(440,
+
+    out vec2 screenUV;
+
+void main()
+{
+    // One triangle covering the screen, made from the vertex index alone
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    screenUV = corner;
+    gl_Position = vec4(corner * 2.0f - 1.0f, 0.0f, 1.0f);
+}
+);
+
+
+/* Upscale Fragment Shader Source Code*/
+const GLchar* upscaleFragmentShaderSource = GLSL(440,
+
+    in vec2 screenUV;
+    out vec4 fragmentColor;
+
+    uniform sampler2D uScene;
+    uniform vec2 uvScale;       // Part of the target the scene was drawn into
+    uniform vec2 uvMax;         // Last texel centers of that part, so filtering never reads beyond it
+    uniform vec2 texelSize;
+    uniform float sharpness;    // 0 for a plain bilinear upscale
+
+void main()
+{
+    vec2 uv = min(screenUV * uvScale, uvMax);
+    vec3 center = texture(uScene, uv).rgb;
+
+    if (sharpness > 0.0f)
+    {
+        // Unsharp mask against the four neighbors, kept within their range so edges do not ring
+        vec3 left = texture(uScene, uv - vec2(texelSize.x, 0.0f)).rgb;
+        vec3 right = texture(uScene, min(uv + vec2(texelSize.x, 0.0f), uvMax)).rgb;
+        vec3 down = texture(uScene, uv - vec2(0.0f, texelSize.y)).rgb;
+        vec3 up = texture(uScene, min(uv + vec2(0.0f, texelSize.y), uvMax)).rgb;
+
+        vec3 low = min(center, min(min(left, right), min(down, up)));
+        vec3 high = max(center, max(max(left, right), max(down, up)));
+        center = clamp(center + sharpness * (4.0f * center - left - right - down - up), low, high);
+    }
+
+    fragmentColor = vec4(center, 1.0f);
+}
+);
+
+/* FXAA Fragment Shader Source Code*/
+const GLchar* fxaaFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor;
+
+    uniform sampler2D uScene;
+    uniform vec2 uvMax;         // Last texel centers of the drawn part of the scene
+    uniform vec2 texelSize;
+
+    const float EDGE_THRESHOLD_MIN = 0.0312f;   // Contrast below which nothing is done, in dark areas
+    const float EDGE_THRESHOLD_MAX = 0.125f;    // and relative to the brightest neighbor elsewhere
+    const float SUBPIXEL_QUALITY = 0.75f;
+    const int SEARCH_STEPS = 10;
+    const float SEARCH_STEP_SIZES[SEARCH_STEPS] = float[](1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.5f, 2.0f, 2.0f, 4.0f, 8.0f);
+
+vec3 sceneColor(vec2 uv)
+{
+    return texture(uScene, min(uv, uvMax)).rgb;
+}
+
+float luma(vec3 color)
+{
+    return sqrt(dot(color, vec3(0.299f, 0.587f, 0.114f)));
+}
+
+float lumaAt(vec2 uv)
+{
+    return luma(sceneColor(uv));
+}
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy * texelSize;
+    vec3 center = sceneColor(uv);
+
+    float lumaCenter = luma(center);
+    float lumaDown = lumaAt(uv + vec2(0.0f, -texelSize.y));
+    float lumaUp = lumaAt(uv + vec2(0.0f, texelSize.y));
+    float lumaLeft = lumaAt(uv + vec2(-texelSize.x, 0.0f));
+    float lumaRight = lumaAt(uv + vec2(texelSize.x, 0.0f));
+
+    float lumaMin = min(lumaCenter, min(min(lumaDown, lumaUp), min(lumaLeft, lumaRight)));
+    float lumaMax = max(lumaCenter, max(max(lumaDown, lumaUp), max(lumaLeft, lumaRight)));
+    float lumaRange = lumaMax - lumaMin;
+    if (lumaRange < max(EDGE_THRESHOLD_MIN, lumaMax * EDGE_THRESHOLD_MAX))
+    {
+        fragmentColor = vec4(center, 1.0f);
+        return;
+    }
+
+    float lumaDownLeft = lumaAt(uv - texelSize);
+    float lumaUpRight = lumaAt(uv + texelSize);
+    float lumaUpLeft = lumaAt(uv + vec2(-texelSize.x, texelSize.y));
+    float lumaDownRight = lumaAt(uv + vec2(texelSize.x, -texelSize.y));
+
+    float lumaDownUp = lumaDown + lumaUp;
+    float lumaLeftRight = lumaLeft + lumaRight;
+    float lumaLeftCorners = lumaDownLeft + lumaUpLeft;
+    float lumaDownCorners = lumaDownLeft + lumaDownRight;
+    float lumaRightCorners = lumaDownRight + lumaUpRight;
+    float lumaUpCorners = lumaUpRight + lumaUpLeft;
+
+    // Whether the edge runs horizontally or vertically, from the luma gradients in both directions
+    float edgeHorizontal = abs(-2.0f * lumaLeft + lumaLeftCorners) + abs(-2.0f * lumaCenter + lumaDownUp) * 2.0f + abs(-2.0f * lumaRight + lumaRightCorners);
+    float edgeVertical = abs(-2.0f * lumaUp + lumaUpCorners) + abs(-2.0f * lumaCenter + lumaLeftRight) * 2.0f + abs(-2.0f * lumaDown + lumaDownCorners);
+    bool horizontal = edgeHorizontal >= edgeVertical;
+
+    // The edge lies on the side of the texel where the luma changes most
+    float luma1 = horizontal ? lumaDown : lumaLeft;
+    float luma2 = horizontal ? lumaUp : lumaRight;
+    float gradient1 = luma1 - lumaCenter;
+    float gradient2 = luma2 - lumaCenter;
+    bool steepest1 = abs(gradient1) >= abs(gradient2);
+    float gradientScaled = 0.25f * max(abs(gradient1), abs(gradient2));
+
+    float stepLength = horizontal ? texelSize.y : texelSize.x;
+    float lumaLocalAverage = 0.5f * (luma2 + lumaCenter);
+    if (steepest1)
+    {
+        stepLength = -stepLength;
+        lumaLocalAverage = 0.5f * (luma1 + lumaCenter);
+    }
+
+    // Walks both ways along the edge, half a texel off the center, until the luma leaves the edge's average
+    vec2 edgeUV = uv;
+    if (horizontal)
+        edgeUV.y += stepLength * 0.5f;
+    else
+        edgeUV.x += stepLength * 0.5f;
+
+    vec2 offset = horizontal ? vec2(texelSize.x, 0.0f) : vec2(0.0f, texelSize.y);
+    vec2 uv1 = edgeUV - offset;
+    vec2 uv2 = edgeUV + offset;
+    float lumaEnd1 = lumaAt(uv1) - lumaLocalAverage;
+    float lumaEnd2 = lumaAt(uv2) - lumaLocalAverage;
+    bool reached1 = abs(lumaEnd1) >= gradientScaled;
+    bool reached2 = abs(lumaEnd2) >= gradientScaled;
+
+    for (int i = 1; i < SEARCH_STEPS && !(reached1 && reached2); ++i)
+    {
+        if (!reached1)
+        {
+            uv1 -= offset * SEARCH_STEP_SIZES[i];
+            lumaEnd1 = lumaAt(uv1) - lumaLocalAverage;
+            reached1 = abs(lumaEnd1) >= gradientScaled;
+        }
+        if (!reached2)
+        {
+            uv2 += offset * SEARCH_STEP_SIZES[i];
+            lumaEnd2 = lumaAt(uv2) - lumaLocalAverage;
+            reached2 = abs(lumaEnd2) >= gradientScaled;
+        }
+    }
+
+    // Texels near an end of the edge are shifted across it the most, if the end bends the right way
+    float distance1 = horizontal ? uv.x - uv1.x : uv.y - uv1.y;
+    float distance2 = horizontal ? uv2.x - uv.x : uv2.y - uv.y;
+    bool nearer1 = distance1 < distance2;
+    float edgeLength = distance1 + distance2;
+    bool centerDarker = lumaCenter < lumaLocalAverage;
+    bool bendsAway = ((nearer1 ? lumaEnd1 : lumaEnd2) < 0.0f) != centerDarker;
+    float edgeOffset = bendsAway ? 0.5f - min(distance1, distance2) / edgeLength : 0.0f;
+
+    // A texel standing out from all its neighbors is thinner than a pixel and gets blended regardless
+    float lumaAverage = (1.0f / 12.0f) * (2.0f * (lumaDownUp + lumaLeftRight) + lumaLeftCorners + lumaRightCorners);
+    float subPixel = clamp(abs(lumaAverage - lumaCenter) / lumaRange, 0.0f, 1.0f);
+    subPixel = (-2.0f * subPixel + 3.0f) * subPixel * subPixel;
+    float subPixelOffset = subPixel * subPixel * SUBPIXEL_QUALITY;
+
+    vec2 finalUV = uv;
+    if (horizontal)
+        finalUV.y += max(edgeOffset, subPixelOffset) * stepLength;
+    else
+        finalUV.x += max(edgeOffset, subPixelOffset) * stepLength;
+    fragmentColor = vec4(sceneColor(finalUV), 1.0f);
+}
+);
+
+
+/* SMAA Edge Detection Fragment Shader Source Code*/
+const GLchar* smaaEdgesFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentEdges;     // Edge with the texel on the left in r, with the texel below in g
+
+    uniform sampler2D uScene;
+    uniform ivec2 drawnSize;
+
+    const float THRESHOLD = 0.1f;
+    const float LOCAL_CONTRAST_FACTOR = 2.0f;
+
+float lumaAt(ivec2 texel)
+{
+    texel = clamp(texel, ivec2(0), drawnSize - 1);
+    return dot(texelFetch(uScene, texel, 0).rgb, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float luma = lumaAt(texel);
+    float lumaLeft = lumaAt(texel + ivec2(-1, 0));
+    float lumaDown = lumaAt(texel + ivec2(0, -1));
+
+    vec2 delta = abs(luma - vec2(lumaLeft, lumaDown));
+    vec2 edges = step(THRESHOLD, delta);
+
+    // An edge much weaker than the ones next to it is a gradient within a contrasted area, not an edge
+    vec2 deltaNext = abs(luma - vec2(lumaAt(texel + ivec2(1, 0)), lumaAt(texel + ivec2(0, 1))));
+    vec2 deltaFar = abs(vec2(lumaLeft, lumaDown) - vec2(lumaAt(texel + ivec2(-2, 0)), lumaAt(texel + ivec2(0, -2))));
+    vec2 maxDelta = max(delta, max(deltaNext, deltaFar));
+    edges *= step(max(maxDelta.x, maxDelta.y), LOCAL_CONTRAST_FACTOR * delta);
+
+    fragmentEdges = vec4(edges, 0.0f, 0.0f);
+}
+);
+
+
+/* SMAA Blending Weight Fragment Shader Source Code*/
+const GLchar* smaaWeightsFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentWeights;   // Blending across the edge below in rg, across the edge on the left in ba
+
+    uniform sampler2D uEdges;
+    uniform ivec2 drawnSize;
+
+    const int MAX_SEARCH = 16;  // Texels searched each way along an edge
+
+float edgeAt(ivec2 texel, int channel)
+{
+    if (any(lessThan(texel, ivec2(0))) || any(greaterThanEqual(texel, drawnSize)))
+        return 0.0f;
+    return texelFetch(uEdges, texel, 0)[channel];
+}
+
+// Area of the texel covered by the other side of the edge (x), and of the texel across by this side (y).
+// The edge is followed both ways to its ends; an edge crossing an end on this side or the other one makes
+// the silhouette leave the edge there, and the silhouette is rebuilt as lines from half a texel off each
+// end to the middle of the edge.
+vec2 edgeWeights(ivec2 texel, ivec2 along, ivec2 across, int channel)
+{
+    int crossing = 1 - channel;
+
+    int back = 0;
+    while (back < MAX_SEARCH && edgeAt(texel - along * (back + 1), channel) > 0.5f)
+        ++back;
+    int forward = 0;
+    while (forward < MAX_SEARCH && edgeAt(texel + along * (forward + 1), channel) > 0.5f)
+        ++forward;
+
+    // +1 when the crossing edge is on this side, -1 on the other one, 0 for none or both
+    ivec2 first = texel - along * back;
+    ivec2 pastLast = texel + along * (forward + 1);
+    float side1 = back < MAX_SEARCH ? edgeAt(first, crossing) - edgeAt(first + across, crossing) : 0.0f;
+    float side2 = forward < MAX_SEARCH ? edgeAt(pastLast, crossing) - edgeAt(pastLast + across, crossing) : 0.0f;
+
+    // The texel spans [start, start + 1] of the edge's [0, edgeLength]
+    float edgeLength = float(back + forward + 1);
+    float middle = 0.5f * edgeLength;
+    float start = float(back);
+    vec2 weights = vec2(0.0f);
+
+    float a = start;
+    float b = min(start + 1.0f, middle);
+    if (b > a)
+    {
+        float area = (b - a) * 0.5f * side1 * (1.0f - (a + b) / edgeLength);
+        weights += vec2(max(area, 0.0f), max(-area, 0.0f));
+    }
+    a = max(start, middle);
+    b = start + 1.0f;
+    if (b > a)
+    {
+        float area = (b - a) * 0.5f * side2 * ((a + b) / edgeLength - 1.0f);
+        weights += vec2(max(area, 0.0f), max(-area, 0.0f));
+    }
+    return weights;
+}
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    vec2 edges = texelFetch(uEdges, texel, 0).rg;
+
+    vec4 weights = vec4(0.0f);
+    if (edges.g > 0.5f)
+        weights.rg = edgeWeights(texel, ivec2(1, 0), ivec2(0, -1), 1);
+    if (edges.r > 0.5f)
+        weights.ba = edgeWeights(texel, ivec2(0, 1), ivec2(-1, 0), 0);
+    fragmentWeights = weights;
+}
+);
+
+
+/* SMAA Neighborhood Blending Fragment Shader Source Code*/
+const GLchar* smaaBlendFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor;
+
+    uniform sampler2D uScene;
+    uniform sampler2D uWeights;
+    uniform ivec2 drawnSize;
+
+vec4 weightsAt(ivec2 texel)
+{
+    if (any(greaterThanEqual(texel, drawnSize)))
+        return vec4(0.0f);
+    return texelFetch(uWeights, texel, 0);
+}
+
+vec3 sceneAt(ivec2 texel)
+{
+    return texelFetch(uScene, clamp(texel, ivec2(0), drawnSize - 1), 0).rgb;
+}
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    vec4 weights = weightsAt(texel);
+    float fromBelow = weights.r;
+    float fromLeft = weights.b;
+    float fromAbove = weightsAt(texel + ivec2(0, 1)).g;
+    float fromRight = weightsAt(texel + ivec2(1, 0)).a;
+
+    // Blends with the neighbors across the stronger pair of edges
+    vec3 color = sceneAt(texel);
+    if (max(fromLeft, fromRight) > max(fromBelow, fromAbove))
+        color = color * (1.0f - fromLeft - fromRight) + sceneAt(texel + ivec2(-1, 0)) * fromLeft + sceneAt(texel + ivec2(1, 0)) * fromRight;
+    else
+        color = color * (1.0f - fromBelow - fromAbove) + sceneAt(texel + ivec2(0, -1)) * fromBelow + sceneAt(texel + ivec2(0, 1)) * fromAbove;
+    fragmentColor = vec4(color, 1.0f);
+}
+);
+
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    for (int j = 0; j < height / 2; ++j)
+    {
+        int index1 = j * width * channels;
+        int index2 = (height - 1 - j) * width * channels;
+
+        for (int i = width * channels; i > 0; --i)
+        {
+            unsigned char tmp = image[index1];
+            image[index1] = image[index2];
+            image[index2] = tmp;
+            ++index1;
+            ++index2;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    gOptions.parse(argc, argv, OPTIONS_FILE);
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+
+    // Frame pacing: --fps 0 uncaps the frame rate and leaves it to --vsync. Vsync is off by default while
+    // the pacer caps the rate, since the display's clock and the pacer's would beat against each other.
+    gFramePacer.setTargetFps(gOptions.getNumber("fps", DEFAULT_TARGET_FPS));
+    gFramePacer.setLowLatency(gOptions.getBool("low-latency", false));
+    glfwSwapInterval(gOptions.getBool("vsync", gFramePacer.targetFps() <= 0.0) ? 1 : 0);
+
+    // Anti-aliasing: --aa none, msaa, fxaa or smaa, with --msaa-samples per pixel under MSAA
+    const std::string antiAliasing = gOptions.getString("aa", AA_MODE_NAMES[AA_NONE]);
+    for (int mode = 0; mode < AA_MODE_COUNT; ++mode)
+    {
+        if (antiAliasing == AA_MODE_NAMES[mode])
+            gAntiAliasing = (AntiAliasing)mode;
+    }
+    if (antiAliasing != AA_MODE_NAMES[gAntiAliasing])
+        cout << "Unknown anti-aliasing " << antiAliasing << ", using " << AA_MODE_NAMES[gAntiAliasing] << endl;
+
+    // Shading: --shading forward, deferred or lightmapped
+    const std::string shading = gOptions.getString("shading", SHADING_MODE_NAMES[SHADING_FORWARD]);
+    for (int mode = 0; mode < SHADING_MODE_COUNT; ++mode)
+    {
+        if (shading == SHADING_MODE_NAMES[mode])
+            gShading = (Shading)mode;
+    }
+    if (shading != SHADING_MODE_NAMES[gShading])
+        cout << "Unknown shading " << shading << ", using " << SHADING_MODE_NAMES[gShading] << endl;
+
+    GLint maxSamples = 0;
+    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+    gMsaaSamples = std::min(std::max((int)gOptions.getNumber("msaa-samples", gMsaaSamples), 2), (int)maxSamples);
+
+    // Render targets start at the framebuffer size, which on high-DPI displays exceeds the window size
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(gWindow, &framebufferWidth, &framebufferHeight);
+    gFramebuffer.resize(framebufferWidth, framebufferHeight, glfwGetTime());
+    UUpdateRenderTargets(glfwGetTime());
+
+    // Create the mesh
+    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+    UCreateScene();
+
+    // Create the shader program
+    if (!UCreateShaderProgram({ pyramidVertexShaderSource }, { objectTextureShaderSource, ambientShaderSource, lightingShaderSource, pyramidFragmentShaderSource }, gObjectsProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram({ pyramidVertexShaderSource }, { objectTextureShaderSource, octahedralShaderSource, gbufferFragmentShaderSource }, gGBufferProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram({ fullscreenVertexShaderSource }, { deferredInputShaderSource, octahedralShaderSource, ambientShaderSource, lightingShaderSource, deferredLightingFragmentShaderSource }, gDeferredLightingProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram({ lightmapVertexShaderSource }, { objectTextureShaderSource, ambientShaderSource, lightmapFragmentShaderSource }, gLightmapProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(depthVertexShaderSource, depthFragmentShaderSource, gDepthProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, upscaleFragmentShaderSource, gUpscaleProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, fxaaFragmentShaderSource, gFxaaProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, smaaEdgesFragmentShaderSource, gSmaaEdgesProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, smaaWeightsFragmentShaderSource, gSmaaWeightsProgramId))
+        return EXIT_FAILURE;
+    if (!UCreateShaderProgram(fullscreenVertexShaderSource, smaaBlendFragmentShaderSource, gSmaaBlendProgramId))
+        return EXIT_FAILURE;
+
+    // Dynamic resolution: by default the GPU gets most of a frame period, leaving room for the upscale
+    // and the swap; the scale never drops below resolution-min
+    const double targetFps = gFramePacer.targetFps() > 0.0 ? gFramePacer.targetFps() : DEFAULT_TARGET_FPS;
+    gDynamicResolution = gOptions.getBool("dynamic-resolution", true);
+    gResolution.setBudget(gOptions.getNumber("gpu-budget", 850.0 / targetFps) / 1000.0);
+    gResolution.setRange((float)gOptions.getNumber("resolution-min", 0.5), 1.0f);
+    gSharpenUpscale = gOptions.getString("upscale", "sharpen") != "bilinear";
+    gUpscaleSharpness = (float)gOptions.getNumber("sharpness", gUpscaleSharpness);
+
+    glGenVertexArrays(1, &gFullscreenVao);
+    UCreateGpuTimer(gSceneTimer);
+    UCreateGpuTimer(gAntiAliasingTimer);
+
+    // The blending pass of SMAA reads the scene and the blend weights from units 0 and 1
+    glUseProgram(gSmaaBlendProgramId);
+    glUniform1i(glGetUniformLocation(gSmaaBlendProgramId, "uWeights"), 1);
+
+    // Multi-draw indirect path, used by default where gl_DrawIDARB is available and every material fits
+    // in a layer of the material array
+    GLint maxMaterialLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxMaterialLayers);
+    gIndirectDrawSupported = GLEW_ARB_shader_draw_parameters && gMaterialTextures.size() <= (size_t)maxMaterialLayers;
+    if (GLEW_ARB_shader_draw_parameters && !gIndirectDrawSupported)
+        cout << "The scene uses more textures than a texture array holds; multi-draw indirect is disabled" << endl;
+    if (gIndirectDrawSupported)
+    {
+        if (!UCreateShaderProgram({ indirectVertexShaderSource }, { indirectTextureShaderSource, ambientShaderSource, lightingShaderSource, pyramidFragmentShaderSource }, gIndirectProgramId))
+            return EXIT_FAILURE;
+        if (!UCreateShaderProgram({ indirectVertexShaderSource }, { indirectTextureShaderSource, octahedralShaderSource, gbufferFragmentShaderSource }, gIndirectGBufferProgramId))
+            return EXIT_FAILURE;
+        if (!UCreateShaderProgram(indirectDepthVertexShaderSource, depthFragmentShaderSource, gIndirectDepthProgramId))
+            return EXIT_FAILURE;
+
+        glGenBuffers(1, &gIndirectBuffer);
+        glGenBuffers(1, &gDrawRemapBuffer);
+        UCreateDrawDataBuffer();
+        gIndirectDraw = true;
+
+        // GPU culling feeds the indirect path; without the draw count extension the unused commands are zeroed instead
+        if (!UCreateComputeProgram(cullComputeShaderSource, gCullProgramId))
+            return EXIT_FAILURE;
+        glGenBuffers(1, &gDrawCountBuffer);
+        glGenBuffers(1, &gDrawCountReadback);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, gDrawCountReadback);
+        glBufferData(GL_COPY_WRITE_BUFFER, 2 * sizeof(GLuint), nullptr, GL_STREAM_READ);
+        gDrawCountSupported = GLEW_ARB_indirect_parameters;
+    }
+
+    // Load texture
+    const char* texFilename = "resources/textures/pencilBody.jpg";
+    if (!UCreateTexture(texFilename, gTextureIdBody))
+    {
+        cout << "Failed to load texture " << texFilename << endl;
+        return EXIT_FAILURE;
+    }
+    texFilename = "resources/textures/penNib.png";
+    if (!UCreateTexture(texFilename, gTextureIdHead))
+    {
+        cout << "Failed to load texture " << texFilename << endl;
+        return EXIT_FAILURE;
+    }
+    texFilename = "resources/textures/Scene.png";
+    if (!UCreateTexture(texFilename, gTextureIdPlane))
+    {
+        cout << "Failed to load texture " << texFilename << endl;
+        return EXIT_FAILURE;
+    }
+    texFilename = "resources/textures/keyboard.png";
+    if (!UCreateTexture(texFilename, gTextureIdKeyboard))
+    {
+        cout << "Failed to load texture " << texFilename << endl;
+        return EXIT_FAILURE;
+    }
+    texFilename = "resources/textures/brownPaper.jpg";
+    if (!UCreateTexture(texFilename, gTextureIdPaper))
+    {
+        cout << "Failed to load texture " << texFilename << endl;
+        return EXIT_FAILURE;
+    }
+    texFilename = "resources/textures/book.jpg";
+    if (!UCreateTexture(texFilename, gTextureIdNotebook))
+    {
+        cout << "Failed to load texture " << texFilename << endl;
+        return EXIT_FAILURE;
+    }
+
+    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
+    glUseProgram(gObjectsProgramId);
+    // We set the texture as texture unit 0
     glUniform1i(glGetUniformLocation(gObjectsProgramId, "bodyTexture"), 0);
     glUniform1i(glGetUniformLocation(gObjectsProgramId, "headTexture"), 1);
     glUniform1i(glGetUniformLocation(gObjectsProgramId, "planeTexture"), 2);
@@ -290,424 +1784,2948 @@ int main(int argc, char* argv[])
     glUniform1i(glGetUniformLocation(gObjectsProgramId, "brownPaperTexture"), 4);
     glUniform1i(glGetUniformLocation(gObjectsProgramId, "notebookTexture"), 4);
 
+    // The indirect path reads every material from the layers of one array on unit 0
+    if (gIndirectDrawSupported)
+    {
+        UCreateMaterialArray();
+        glUseProgram(gIndirectProgramId);
+        glUniform1i(glGetUniformLocation(gIndirectProgramId, "uMaterials"), 0);
+        glUniform1i(glGetUniformLocation(gIndirectProgramId, "uShadowAtlas"), SHADOW_TEXTURE_UNIT);
+        glUseProgram(gIndirectGBufferProgramId);
+        glUniform1i(glGetUniformLocation(gIndirectGBufferProgramId, "uMaterials"), 0);
+    }
+
+    // The lighting pass reads the G-buffer from units 0 to 2, and the shadows from their usual unit
+    glUseProgram(gDeferredLightingProgramId);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "uAlbedo"), 0);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "uNormal"), 1);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "uDepth"), 2);
+    glUniform1i(glGetUniformLocation(gDeferredLightingProgramId, "uShadowAtlas"), SHADOW_TEXTURE_UNIT);
+
+    // The lightmapped objects read their material from unit 0 and the lightmap from a unit of its own
+    glUseProgram(gLightmapProgramId);
+    glUniform1i(glGetUniformLocation(gLightmapProgramId, "uTexture"), 0);
+    glUniform1i(glGetUniformLocation(gLightmapProgramId, "uLightmap"), LIGHTMAP_TEXTURE_UNIT);
+    glUniform1f(glGetUniformLocation(gLightmapProgramId, "lightmapRange"), LIGHTMAP_RANGE);
+
+    // Shadows: --shadows off leaves the light unshadowed, --shadow-map-size sets the texels per face
+    gShadows = gOptions.getBool("shadows", true);
+    gShadowTileSize = (int)gOptions.getNumber("shadow-map-size", gShadowTileSize);
+    UCreateShadowAtlas();
+    glUseProgram(gObjectsProgramId);
+    glUniform1i(glGetUniformLocation(gObjectsProgramId, "uShadowAtlas"), SHADOW_TEXTURE_UNIT);
+
+    // Clustered lights: --lights scatters that many point lights over the desk, reaching --light-radius
+    glGenBuffers(1, &gPointLightBuffer);
+    glGenBuffers(1, &gClusterBuffer);
+    glGenBuffers(1, &gClusterLightBuffer);
+    gPointLightRadius = (float)gOptions.getNumber("light-radius", gPointLightRadius);
+    gStaticBatching = gOptions.getBool("static-batching", gStaticBatching);
+    UScatterPointLights((unsigned int)std::max(gOptions.getNumber("lights", 0), 0.0));
+
+
+    // Sets the background color of the window to black (it will be implicitely used by glClear)
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    // Lightmaps: --lightmap names the file of the baked lighting, --lightmap-size its texels per side.
+    // --bake-lightmaps bakes it again, with --lightmap-samples paths per texel bouncing --lightmap-bounces
+    // times, and exits. Lightmapped shading only loads the file, and falls back to forward shading when the
+    // file is missing or was baked from other inputs.
+    gLightmapSize = std::max((int)gOptions.getNumber("lightmap-size", gLightmapSize), 16);
+    const bool bakeLightmaps = gOptions.getBool("bake-lightmaps", false);
+    if (gShading == SHADING_LIGHTMAPPED && !bakeLightmaps && !UCreateLightmaps(false))
+        gShading = SHADING_FORWARD;
+
+    // Batch mode renders the poses of a file to images and exits instead of entering the render loop.
+    // --check-gpu-culling compares the GPU culling pass with the CPU tests and exits, --check-capture
+    // runs frames through the capture path and exits.
+    const std::string batchPoses = gOptions.getString("batch", "");
+    const bool checkGpuCulling = gOptions.getBool("check-gpu-culling", false);
+    const bool checkCapture = gOptions.getBool("check-capture", false);
+    const bool interactive = batchPoses.empty() && !bakeLightmaps && !checkGpuCulling && !checkCapture;
+    bool succeeded = true;
+    if (bakeLightmaps)
+        succeeded = UCreateLightmaps(true);
+    else if (checkGpuCulling)
+        succeeded = UCheckGpuCulling();
+    else if (checkCapture)
+        succeeded = UCheckCapture();
+    else if (!interactive)
+        succeeded = URunBatch(batchPoses);
+
+    // render loop
+    // -----------
+    if (interactive)
+    {
+        // Capture buffers are ready before the first capture, which then costs no allocation
+        gCapturePrefix = gOptions.getString("capture-prefix", gCapturePrefix);
+        gCapture.onReady = UEncodeCapture;
+        UCreateReadback(gCapture, gFramebuffer.width(), gFramebuffer.height());
+
+        // A stream that was asked for and could not be opened ends the program, as in batch mode
+        succeeded = UStartStream(gFramebuffer.width(), gFramebuffer.height(), false);
+        if (succeeded)
+            UStartUpdateThread();
+    }
+    const int exitCode = succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+    while (interactive && succeeded && !glfwWindowShouldClose(gWindow))
+    {
+        // Sleeps until this frame is due, so events are polled and input sampled right before rendering
+        gFramePacer.waitForFrame();
+        glfwPollEvents();
+
+        // input
+        // -----
+        UProcessInput(gWindow);
+
+        // Camera and objects as the update thread left them, blended to this frame's time
+        UApplySnapshot(glfwGetTime());
+
+        // Render this frame
+        URender();
+
+        gFramePacer.endFrame();
+    }
+    UStopUpdateThread();
+    UStopStream();
+    if (gCapture.slots[0].buffer != 0)
+    {
+        UFinishCaptures();
+        UDestroyReadback(gCapture);
+    }
+    gCaptureEncoders.reset();
+
+    // Release mesh data
+    UDestroyScene();
+    UDestroyMesh(gMesh);
+
+    // Release texture
+    UDestroyTexture(gTextureIdBody);
+    UDestroyTexture(gTextureIdHead);
+    UDestroyTexture(gTextureIdPlane);
+    UDestroyTexture(gTextureIdKeyboard);
+
+    // Release shader program
+    UDestroyShaderProgram(gObjectsProgramId);
+    UDestroyShaderProgram(gGBufferProgramId);
+    UDestroyShaderProgram(gDeferredLightingProgramId);
+    UDestroyShaderProgram(gLightmapProgramId);
+    UDestroyShaderProgram(gLampProgramId);
+    UDestroyShaderProgram(gDepthProgramId);
+    UDestroyShaderProgram(gUpscaleProgramId);
+    UDestroyShaderProgram(gFxaaProgramId);
+    UDestroyShaderProgram(gSmaaEdgesProgramId);
+    UDestroyShaderProgram(gSmaaWeightsProgramId);
+    UDestroyShaderProgram(gSmaaBlendProgramId);
+    UDestroyRenderTargets();
+    glDeleteVertexArrays(1, &gFullscreenVao);
+    UDestroyGpuTimer(gSceneTimer);
+    UDestroyGpuTimer(gAntiAliasingTimer);
+    UDestroyShadowAtlas();
+    UDestroyLightmaps();
+    glDeleteBuffers(1, &gPointLightBuffer);
+    glDeleteBuffers(1, &gClusterBuffer);
+    glDeleteBuffers(1, &gClusterLightBuffer);
+    if (gIndirectDrawSupported)
+    {
+        UDestroyShaderProgram(gIndirectProgramId);
+        UDestroyShaderProgram(gIndirectGBufferProgramId);
+        UDestroyShaderProgram(gIndirectDepthProgramId);
+        glDeleteBuffers(1, &gIndirectBuffer);
+        glDeleteBuffers(1, &gDrawRemapBuffer);
+        UDestroyDrawDataBuffer();
+        glDeleteTextures(1, &gMaterialArray);
+        UDestroyShaderProgram(gCullProgramId);
+        glDeleteBuffers(1, &gDrawCountBuffer);
+        glDeleteBuffers(1, &gDrawCountReadback);
+        glDeleteSync(gDrawCountFence);
+    }
+
+    exit(exitCode); // Terminates the program
+}
+
+
+// Initialize GLFW, GLEW, and create a window
+bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+{
+    // Batch mode, baking and the checks draw offscreen; the window only provides the context
+    const bool offscreen = gOptions.has("batch") || gOptions.has("bake-lightmaps") || gOptions.has("check-gpu-culling") || gOptions.has("check-capture");
+
+    // GLFW: initialize and configure
+    // ------------------------------
+#if defined(__linux__) && defined(GLFW_PLATFORM_NULL)
+    // Without a display server, offscreen work runs on GLFW's null platform (GLFW 3.4) with a surfaceless
+    // EGL context, so batch rendering and streaming need no X. The context has no default framebuffer,
+    // which the capture check reads, so that check still wants a display.
+    const bool headless = offscreen && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY");
+    if (headless)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#else
+    const bool headless = false;
+#endif
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    if (offscreen)
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    if (headless)
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+
+    // GLFW: window creation
+    // ---------------------
+    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    if (*window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(*window);
+    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+    glfwSetCursorPosCallback(*window, UMousePositionCallback);
+    glfwSetScrollCallback(*window, UMouseScrollCallback);
+    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+
+    // tell GLFW to capture our mouse
+    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    // GLEW: initialize
+    // ----------------
+    // Note: if using GLEW version 1.13 or earlier
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLEW built for GLX loads the OpenGL functions, then fails to find the GLX display an EGL context lacks
+    if (headless && GlewInitResult == GLEW_ERROR_NO_GLX_DISPLAY)
+        GlewInitResult = GLEW_OK;
+#endif
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    // Displays GPU OpenGL version
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+
+    return true;
+}
+
+
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+void UProcessInput(GLFWwindow* window)
+{
+    static const float cameraSpeed = 2.5f;
+
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    // The camera moves on the update thread, by a fixed step for as long as a key is held
+    {
+        std::lock_guard<std::mutex> lock(gInputMutex);
+        gInput.moving[FORWARD] = glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS;
+        gInput.moving[BACKWARD] = glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS;
+        gInput.moving[LEFT] = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
+        gInput.moving[RIGHT] = glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS;
+        gInput.moving[UPWARD] = glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS;
+        gInput.moving[DOWNWARD] = glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS;
+        gInput.pencilRoll = (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS ? 1.0f : 0.0f) - (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS ? 1.0f : 0.0f);
+    }
+
+    // Rendering options
+    if (UKeyPressedOnce(window, GLFW_KEY_O))
+    {
+        gOcclusionCulling = !gOcclusionCulling;
+        // Results from before the switch describe a different frame
+        std::fill(gOcclusionIssued.begin(), gOcclusionIssued.end(), 0);
+        // The indirect path draws without queries, so the setting waits until it is left
+        if (gOcclusionCulling && gIndirectDraw)
+            std::cout << "Occlusion queries only apply to the per-object path; press I to leave the indirect path" << std::endl;
+    }
+    if (UKeyPressedOnce(window, GLFW_KEY_H))
+        gHiZCulling = !gHiZCulling;
+    if (UKeyPressedOnce(window, GLFW_KEY_P))
+        gDepthPrePass = !gDepthPrePass;
+    if (UKeyPressedOnce(window, GLFW_KEY_I) && gIndirectDrawSupported)
+        gIndirectDraw = !gIndirectDraw;
+    if (UKeyPressedOnce(window, GLFW_KEY_G) && gIndirectDrawSupported)
+        gGpuCulling = !gGpuCulling;
+    if (UKeyPressedOnce(window, GLFW_KEY_B))
+        gStaticBatching = !gStaticBatching;
+    if (UKeyPressedOnce(window, GLFW_KEY_L))
+        gFramePacer.setLowLatency(!gFramePacer.lowLatency());
+    if (UKeyPressedOnce(window, GLFW_KEY_R))
+    {
+        gDynamicResolution = !gDynamicResolution;
+        gResolution.reset();
+    }
+    if (UKeyPressedOnce(window, GLFW_KEY_U))
+        gSharpenUpscale = !gSharpenUpscale;
+    if (UKeyPressedOnce(window, GLFW_KEY_T))
+    {
+        // Objects may have moved while the atlas was not kept up to date
+        gShadows = !gShadows;
+        gShadowCache.reset();
+    }
+    if (UKeyPressedOnce(window, GLFW_KEY_F12))
+    {
+        static unsigned int screenshots = 0;
+        char stamp[32];
+        const std::time_t now = std::time(nullptr);
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&now));
+        UCaptureScreenshot(gCapturePrefix + "_" + stamp + "_" + to_string(++screenshots) + ".png");
+    }
+    if (UKeyPressedOnce(window, GLFW_KEY_F10))
+    {
+        gRecording = !gRecording;
+        if (gRecording)
+            gDroppedFrames = 0;
+        else
+            cout << "Recorded " << gRecordedFrames << " frames, dropped " << gDroppedFrames << endl;
+    }
+    if (UKeyPressedOnce(window, GLFW_KEY_N))
+    {
+        // The targets follow at the start of the next frame; timings of the previous mode are dropped
+        gAntiAliasing = (AntiAliasing)((gAntiAliasing + 1) % AA_MODE_COUNT);
+        gAntiAliasingTimer.total = 0.0;
+        gAntiAliasingTimer.samples = 0;
+    }
+    if (UKeyPressedOnce(window, GLFW_KEY_M))
+    {
+        // Scene timings of the paths are kept apart, so each can be compared on the same view. The
+        // lightmaps are loaded the first time they are needed; without a baked file the mode is skipped,
+        // since baking takes seconds and is left to --bake-lightmaps.
+        gShading = (Shading)((gShading + 1) % SHADING_MODE_COUNT);
+        if (gShading == SHADING_LIGHTMAPPED && gLightmap == 0 && !UCreateLightmaps(false))
+            gShading = (Shading)((gShading + 1) % SHADING_MODE_COUNT);
+        gSceneTimer.total = 0.0;
+        gSceneTimer.samples = 0;
+    }
+}
+
+
+// Returns true on the frame a key goes down, so options toggle once per press rather than every frame
+bool UKeyPressedOnce(GLFWwindow* window, int key)
+{
+    static bool wasDown[GLFW_KEY_LAST + 1] = {};
+
+    bool down = glfwGetKey(window, key) == GLFW_PRESS;
+    bool pressed = down && !wasDown[key];
+    wasDown[key] = down;
+    return pressed;
+}
+
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes.
+// Only the size is recorded; the viewports are set every frame and the targets follow once it settles.
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    gFramebuffer.resize(width, height, glfwGetTime());
+}
+
+
+// glfw: whenever the mouse moves, this callback is called
+// -------------------------------------------------------
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (gFirstMouse)
+    {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
+    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+
+    gLastX = xpos;
+    gLastY = ypos;
+
+    std::lock_guard<std::mutex> lock(gInputMutex);
+    gInput.mouseX += xoffset;
+    gInput.mouseY += yoffset;
+}
+
+
+// glfw: whenever the mouse scroll wheel scrolls, this callback is called
+// ----------------------------------------------------------------------
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    std::lock_guard<std::mutex> lock(gInputMutex);
+    gInput.scroll += yoffset;
+}
+
+
+// Starts the update thread from the current camera and scene graph
+void UStartUpdateThread()
+{
+    gUpdateCamera = gCamera;
+    {
+        std::lock_guard<std::mutex> lock(gInputMutex);
+        gUpdateInput = gInput;
+    }
+    gUpdateObjects.resize(gSceneGraph.size());
+    for (size_t i = 0; i < gUpdateObjects.size(); ++i)
+        gUpdateObjects[i] = { gSceneGraph.translation((int)i), gSceneGraph.rotation((int)i), gSceneGraph.scale((int)i) };
+
+    // The pencil body is a cylinder along its local y axis, lying on the desk; rolling keeps both directions
+    gPencilAxis = glm::normalize(gSceneGraph.worldRotation(PENCIL_NODE) * glm::vec3(0.0f, 1.0f, 0.0f));
+    const glm::vec3 deskNormal = glm::normalize(gSceneGraph.worldRotation(DESK_NODE) * glm::vec3(0.0f, 0.0f, 1.0f));
+    gPencilRollDirection = glm::normalize(glm::cross(gPencilAxis, deskNormal));
+    gPencilRadius = 0.5f * gSceneGraph.scale(PENCIL_NODE).x;
+
+    // The first snapshot holds the starting state twice, so the first frame has something to draw
+    const double now = glfwGetTime();
+    SceneSnapshot& snapshot = gSnapshots.back();
+    snapshot.time = now;
+    snapshot.camera = gUpdateCamera;
+    snapshot.appliedInput = gUpdateInput;
+    snapshot.previousObjects = snapshot.objects = gUpdateObjects;
+    gSnapshots.publish();
+
+    gUpdateRunning = true;
+    gUpdateThread = std::thread(UUpdateLoop, now);
+}
+
+
+void UStopUpdateThread()
+{
+    gUpdateRunning = false;
+    if (gUpdateThread.joinable())
+        gUpdateThread.join();
+}
+
+
+// Body of the update thread: runs a step each time UPDATE_STEP seconds of real time have passed,
+// and publishes the state before and after it
+void UUpdateLoop(double startTime)
+{
+    double stepTime = startTime;    // When the last published state was due
+    while (gUpdateRunning)
+    {
+        const double now = glfwGetTime();
+        if (now < stepTime + UPDATE_STEP)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double>(stepTime + UPDATE_STEP - now));
+            continue;
+        }
+        if (now - stepTime > UPDATE_MAX_LAG)
+            stepTime = now - UPDATE_STEP;
+
+        // The snapshot slot is the writer's until published; the assignments reuse its storage
+        SceneSnapshot& snapshot = gSnapshots.back();
+        snapshot.previousObjects = gUpdateObjects;
+
+        UUpdateStep((float)UPDATE_STEP);
+        stepTime += UPDATE_STEP;
+
+        snapshot.time = stepTime;
+        snapshot.camera = gUpdateCamera;
+        snapshot.appliedInput = gUpdateInput;
+        snapshot.objects = gUpdateObjects;
+        gSnapshots.publish();
+    }
+}
+
+
+// Advances the simulation by one step, applying the input gathered since the previous one
+void UUpdateStep(float step)
+{
+    InputState input;
+    {
+        std::lock_guard<std::mutex> lock(gInputMutex);
+        input = gInput;
+    }
+
+    // The step takes in what the totals gained since the step before, and the snapshot records the new
+    // totals, so a frame adds exactly the rest whichever snapshot it draws
+    const float mouseX = (float)(input.mouseX - gUpdateInput.mouseX);
+    const float mouseY = (float)(input.mouseY - gUpdateInput.mouseY);
+    const float scroll = (float)(input.scroll - gUpdateInput.scroll);
+    gUpdateInput = input;
+
+    if (mouseX != 0.0f || mouseY != 0.0f)
+        gUpdateCamera.ProcessMouseMovement(mouseX, mouseY);
+    if (scroll != 0.0f)
+        gUpdateCamera.ProcessMouseScroll(scroll);
+    for (int direction = FORWARD; direction <= DOWNWARD; ++direction)
+    {
+        if (input.moving[direction])
+            gUpdateCamera.ProcessKeyboard((Camera_Movement)direction, step);
+    }
+
+    // The pencil turns by the angle its side rolls over, so it does not slide. It has no parent, so its
+    // transform is already in world space.
+    if (input.pencilRoll != 0.0f)
+    {
+        ObjectPose& pencil = gUpdateObjects[PENCIL_NODE];
+        const float distance = input.pencilRoll * PENCIL_ROLL_SPEED * step;
+        pencil.translation += gPencilRollDirection * distance;
+        pencil.rotation = glm::normalize(glm::angleAxis(distance / gPencilRadius, gPencilAxis) * pencil.rotation);
+    }
+}
+
+
+// Sets the scene graph to the latest snapshot, blended between its two states by how far now is past
+// the time the newer one was due. Drawing the state one step late this way means a frame never has to
+// guess ahead of the simulation. The camera takes the newest state and the input not applied yet.
+void UApplySnapshot(double now)
+{
+    gSnapshots.fetch();
+    const SceneSnapshot& snapshot = gSnapshots.front();
+    const float blend = (float)std::min(std::max((now - snapshot.time) / UPDATE_STEP, 0.0), 1.0);
+
+    // Input sampled this frame is not waited for: the mouse and scroll offsets past the totals the snapshot
+    // took in, and the held keys over the time since the newest state was due, go on top of it. The step
+    // that takes them in lands where the frames already were, so the camera neither lags nor jumps back.
+    // A step that runs between the fetch and the lock only raises the totals; the snapshot still counts
+    // its own, so nothing is applied twice or lost.
+    InputState input;
+    {
+        std::lock_guard<std::mutex> lock(gInputMutex);
+        input = gInput;
+    }
+    const float mouseX = (float)(input.mouseX - snapshot.appliedInput.mouseX);
+    const float mouseY = (float)(input.mouseY - snapshot.appliedInput.mouseY);
+    const float scroll = (float)(input.scroll - snapshot.appliedInput.scroll);
+    Camera camera = snapshot.camera;
+    if (mouseX != 0.0f || mouseY != 0.0f)
+        camera.ProcessMouseMovement(mouseX, mouseY);
+    if (scroll != 0.0f)
+        camera.ProcessMouseScroll(scroll);
+    const float pending = (float)std::min(std::max(now - snapshot.time, 0.0), UPDATE_STEP);
+    for (int direction = FORWARD; direction <= DOWNWARD; ++direction)
+    {
+        if (input.moving[direction])
+            camera.ProcessKeyboard((Camera_Movement)direction, pending);
+    }
+    gCamera = camera;
+
+    // Objects that did not move keep their exact transform, so the scene graph does not see them as changed
+    for (size_t i = 0; i < snapshot.objects.size(); ++i)
+    {
+        const ObjectPose& fromPose = snapshot.previousObjects[i];
+        const ObjectPose& toPose = snapshot.objects[i];
+        const int node = (int)i;
+
+        glm::vec3 translation = fromPose.translation == toPose.translation ? toPose.translation : glm::mix(fromPose.translation, toPose.translation, blend);
+        glm::quat rotation = fromPose.rotation == toPose.rotation ? toPose.rotation : glm::slerp(fromPose.rotation, toPose.rotation, blend);
+        glm::vec3 scale = fromPose.scale == toPose.scale ? toPose.scale : glm::mix(fromPose.scale, toPose.scale, blend);
+
+        if (translation != gSceneGraph.translation(node))
+            gSceneGraph.setTranslation(node, translation);
+        if (rotation != gSceneGraph.rotation(node))
+            gSceneGraph.setRotation(node, rotation);
+        if (scale != gSceneGraph.scale(node))
+            gSceneGraph.setScale(node, scale);
+    }
+}
+
+// glfw: handle mouse button events
+// --------------------------------
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button)
+    {
+    case GLFW_MOUSE_BUTTON_LEFT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Left mouse button pressed" << endl;
+        else
+            cout << "Left mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Middle mouse button pressed" << endl;
+        else
+            cout << "Middle mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_RIGHT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Right mouse button pressed" << endl;
+        else
+            cout << "Right mouse button released" << endl;
+    }
+    break;
+
+    default:
+        cout << "Unhandled mouse button event" << endl;
+        break;
+    }
+}
+
+
+// Functioned called to render a frame
+void URender()
+{
+    URenderScene();
+
+    // Requested captures and the stream copy the back buffer before it is swapped away
+    UCaptureFrame();
+    UStreamFrame(0, gFramebuffer.width(), gFramebuffer.height(), glfwGetTime());
+
+    UReportFrameStats();
+
+    // Time blocked in the swap is not the frame's work, so the pacer stops measuring here
+    gFramePacer.endWork();
+
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+}
+
+
+// Draws the frame into gOutputFbo
+void URenderScene()
+{
+    // Render targets catch up with a window size that stopped changing
+    UUpdateRenderTargets(glfwGetTime());
+
+    // Enable z-depth
+    glEnable(GL_DEPTH_TEST);
+
+    glm::mat4 view = gCamera.GetViewMatrix();
+
+    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), gFramebuffer.aspect(), CAMERA_NEAR, CAMERA_FAR);
+
+    /// Transforms and bounding volumes
+    ///--------------------------------
+    // Only objects whose transform or parent changed are recomputed
+    UUpdateObjectTransforms();
+
+    /// Shadows
+    ///--------
+    // Draws into the atlas only where objects or the light moved since the last frame
+    UUpdateShadows();
+
+    /// Clustered lights
+    ///-----------------
+    UUpdateLightClusters(view, projection);
+
+    // The scene goes to the offscreen target, at the resolution scale picked for this frame
+    UBeginScenePass();
+
+    // Clear the frame and z buffers
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    /// Frustum culling
+    ///----------------
+    // Culling on the GPU needs the indirect path; the CPU then hands every object over as a candidate
+    const bool gpuCulling = gGpuCulling && gIndirectDraw;
+    Frustum frustum = UExtractFrustum(projection * view);
+    gFrameStats.occluded = 0;
+    if (gpuCulling)
+    {
+        std::fill(gObjectVisible.begin(), gObjectVisible.end(), 1);
+
+        // The GPU's count arrives a frame or more late; until a new one lands the last one stays on show
+        UReadGpuCullingCount(gGpuVisibleCount);
+    }
+    else
+    {
+        UParallelForRange((unsigned int)gSceneObjects.size(), FRAME_JOB_GRAIN, [&](unsigned int begin, unsigned int end)
+        {
+            UCullBoxes(frustum, gObjectBounds, gObjectVisible.data(), begin, end);
+        });
+
+        if (gHiZCulling)
+            UCullOccludedObjects(projection * view);
+    }
+
+    // Opaque objects go front to back so early depth testing rejects the fragments they hide
+    USortDrawOrder(view);
+    UCountFrameDraws(frustum, gpuCulling);
+
+    // Both parts of the pencil share the level picked for the body, so they change detail together
+    int pencilLod = PENCIL_LOD_COUNT - 1;
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (gSceneObjects[i].mesh == SCENE_MESH_PENCIL_BODY)
+        {
+            pencilLod = USelectPencilLod(gObjectModels[i], gMesh.bodyLod[0].bounds.radius);
+            break;
+        }
+    }
+
+    // The box tests go first so the draws of this frame can be skipped on their results. Only the render
+    // packets are drawn conditionally, so the other paths issue no queries.
+    if (gOcclusionCulling && !gIndirectDraw)
+        URenderOcclusionQueries(view, projection, pencilLod);
+
+    // The draws of every pass are prepared once; from here on the GL thread only replays them
+    UBuildRenderPackets(pencilLod);
+
+    // The indirect path gets the commands and data of every pass written once
+    if (gIndirectDraw)
+    {
+        UWriteDrawData();
+        UUploadDrawCommands();
+        if (gpuCulling)
+            UCullOnGpu(frustum);
+    }
+
+    // Deferred shading draws the objects, and their depth pre-pass, into the G-buffer
+    const bool deferred = gShading == SHADING_DEFERRED;
+    const bool lightmapped = gShading == SHADING_LIGHTMAPPED;
+    if (deferred)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    /// Depth pre-pass
+    ///---------------
+    if (gDepthPrePass)
+    {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        if (gIndirectDraw)
+        {
+            UUseObjectsProgram(gIndirectDepthProgramId, view, projection);
+            UDrawSceneObjectsIndirect();
+        }
+        else
+            UDrawSceneObjects(UUseObjectsProgram(gDepthProgramId, view, projection), false);
+
+        if (lightmapped)
+            UDrawLightmapBatches(frustum, UUseObjectsProgram(gDepthProgramId, view, projection), false);
+        else if (gStaticBatching)
+            UDrawStaticBatches(frustum, UUseObjectsProgram(gDepthProgramId, view, projection), false);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        // The shading pass only touches the fragments that won, and leaves the depth buffer as it is
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+    }
+
+
+    /// Desk objects
+    ///-------------
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, gShadowAtlas);
+    glActiveTexture(GL_TEXTURE0);
+
+    const GLuint objectsProgramId = deferred ? gGBufferProgramId : gObjectsProgramId;
+    GLint modelLoc = UUseObjectsProgram(gIndirectDraw ? (deferred ? gIndirectGBufferProgramId : gIndirectProgramId) : objectsProgramId, view, projection);
+
+    if (gIndirectDraw)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, gMaterialArray);
+
+        UDrawSceneObjectsIndirect();
+    }
+    else
+    {
+        glActiveTexture(GL_TEXTURE0);
+
+        UDrawSceneObjects(modelLoc, true);
+    }
+
+    if (lightmapped)
+    {
+        glActiveTexture(GL_TEXTURE0 + LIGHTMAP_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, gLightmap);
+        glActiveTexture(GL_TEXTURE0);
+        UDrawLightmapBatches(frustum, UUseObjectsProgram(gLightmapProgramId, view, projection), true);
+    }
+    else if (gStaticBatching)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        UDrawStaticBatches(frustum, UUseObjectsProgram(objectsProgramId, view, projection), true);
+    }
+
+    if (gDepthPrePass)
+    {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    }
+
+    if (deferred)
+        UDrawDeferredLighting(view, projection);
+
+    // The draws reading this frame's DrawData region are all submitted
+    if (gIndirectDraw)
+        UFenceDrawData();
+
+
+    /// Lamp
+    ///---------
+    glBindVertexArray(gMesh.vaoKB);
+    glUseProgram(gLampProgramId);
+
+    glm::mat4 scale5 = glm::scale(glm::vec3(1.5f, 1.5f, 1.5f));
+    glm::mat4 rotation5 = glm::rotate(90.0f, glm::vec3(1.0, 1.0f, 1.0f));
+    glm::mat4 translation5 = glm::translate(glm::vec3(0.0f, 7.0f, -6.0f));
+    glm::mat4 model5 = translation5 * rotation5 * scale5;
+
+    // Reference matrix uniforms from the Lamp Shader program
+    modelLoc = glGetUniformLocation(gLampProgramId, "model");
+    GLint viewLoc = glGetUniformLocation(gLampProgramId, "view");
+    GLint projLoc = glGetUniformLocation(gLampProgramId, "projection");
+
+    // Pass matrix data to the Lamp Shader program's matrix uniforms
+    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model5));
+    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+
+    glDrawArrays(GL_TRIANGLES, 0, 36);
+
+    // Deactivate the Vertex Array Object
+    glBindVertexArray(0);
+
+    /// Upscale
+    ///--------
+    UEndScenePass();
+}
+
+
+// Binds one of the programs drawing the scene objects and passes it the camera and lighting uniforms.
+// Depth-only programs ignore the lighting ones. Returns the location of the model matrix uniform.
+GLint UUseObjectsProgram(GLuint programId, const glm::mat4& view, const glm::mat4& projection)
+{
+    glUseProgram(programId);
+
+    // Retrieves and passes transform matrices to the Shader program
+    GLint viewLoc = glGetUniformLocation(programId, "view");
+    GLint projLoc = glGetUniformLocation(programId, "projection");
+
+    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+
+    // Reference matrix uniforms from the Cube Shader program for the cub color, light color, light position, and camera position
+    GLint objectColorLoc = glGetUniformLocation(programId, "objectColor");
+    GLint lightColorLoc = glGetUniformLocation(programId, "lightColor");
+    GLint lightPositionLoc = glGetUniformLocation(programId, "lightPos");
+    GLint viewPositionLoc = glGetUniformLocation(programId, "viewPosition");
+
+    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
+    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
+    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
+    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
+
+    const glm::vec3 cameraPosition = gCamera.Position;
+    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+
+    GLint UVScaleLoc = glGetUniformLocation(programId, "uvScale");
+    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+
+    // Faces of the shadow atlas
+    glUniform1i(glGetUniformLocation(programId, "shadowsEnabled"), gShadows);
+    glUniformMatrix4fv(glGetUniformLocation(programId, "shadowMatrices"), SHADOW_FACES, GL_FALSE, glm::value_ptr(gShadowMatrices[0]));
+    glUniform2f(glGetUniformLocation(programId, "shadowTexel"), 1.0f / (SHADOW_ATLAS_COLUMNS * gShadowTileSize), 1.0f / (SHADOW_ATLAS_ROWS * gShadowTileSize));
+
+    // Clusters of the point lights, over the part of the scene target drawn this frame
+    glUniform1i(glGetUniformLocation(programId, "pointLightCount"), (GLint)gPointLights.size());
+    glUniform2f(glGetUniformLocation(programId, "clusterScale"), (float)CLUSTER_COLUMNS / gSceneTarget.drawnWidth, (float)CLUSTER_ROWS / gSceneTarget.drawnHeight);
+    glUniform3i(glGetUniformLocation(programId, "clusterGrid"), CLUSTER_COLUMNS, CLUSTER_ROWS, CLUSTER_SLICES);
+    glUniform2f(glGetUniformLocation(programId, "clusterSlicing"), gLightClusters.sliceScale(), gLightClusters.sliceBias());
+    glUniform2f(glGetUniformLocation(programId, "clusterDepthRange"), CAMERA_NEAR, CAMERA_FAR);
+
+    return glGetUniformLocation(programId, "model");
+}
+
+
+// Lists the objects left visible by culling in gDrawOrder, sorted by the view-space depth of their box centers.
+// Each job lists the objects of its range with their sort keys; the lists are merged in range order.
+void USortDrawOrder(const glm::mat4& view)
+{
+    const unsigned int objectCount = (unsigned int)gSceneObjects.size();
+    gJobDrawLists.resize((objectCount + FRAME_JOB_GRAIN - 1) / FRAME_JOB_GRAIN);
+    UParallelForRange(objectCount, FRAME_JOB_GRAIN, [&](unsigned int begin, unsigned int end)
+    {
+        std::vector<unsigned int>& list = gJobDrawLists[begin / FRAME_JOB_GRAIN];
+        list.clear();
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            // Baked objects are drawn with their static or lightmap batch
+            if (!gObjectVisible[i] || !UDrawnAlone(i))
+                continue;
+
+            // The camera looks down -z in view space; only the z row of the view matrix is needed
+            gObjectDepth[i] = -(view[0][2] * gObjectBounds.centerX[i] + view[1][2] * gObjectBounds.centerY[i]
+                              + view[2][2] * gObjectBounds.centerZ[i] + view[3][2]);
+            list.push_back(i);
+        }
+    });
+
+    gDrawOrder.clear();
+    for (const std::vector<unsigned int>& list : gJobDrawLists)
+        gDrawOrder.insert(gDrawOrder.end(), list.begin(), list.end());
+
+    std::sort(gDrawOrder.begin(), gDrawOrder.end(), [](unsigned int a, unsigned int b)
+    {
+        return gObjectDepth[a] < gObjectDepth[b];
+    });
+}
+
+
+// Builds what the passes draw for the objects of gDrawOrder: render packets for the classic path, or
+// indirect commands with the remap entries pointing each command at its object's DrawData. Each job
+// writes the entries of its own range of draws, so the merged list keeps the front-to-back order.
+void UBuildRenderPackets(int pencilLod)
+{
+    const unsigned int drawCount = (unsigned int)gDrawOrder.size();
+    if (gIndirectDraw)
+    {
+        gDrawCommands.resize(drawCount);
+        gDrawRemap.resize(drawCount);
+    }
+    else
+        gRenderPackets.resize(drawCount);
+
+    UParallelForRange(drawCount, FRAME_JOB_GRAIN, [&](unsigned int begin, unsigned int end)
+    {
+        for (unsigned int draw = begin; draw < end; ++draw)
+        {
+            unsigned int i = gDrawOrder[draw];
+            const GLLodLevel& level = USelectObjectLod(gSceneObjects[i], gObjectModels[i], pencilLod);
+
+            if (gIndirectDraw)
+            {
+                DrawElementsIndirectCommand& command = gDrawCommands[draw];
+                command.count = (GLuint)level.nIndices;
+                command.instanceCount = 1;
+                command.firstIndex = level.firstIndex;
+                command.baseVertex = level.baseVertex;
+                command.baseInstance = 0;
+
+                gDrawRemap[draw] = i;
+                continue;
+            }
+
+            // The GPU skips the draw when this frame's box test found no visible sample
+            RenderPacket& packet = gRenderPackets[draw];
+            packet.indexCount = level.nIndices;
+            packet.firstIndex = level.firstIndex;
+            packet.baseVertex = level.baseVertex;
+            packet.texture = *gSceneObjects[i].textureId;
+            packet.query = gOcclusionCulling && gOcclusionIssued[i] ? gOcclusionQueries[i] : 0;
+            packet.model = &gObjectModels[i];
+        }
+    });
+}
+
+
+// Replays the render packets with the bound program. The depth pre-pass leaves textures out.
+void UDrawSceneObjects(GLint modelLoc, bool textured)
+{
+    // NO_WAIT draws anyway if the query result is not ready yet, so the GPU never stalls on it. With the
+    // depth pre-pass both passes must see the same result, or a fragment written to depth alone would be
+    // left unshaded under the equal test, so both wait for it.
+    const GLenum queryMode = gDepthPrePass ? GL_QUERY_WAIT : GL_QUERY_NO_WAIT;
+
+    // Every object level lives in the mesh pool
+    glBindVertexArray(gMesh.pool.vao);
+    for (const RenderPacket& packet : gRenderPackets)
+    {
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(*packet.model));
+        if (textured)
+            glBindTexture(GL_TEXTURE_2D, packet.texture);
+
+        if (packet.query)
+            glBeginConditionalRender(packet.query, queryMode);
+
+        glDrawElementsBaseVertex(GL_TRIANGLES, packet.indexCount, GL_UNSIGNED_INT, (void*)(sizeof(GLuint) * packet.firstIndex), packet.baseVertex);
+
+        if (packet.query)
+            glEndConditionalRender();
+    }
+}
+
+
+// Uploads the indirect commands and remap entries built by UBuildRenderPackets
+void UUploadDrawCommands()
+{
+    // Orphaned every frame so the driver never waits on the draws of the previous one
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, gDrawCommands.size() * sizeof(DrawElementsIndirectCommand), gDrawCommands.data(), GL_STREAM_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawRemapBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gDrawRemap.size() * sizeof(GLuint), gDrawRemap.data(), GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, gDrawRemapBuffer);
+}
+
+
+// Clears, in place, the commands uploaded by UUploadDrawCommands whose objects fail the frustum and
+// distance tests, run by a compute pass on the boxes of the bound DrawData region. Every command keeps its
+// slot, so the remap buffer and the front-to-back order stay as uploaded, and the CPU writes nothing.
+void UCullOnGpu(const Frustum& frustum)
+{
+    const GLuint commandCount = (GLuint)gDrawCommands.size();
+    if (commandCount == 0)
+        return;
+
+    UDispatchGpuCulling(frustum, gCamera.Position, commandCount);
+
+    // The visible count is copied out for the frame counters, unless the last copy is still to be read
+    if (gDrawCountFence == 0)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, gDrawCountBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, gDrawCountReadback);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, 2 * sizeof(GLuint));
+        gDrawCountFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+
+// Runs the culling compute pass over the first commandCount commands of gIndirectBuffer, looking up the
+// box of each through the DrawData and remap buffers bound at 0 and 4
+void UDispatchGpuCulling(const Frustum& frustum, const glm::vec3& cameraPosition, GLuint commandCount)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gIndirectBuffer);
+
+    const GLuint zero[2] = { 0, 0 };
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawCountBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(zero), zero, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gDrawCountBuffer);
+
+    glUseProgram(gCullProgramId);
+    glUniform4fv(glGetUniformLocation(gCullProgramId, "frustumPlanes"), 6, glm::value_ptr(frustum.planes[0]));
+    glUniform3fv(glGetUniformLocation(gCullProgramId, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+    glUniform1f(glGetUniformLocation(gCullProgramId, "maxDistance"), GPU_CULL_MAX_DISTANCE);
+    glUniform1ui(glGetUniformLocation(gCullProgramId, "commandCount"), commandCount);
+    glDispatchCompute((commandCount + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+
+    // The commands and count are read by the draws, and the count copied out for the CPU
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+
+// Reads the visible count of an earlier GPU culling pass once its copy has landed, without waiting for it
+bool UReadGpuCullingCount(unsigned int& visible)
+{
+    if (gDrawCountFence == 0 || glClientWaitSync(gDrawCountFence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        return false;
+
+    glDeleteSync(gDrawCountFence);
+    gDrawCountFence = 0;
+
+    GLuint counts[2];
+    glBindBuffer(GL_COPY_READ_BUFFER, gDrawCountReadback);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(counts), counts);
+    visible = counts[1];
+    return true;
+}
+
+
+// Checks the GPU culling pass against the CPU frustum and distance tests, over random boxes seen from
+// random cameras, and reports whether they agree. Run with --check-gpu-culling; it needs no window contents,
+// so it also runs on software GL (LIBGL_ALWAYS_SOFTWARE=1 selects Mesa's llvmpipe) in CI.
+bool UCheckGpuCulling()
+{
+    if (!gIndirectDrawSupported)
+    {
+        cout << "GPU culling check: the indirect path is not supported" << endl;
+        return false;
+    }
+
+    const GLuint boxCount = 10000;              // Enough for many compute groups
+    const int viewCount = 16;
+    const float boundaryMargin = 1e-3f;         // Boxes this close to a plane may go either way
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-60.0f, 60.0f), size(0.05f, 4.0f);
+
+    // The boxes stand in for the DrawData of as many objects, reached through a shuffled remap, so a
+    // command tested against the box of another object shows
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+    std::vector<DrawData> boxes(boxCount);
+    std::vector<GLuint> remap(boxCount);
+    for (GLuint i = 0; i < boxCount; ++i)
+        remap[i] = i;
+    std::shuffle(remap.begin(), remap.end(), random);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[1]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, remap.size() * sizeof(GLuint), remap.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, buffers[1]);
+
+    // The first index of each command names its slot, so a command moved to another slot shows
+    std::vector<DrawElementsIndirectCommand> commands(boxCount);
+    for (GLuint i = 0; i < boxCount; ++i)
+        commands[i] = { 3, 1, i, 0, 0 };
+
+    unsigned int failures = 0;
+    for (int view = 0; view < viewCount; ++view)
+    {
+        glm::vec3 eye(position(random), position(random), position(random));
+        glm::vec3 target(position(random), position(random), position(random));
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT, CAMERA_NEAR, CAMERA_FAR);
+        Frustum frustum = UExtractFrustum(projection * glm::lookAt(eye, target, glm::vec3(0.0f, 1.0f, 0.0f)));
+
+        for (DrawData& box : boxes)
+        {
+            box.boundsCenter = glm::vec4(position(random), position(random), position(random), 0.0f);
+            box.boundsExtent = glm::vec4(size(random), size(random), size(random), 0.0f);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, boxes.size() * sizeof(DrawData), boxes.data(), GL_STREAM_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffers[0]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gIndirectBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STREAM_DRAW);
+
+        UDispatchGpuCulling(frustum, eye, boxCount);
+
+        std::vector<DrawElementsIndirectCommand> culled(boxCount);
+        GLuint counts[2];
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gIndirectBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, boxCount * sizeof(DrawElementsIndirectCommand), culled.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawCountBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+
+        GLuint lastVisible = 0, visibleCount = 0;
+        for (GLuint i = 0; i < boxCount; ++i)
+        {
+            const DrawData& box = boxes[remap[i]];
+            const glm::vec3 center(box.boundsCenter), extent(box.boundsExtent);
+            const bool gpuVisible = culled[i].instanceCount != 0;
+            if (culled[i].firstIndex != i || culled[i].count != 3)
+                ++failures;
+            if (gpuVisible)
+            {
+                lastVisible = i + 1;
+                ++visibleCount;
+            }
+
+            // Signed distance of the box past the nearest plane and past the distance limit; negative is outside
+            float margin = FLT_MAX;
+            for (const glm::vec4& plane : frustum.planes)
+                margin = std::min(margin, glm::dot(glm::vec3(plane), center) + plane.w + glm::dot(glm::abs(glm::vec3(plane)), extent));
+            glm::vec3 outside = glm::max(glm::abs(eye - center) - extent, glm::vec3(0.0f));
+            margin = std::min(margin, GPU_CULL_MAX_DISTANCE - glm::length(outside));
+
+            if (gpuVisible != (margin >= 0.0f) && std::fabs(margin) > boundaryMargin)
+                ++failures;
+        }
+        if (counts[0] != lastVisible || counts[1] != visibleCount)
+            ++failures;
+
+        cout << "GPU culling check: view " << view << ", " << visibleCount << " of " << boxCount << " boxes visible" << endl;
+    }
+
+    // The frame binds its own DrawData region and remap buffer again before it culls
+    glDeleteBuffers(2, buffers);
+    cout << "GPU culling check: " << (failures == 0 ? "passed" : to_string(failures) + " mismatches") << endl;
+    return failures == 0;
+}
+
+
+// Draws every object of gDrawOrder with a single call, using the commands of UUploadDrawCommands.
+// Conditional rendering works per draw call, so occlusion query results are not applied here.
+void UDrawSceneObjectsIndirect()
+{
+    if (gDrawCommands.empty())
+        return;
+
+    glBindVertexArray(gMesh.pool.vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+
+    // After GPU culling only the count written by the compute pass is drawn
+    if (gGpuCulling && gDrawCountSupported)
+    {
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, gDrawCountBuffer);
+        glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, 0, (GLsizei)gDrawCommands.size(), 0);
+    }
+    else
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, (GLsizei)gDrawCommands.size(), 0);
+}
+
+
+// Fills the scene with the desk objects drawn by URender
+void UCreateScene()
+{
+    gSceneObjects = {
+        { "Pencil body", SCENE_MESH_PENCIL_BODY, &gTextureIdBody, -1, glm::vec3(0.5f, 3.0f, 0.5f), 90.0f, glm::vec3(90.0f, 10.0f, 0.0f), glm::vec3(5.0f, 0.0f, 1.0f), false, true },
+        { "Pencil nib", SCENE_MESH_PENCIL_NIB, &gTextureIdHead, 0, glm::vec3(0.25f, 0.5f, 0.25f), 45.0f, glm::vec3(-95.0f, 0.0f, 30.0f), glm::vec3(4.6f, 0.9f, -0.8f), false, true },
+        { "Plane", SCENE_MESH_CUBE, &gTextureIdPlane, -1, glm::vec3(13.0f, 10.0f, 0.5f), 90.0f, glm::vec3(90.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 0.0f), true, false },
+        { "Keyboard", SCENE_MESH_CUBE, &gTextureIdKeyboard, -1, glm::vec3(7.0f, 4.0f, 0.1f), 90.0f, glm::vec3(90.0f, 0.0f, 0.0f), glm::vec3(-2.1f, 1.5f, -2.3f), true, false },
+        { "Brown paper", SCENE_MESH_CUBE, &gTextureIdPaper, 2, glm::vec3(2.0f, 3.5f, 0.1f), 90.0f, glm::vec3(90.0f, -6.0f, 5.0f), glm::vec3(0.0f, -0.5f, 1.7f), true, false },
+        { "Lined paper", SCENE_MESH_CUBE, &gTextureIdNotebook, 2, glm::vec3(2.0f, 3.5f, 0.1f), 90.0f, glm::vec3(90.0f, -6.0f, 5.0f), glm::vec3(0.5f, -0.3f, 1.5f), true, false },
+    };
+
+    // Placements are given in world space and turned into transforms relative to the parent
+    gSceneGraph = SceneGraph();
+    for (const SceneObject& object : gSceneObjects)
+        gSceneGraph.addNodeAtWorld(object.parent, object.translation, glm::angleAxis(object.rotationAngle, glm::normalize(object.rotationAxis)), object.scale);
+
+    gObjectModels.resize(gSceneObjects.size());
+    gObjectBounds.resize(gSceneObjects.size());
+    gObjectTransforms.resize(gSceneObjects.size());
+    gObjectChangedUpdate.resize(gSceneObjects.size());
+    UUpdateObjectTransforms();
+    gObjectVisible.resize(gSceneObjects.size());
+    gDrawOrder.reserve(gSceneObjects.size());
+    gObjectDepth.resize(gSceneObjects.size());
+
+    // Objects sharing a texture share a material of the indirect path
+    gMaterialTextures.clear();
+    gObjectMaterials.resize(gSceneObjects.size());
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        auto found = std::find(gMaterialTextures.begin(), gMaterialTextures.end(), gSceneObjects[i].textureId);
+        gObjectMaterials[i] = (GLuint)(found - gMaterialTextures.begin());
+        if (found == gMaterialTextures.end())
+            gMaterialTextures.push_back(gSceneObjects[i].textureId);
+    }
+
+    UCreateStaticBatches();
+
+    gOcclusionQueries.resize(gSceneObjects.size());
+    gOcclusionIssued.assign(gSceneObjects.size(), 0);
+    glGenQueries((GLsizei)gOcclusionQueries.size(), gOcclusionQueries.data());
+}
+
+
+void UDestroyScene()
+{
+    for (StaticBatch& batch : gStaticBatches)
+        UDestroyLodLevel(batch.mesh);
+    gStaticBatches.clear();
+
+    glDeleteQueries((GLsizei)gOcclusionQueries.size(), gOcclusionQueries.data());
+}
+
+
+// Brings the scene graph up to date and copies the new world transforms, with the world bounds they
+// give, to the objects whose transform or ancestors changed. The graph walks parents before children
+// in one pass; the copies are independent and run as jobs.
+void UUpdateObjectTransforms()
+{
+    gSceneGraph.update();
+    ++gTransformUpdate;
+    UParallelForRange((unsigned int)gSceneObjects.size(), FRAME_JOB_GRAIN, [](unsigned int begin, unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            if (!gSceneGraph.changed((int)i))
+                continue;
+
+            gObjectChangedUpdate[i] = gTransformUpdate;
+            gObjectModels[i] = gSceneGraph.world((int)i);
+            gObjectTransforms.set(i, gSceneGraph.worldTranslation((int)i), gSceneGraph.worldRotation((int)i), gSceneGraph.scale((int)i));
+            gObjectBounds.set(i, UTransformBounds(USelectObjectLod(gSceneObjects[i], gObjectModels[i], 0).bounds, gObjectModels[i]));
+        }
+    });
+}
+
+
+// Creates the persistently mapped DrawData buffer, one region per frame in flight. The materials
+// never change, so they are written to every region once here and the matrix composition leaves them alone.
+void UCreateDrawDataBuffer()
+{
+    // Regions are bound with glBindBufferRange, so each one starts on the storage buffer offset alignment
+    GLint alignment = 1;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    GLsizeiptr dataSize = (GLsizeiptr)(gSceneObjects.size() * sizeof(DrawData));
+    gDrawDataRegionSize = (dataSize + alignment - 1) / alignment * alignment;
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &gDrawDataBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawDataBuffer);
+    glBufferStorage(GL_SHADER_STORAGE_BUFFER, gDrawDataRegionSize * DRAW_DATA_REGIONS, nullptr, flags);
+    gDrawDataMapped = (char*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, gDrawDataRegionSize * DRAW_DATA_REGIONS, flags);
+
+    for (unsigned int region = 0; region < DRAW_DATA_REGIONS; ++region)
+    {
+        DrawData* data = (DrawData*)(gDrawDataMapped + region * gDrawDataRegionSize);
+        for (size_t i = 0; i < gSceneObjects.size(); ++i)
+            data[i].material = gObjectMaterials[i];
+    }
+}
+
+
+// Copies the texture of every material into its layer of the material array, scaled to the layer size, so the
+// indirect shader picks each draw's material with a layer coordinate rather than a sampler index
+void UCreateMaterialArray()
+{
+    glGenTextures(1, &gMaterialArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gMaterialArray);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, MATERIAL_ARRAY_SIZE, MATERIAL_ARRAY_SIZE, (GLsizei)gMaterialTextures.size());
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // Each texture is blitted into its layer, with linear filtering doing the scaling
+    GLuint framebuffers[2];
+    glGenFramebuffers(2, framebuffers);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[0]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1]);
+    for (size_t layer = 0; layer < gMaterialTextures.size(); ++layer)
+    {
+        GLint width = 0, height = 0;
+        glBindTexture(GL_TEXTURE_2D, *gMaterialTextures[layer]);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *gMaterialTextures[layer], 0);
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, gMaterialArray, 0, (GLint)layer);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, MATERIAL_ARRAY_SIZE, MATERIAL_ARRAY_SIZE, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(2, framebuffers);
+}
+
+
+void UDestroyDrawDataBuffer()
+{
+    for (GLsync& fence : gDrawDataFences)
+    {
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawDataBuffer);
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glDeleteBuffers(1, &gDrawDataBuffer);
+    gDrawDataMapped = nullptr;
+}
+
+
+// Composes the model and normal matrices, and copies the world boxes, of the objects that changed since the
+// next DrawData region was last written into it, and binds it. A still scene writes nothing.
+void UWriteDrawData()
+{
+    // Only waits when the GPU is still DRAW_DATA_REGIONS frames behind
+    GLsync& fence = gDrawDataFences[gDrawDataRegion];
+    if (fence)
+    {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    // Runs of changed objects are composed together, so a scene moving as a whole keeps the SIMD path
+    GLintptr offset = gDrawDataRegion * gDrawDataRegionSize;
+    const unsigned int written = gDrawDataWrittenUpdate[gDrawDataRegion];
+    const size_t objectCount = gObjectTransforms.size();
+    for (size_t first = 0; first < objectCount; )
+    {
+        if (gObjectChangedUpdate[first] <= written)
+        {
+            ++first;
+            continue;
+        }
+        size_t end = first + 1;
+        while (end < objectCount && gObjectChangedUpdate[end] > written)
+            ++end;
+        DrawData* data = (DrawData*)(gDrawDataMapped + offset);
+        gObjectTransforms.compose(first, end - first, &data[first], sizeof(DrawData));
+        for (size_t i = first; i < end; ++i)
+        {
+            data[i].boundsCenter = glm::vec4(gObjectBounds.centerX[i], gObjectBounds.centerY[i], gObjectBounds.centerZ[i], 0.0f);
+            data[i].boundsExtent = glm::vec4(gObjectBounds.extentX[i], gObjectBounds.extentY[i], gObjectBounds.extentZ[i], 0.0f);
+        }
+        first = end;
+    }
+    gDrawDataWrittenUpdate[gDrawDataRegion] = gTransformUpdate;
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, gDrawDataBuffer, offset, (GLsizeiptr)(gObjectTransforms.size() * sizeof(DrawData)));
+}
+
+
+// Marks the end of the draws reading the current DrawData region and moves on to the next one
+void UFenceDrawData()
+{
+    gDrawDataFences[gDrawDataRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    gDrawDataRegion = (gDrawDataRegion + 1) % DRAW_DATA_REGIONS;
+}
+
+
+// Bakes every immovable object into world space, merging those of the same material into one batch.
+// Objects are baked at their finest level of detail, and a batch is culled as a whole.
+void UCreateStaticBatches()
+{
+    std::vector<MeshData> merged(gMaterialTextures.size());
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (!gSceneObjects[i].movable)
+            UAppendMesh(merged[gObjectMaterials[i]], UObjectWorldMesh(i));
+    }
+
+    for (size_t material = 0; material < merged.size(); ++material)
+    {
+        if (merged[material].indices.empty())
+            continue;
+
+        StaticBatch batch;
+        UCreateLodLevel(merged[material], 0.0f, batch.mesh, nullptr);
+        batch.textureId = gMaterialTextures[material];
+        gStaticBatches.push_back(batch);
+    }
+}
+
+
+// Draws the static batches in the frustum with the bound program; their vertices need no model transform
+void UDrawStaticBatches(const Frustum& frustum, GLint modelLoc, bool textured)
+{
+    const glm::mat4 identity(1.0f);
+    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(identity));
+
+    for (const StaticBatch& batch : gStaticBatches)
+    {
+        if (!UBoxInFrustum(frustum, batch.mesh.bounds.center, batch.mesh.bounds.extent))
+            continue;
+
+        glBindVertexArray(batch.mesh.vao);
+        if (textured)
+            glBindTexture(GL_TEXTURE_2D, *batch.textureId);
+        glDrawElements(GL_TRIANGLES, batch.mesh.nIndices, GL_UNSIGNED_INT, (void*)0);
+    }
+}
+
+
+// Finest level of an object, copied out of the pool with its indices made local again, in world space
+MeshData UObjectWorldMesh(size_t object)
+{
+    const GLLodLevel& level = USelectObjectLod(gSceneObjects[object], gObjectModels[object], 0);
+    MeshData source;
+    std::map<GLuint, GLuint> local;
+    for (GLsizei corner = 0; corner < level.nIndices; ++corner)
+    {
+        GLuint index = level.baseVertex + gMesh.poolData.indices[level.firstIndex + corner];
+        auto found = local.find(index);
+        if (found == local.end())
+        {
+            const float* v = &gMesh.poolData.vertices[index * MESH_FLOATS_PER_VERTEX];
+            source.vertices.insert(source.vertices.end(), v, v + MESH_FLOATS_PER_VERTEX);
+            found = local.emplace(index, source.vertexCount() - 1).first;
+        }
+        source.indices.push_back(found->second);
+    }
+    return UTransformMesh(source, gObjectModels[object]);
+}
+
+
+// Whether the immovable objects are left out of the per-object paths, drawn instead with the static
+// batches or, under lightmapped shading, the lightmap batches
+bool UBatchesImmovableObjects()
+{
+    return gStaticBatching || gShading == SHADING_LIGHTMAPPED;
+}
+
+
+// Whether an object is drawn by itself rather than with a batch
+bool UDrawnAlone(size_t object)
+{
+    return gSceneObjects[object].movable || !UBatchesImmovableObjects();
+}
+
+
+// Sets the drawn and culled counters of the frame in draws: the objects drawn one by one, and the batches
+// standing in for the immovable ones. Under GPU culling the objects drawn are the last count read back.
+void UCountFrameDraws(const Frustum& frustum, bool gpuCulling)
+{
+    unsigned int candidates = 0;
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+        candidates += UDrawnAlone(i);
+
+    const unsigned int drawOrderCount = (unsigned int)gDrawOrder.size();
+    gFrameStats.drawn = gpuCulling ? std::min(gGpuVisibleCount, drawOrderCount) : drawOrderCount;
+    gFrameStats.culled = candidates - gFrameStats.drawn - gFrameStats.occluded;
+
+    // Batches are culled whole, by the same test as when they are drawn
+    auto countBatch = [&](const Bounds& bounds)
+    {
+        if (UBoxInFrustum(frustum, bounds.center, bounds.extent))
+            ++gFrameStats.drawn;
+        else
+            ++gFrameStats.culled;
+    };
+    if (gShading == SHADING_LIGHTMAPPED)
+    {
+        for (const LightmapBatch& batch : gLightmapBatches)
+            countBatch(batch.mesh.bounds);
+    }
+    else if (gStaticBatching)
+    {
+        for (const StaticBatch& batch : gStaticBatches)
+            countBatch(batch.mesh.bounds);
+    }
+}
+
+
+// Mean color of a texture, read from the last level of its mipmap chain
+glm::vec3 UAverageTextureColor(GLuint textureId)
+{
+    GLint width = 0, height = 0;
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    int level = 0;
+    while ((width >> level) > 1 || (height >> level) > 1)
+        ++level;
+
+    unsigned char texel[4] = {};
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, level, GL_RGBA, GL_UNSIGNED_BYTE, texel);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return glm::vec3(texel[0], texel[1], texel[2]) / 255.0f;
+}
+
+
+// Unwraps the immovable objects into the lightmap and creates their batches. With bake, the lighting is
+// baked on every core and written to the --lightmap file, with the key of its inputs in a file next to it.
+// Otherwise it comes from that file, which has to hold a lightmap of the current size baked from the current
+// inputs. Returns false when the objects do not fit the lightmap, or the file is missing, stale or cannot be
+// written.
+bool UCreateLightmaps(bool bake)
+{
+    UDestroyLightmaps();
+
+    std::vector<MeshData> meshes;
+    std::vector<size_t> objects;
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (!gSceneObjects[i].movable)
+        {
+            meshes.push_back(UObjectWorldMesh(i));
+            objects.push_back(i);
+        }
+    }
+    std::vector<LightmapMesh> unwrapped;
+    if (!UUnwrapLightmap(meshes, gLightmapSize, unwrapped))
+    {
+        cout << "The immovable objects do not fit a lightmap of " << gLightmapSize << " texels" << endl;
+        return false;
+    }
+
+    std::vector<glm::vec3> albedos;
+    for (size_t i : objects)
+        albedos.push_back(UAverageTextureColor(*gSceneObjects[i].textureId));
+
+    LightmapBakeSettings settings;
+    settings.samples = (unsigned int)std::max(gOptions.getNumber("lightmap-samples", settings.samples), 1.0);
+    settings.bounces = (unsigned int)std::max(gOptions.getNumber("lightmap-bounces", settings.bounces), 0.0);
+    const uint64_t key = ULightmapInputKey(unwrapped, albedos, gLightPosition, gLightColor, settings, gLightmapSize);
+
+    // Texels bottom row first, as the lightmap coordinates count them
+    const std::string path = gOptions.getString("lightmap", "lightmap.png");
+    const std::string keyPath = path + ".key";
+    const size_t rowBytes = (size_t)gLightmapSize * 4;
+    std::vector<unsigned char> pixels;
+    if (!bake)
+    {
+        uint64_t storedKey = 0;
+        std::ifstream keyFile(keyPath);
+        const bool current = (bool)(keyFile >> std::hex >> storedKey) && storedKey == key;
+
+        int width = 0, height = 0, channels = 0;
+        unsigned char* image = current ? stbi_load(path.c_str(), &width, &height, &channels, 4) : nullptr;
+        if (image && width == gLightmapSize && height == gLightmapSize)
+        {
+            flipImageVertically(image, width, height, 4);
+            pixels.assign(image, image + rowBytes * height);
+        }
+        if (image)
+            stbi_image_free(image);
+
+        if (pixels.empty())
+        {
+            cout << "The lightmap " << path << " is missing or was baked from other inputs; bake it with --bake-lightmaps" << endl;
+            return false;
+        }
+    }
+    else
+    {
+        const double start = glfwGetTime();
+        std::vector<glm::vec3> lighting;
+        UBakeLightmap(unwrapped, albedos, gLightPosition, gLightColor, settings, gLightmapSize, lighting);
+
+        pixels.resize(rowBytes * gLightmapSize);
+        for (size_t texel = 0; texel < lighting.size(); ++texel)
+        {
+            const glm::vec3 stored = glm::clamp(lighting[texel] / LIGHTMAP_RANGE, 0.0f, 1.0f) * 255.0f + 0.5f;
+            pixels[texel * 4] = (unsigned char)stored.r;
+            pixels[texel * 4 + 1] = (unsigned char)stored.g;
+            pixels[texel * 4 + 2] = (unsigned char)stored.b;
+            pixels[texel * 4 + 3] = 255;
+        }
+        std::ofstream keyFile;
+        if (UWritePng(path, &pixels[rowBytes * (gLightmapSize - 1)], gLightmapSize, gLightmapSize, -(ptrdiff_t)rowBytes))
+            keyFile.open(keyPath);
+        if (!(keyFile << std::hex << key << endl))
+        {
+            cout << "Failed to write the lightmap " << path << " with its key" << endl;
+            return false;
+        }
+        cout << "Baked the lightmap " << path << " in " << glfwGetTime() - start << " s, " << settings.samples
+             << " paths per texel, " << settings.bounces << " bounces" << endl;
+    }
+
+    glGenTextures(1, &gLightmap);
+    glBindTexture(GL_TEXTURE_2D, gLightmap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, gLightmapSize, gLightmapSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // One batch per material, as for the static batches
+    std::vector<LightmapMesh> merged(gMaterialTextures.size());
+    for (size_t k = 0; k < objects.size(); ++k)
+    {
+        LightmapMesh& target = merged[gObjectMaterials[objects[k]]];
+        UAppendMesh(target.mesh, unwrapped[k].mesh);
+        target.uv2.insert(target.uv2.end(), unwrapped[k].uv2.begin(), unwrapped[k].uv2.end());
+    }
+    for (size_t material = 0; material < merged.size(); ++material)
+    {
+        if (merged[material].mesh.indices.empty())
+            continue;
+
+        LightmapBatch batch;
+        UCreateLodLevel(merged[material].mesh, 0.0f, batch.mesh, nullptr);
+        glBindVertexArray(batch.mesh.vao);
+        glGenBuffers(1, &batch.uv2Vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, batch.uv2Vbo);
+        glBufferData(GL_ARRAY_BUFFER, merged[material].uv2.size() * sizeof(float), merged[material].uv2.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
+        glEnableVertexAttribArray(3);
+        glBindVertexArray(0);
+
+        batch.textureId = gMaterialTextures[material];
+        gLightmapBatches.push_back(batch);
+    }
+    return true;
+}
+
+
+void UDestroyLightmaps()
+{
+    for (LightmapBatch& batch : gLightmapBatches)
+    {
+        UDestroyLodLevel(batch.mesh);
+        glDeleteBuffers(1, &batch.uv2Vbo);
+    }
+    gLightmapBatches.clear();
+    glDeleteTextures(1, &gLightmap);
+    gLightmap = 0;
+}
+
+
+// Draws the lightmap batches in the frustum with the bound program, in world space like the static batches
+void UDrawLightmapBatches(const Frustum& frustum, GLint modelLoc, bool textured)
+{
+    const glm::mat4 identity(1.0f);
+    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(identity));
+
+    for (const LightmapBatch& batch : gLightmapBatches)
+    {
+        if (!UBoxInFrustum(frustum, batch.mesh.bounds.center, batch.mesh.bounds.extent))
+            continue;
+
+        glBindVertexArray(batch.mesh.vao);
+        if (textured)
+            glBindTexture(GL_TEXTURE_2D, *batch.textureId);
+        glDrawElements(GL_TRIANGLES, batch.mesh.nIndices, GL_UNSIGNED_INT, (void*)0);
+    }
+}
+
+
+// Returns the level of detail an object is drawn with this frame
+const GLLodLevel& USelectObjectLod(const SceneObject& object, const glm::mat4& model, int pencilLod)
+{
+    switch (object.mesh)
+    {
+    case SCENE_MESH_PENCIL_BODY:
+        return gMesh.bodyLod[pencilLod];
+    case SCENE_MESH_PENCIL_NIB:
+        return gMesh.nibLod[pencilLod];
+    default:
+        return gMesh.cubeLod[USelectChainLod(gMesh.cubeLod, model)];
+    }
+}
+
+
+// Allocates the offscreen target the scene is drawn into, at the full size of the window's framebuffer,
+// with multisampled buffers when samples is above 0. Scaling only shrinks the viewport inside it, so the
+// scale can change every frame without reallocating.
+void UCreateSceneTarget(int width, int height, int samples)
+{
+    gSceneTarget.width = gSceneTarget.drawnWidth = std::max(width, 1);
+    gSceneTarget.height = gSceneTarget.drawnHeight = std::max(height, 1);
+    gSceneTarget.samples = samples;
+
+    // Filtered linearly, and clamped so the upscale never wraps around to the opposite edge
+    glGenTextures(1, &gSceneTarget.color);
+    glBindTexture(GL_TEXTURE_2D, gSceneTarget.color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, gSceneTarget.width, gSceneTarget.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &gSceneTarget.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, gSceneTarget.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, gSceneTarget.width, gSceneTarget.height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &gSceneTarget.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneTarget.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gSceneTarget.color, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gSceneTarget.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "Scene target is incomplete" << endl;
+
+    if (samples > 0)
+    {
+        glGenRenderbuffers(1, &gSceneTarget.msaaColor);
+        glBindRenderbuffer(GL_RENDERBUFFER, gSceneTarget.msaaColor);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, gSceneTarget.width, gSceneTarget.height);
+        glGenRenderbuffers(1, &gSceneTarget.msaaDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, gSceneTarget.msaaDepth);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, gSceneTarget.width, gSceneTarget.height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &gSceneTarget.msaaFbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, gSceneTarget.msaaFbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gSceneTarget.msaaColor);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gSceneTarget.msaaDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "Multisampled scene target is incomplete" << endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+void UDestroySceneTarget()
+{
+    glDeleteFramebuffers(1, &gSceneTarget.fbo);
+    glDeleteTextures(1, &gSceneTarget.color);
+    glDeleteRenderbuffers(1, &gSceneTarget.depth);
+    glDeleteFramebuffers(1, &gSceneTarget.msaaFbo);
+    glDeleteRenderbuffers(1, &gSceneTarget.msaaColor);
+    glDeleteRenderbuffers(1, &gSceneTarget.msaaDepth);
+    gSceneTarget = {};
+}
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+
+// Allocates the G-buffer of the deferred path, at the size of the scene target. Every pass reads it
+// texel for texel, so nothing is filtered.
+void UCreateGBuffer(int width, int height)
+{
+    const GLenum formats[3] = { GL_RGBA8, GL_RG16, GL_DEPTH_COMPONENT24 };
+    GLuint* textures[3] = { &gGBuffer.albedo, &gGBuffer.normal, &gGBuffer.depth };
+    for (int i = 0; i < 3; ++i)
     {
-        // per-frame timing
-        // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        glGenTextures(1, textures[i]);
+        glBindTexture(GL_TEXTURE_2D, *textures[i]);
+        glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], std::max(width, 1), std::max(height, 1));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &gGBuffer.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gGBuffer.albedo, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gGBuffer.normal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gGBuffer.depth, 0);
+    const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "G-buffer is incomplete" << endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-        // input
-        // -----
-        UProcessInput(gWindow);
 
-        // Render this frame
-        URender();
+void UDestroyGBuffer()
+{
+    glDeleteFramebuffers(1, &gGBuffer.fbo);
+    glDeleteTextures(1, &gGBuffer.albedo);
+    glDeleteTextures(1, &gGBuffer.normal);
+    glDeleteTextures(1, &gGBuffer.depth);
+    gGBuffer = {};
+}
 
-        glfwPollEvents();
+
+// Lights the G-buffer into the scene target with a fullscreen pass, then copies its depth over so
+// what is drawn after the objects is still hidden behind them
+void UDrawDeferredLighting(const glm::mat4& view, const glm::mat4& projection)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneTarget.fbo);
+    glDisable(GL_DEPTH_TEST);
+
+    UUseObjectsProgram(gDeferredLightingProgramId, view, projection);
+    glUniform2f(glGetUniformLocation(gDeferredLightingProgramId, "drawnSize"), (float)gSceneTarget.drawnWidth, (float)gSceneTarget.drawnHeight);
+    glUniformMatrix4fv(glGetUniformLocation(gDeferredLightingProgramId, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * view)));
+
+    const GLuint textures[3] = { gGBuffer.albedo, gGBuffer.normal, gGBuffer.depth };
+    for (GLuint unit = 0; unit < 3; ++unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, textures[unit]);
     }
+    glActiveTexture(GL_TEXTURE0);
 
-    // Release mesh data
-    UDestroyMesh(gMesh);
+    glBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
 
-    // Release texture
-    UDestroyTexture(gTextureIdBody);
-    UDestroyTexture(gTextureIdHead);
-    UDestroyTexture(gTextureIdPlane);
-    UDestroyTexture(gTextureIdKeyboard);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, gGBuffer.fbo);
+    glBlitFramebuffer(0, 0, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight, 0, 0, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneTarget.fbo);
+    glEnable(GL_DEPTH_TEST);
+}
 
-    // Release shader program
-    UDestroyShaderProgram(gObjectsProgramId);
-    UDestroyShaderProgram(gLampProgramId);
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+// Allocates a color target for a post-processing pass, at the size of the scene target
+void UCreatePostTarget(PostTarget& target, GLenum format, int width, int height)
+{
+    glGenTextures(1, &target.texture);
+    glBindTexture(GL_TEXTURE_2D, target.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &target.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "Post-processing target is incomplete" << endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 
-// Initialize GLFW, GLEW, and create a window
-bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+void UDestroyPostTarget(PostTarget& target)
 {
-    // GLFW: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glDeleteFramebuffers(1, &target.fbo);
+    glDeleteTextures(1, &target.texture);
+    target = {};
+}
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-#endif
 
-    // GLFW: window creation
-    // ---------------------
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+void UDestroyRenderTargets()
+{
+    UDestroySceneTarget();
+    UDestroyPostTarget(gAntiAliased);
+    UDestroyPostTarget(gSmaaEdges);
+    UDestroyPostTarget(gSmaaWeights);
+    UDestroyGBuffer();
+}
+
+
+// Reallocates the render targets at the framebuffer size once it has settled, rather than on every
+// event of a drag-resize, and whenever the anti-aliasing mode needs other targets than the allocated ones
+void UUpdateRenderTargets(double now)
+{
+    const bool deferred = gShading == SHADING_DEFERRED;
+    const int samples = gAntiAliasing == AA_MSAA && !deferred ? gMsaaSamples : 0;
+    const bool postProcess = gAntiAliasing == AA_FXAA || gAntiAliasing == AA_SMAA;
+    const bool smaa = gAntiAliasing == AA_SMAA;
+
+    const bool resized = gFramebuffer.reallocationDue(now);
+    if (!resized && samples == gSceneTarget.samples && postProcess == (gAntiAliased.fbo != 0) && smaa == (gSmaaEdges.fbo != 0) && deferred == (gGBuffer.fbo != 0))
+        return;
+    if (resized)
+        gFramebuffer.allocated();
+
+    const int width = gFramebuffer.targetWidth();
+    const int height = gFramebuffer.targetHeight();
+    UDestroyRenderTargets();
+    UCreateSceneTarget(width, height, samples);
+    if (postProcess)
+        UCreatePostTarget(gAntiAliased, GL_RGBA8, width, height);
+    if (smaa)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
+        UCreatePostTarget(gSmaaEdges, GL_RG8, width, height);
+        UCreatePostTarget(gSmaaWeights, GL_RGBA8, width, height);
+    }
+    if (deferred)
+        UCreateGBuffer(width, height);
+}
+
+
+void UCreateGpuTimer(GpuTimer& timer)
+{
+    timer = {};
+    glGenQueries(GPU_TIMER_QUERIES, timer.queries);
+}
+
+
+void UDestroyGpuTimer(GpuTimer& timer)
+{
+    glDeleteQueries(GPU_TIMER_QUERIES, timer.queries);
+    timer = {};
+}
+
+
+// Picks up the result of the query the next timed frame reuses, if it has arrived. Returns whether it had.
+bool UReadGpuTimer(GpuTimer& timer)
+{
+    const unsigned int slot = timer.frame % GPU_TIMER_QUERIES;
+    if (!timer.pending[slot])
+        return false;
+
+    GLint available = 0;
+    glGetQueryObjectiv(timer.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
         return false;
+
+    GLuint64 elapsed = 0;   // Nanoseconds
+    glGetQueryObjectui64v(timer.queries[slot], GL_QUERY_RESULT, &elapsed);
+    timer.pending[slot] = false;
+    timer.seconds = elapsed * 1e-9;
+    timer.tag = timer.tags[slot];
+    timer.total += timer.seconds;
+    ++timer.samples;
+    return true;
+}
+
+
+// Starts timing the GPU work that follows, unless the query to reuse still waits for its result
+void UBeginGpuTimer(GpuTimer& timer, float tag)
+{
+    const unsigned int slot = timer.frame++ % GPU_TIMER_QUERIES;
+    timer.active = !timer.pending[slot];
+    if (timer.active)
+    {
+        timer.tags[slot] = tag;
+        timer.pending[slot] = true;
+        glBeginQuery(GL_TIME_ELAPSED, timer.queries[slot]);
     }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+}
 
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-    // GLEW: initialize
-    // ----------------
-    // Note: if using GLEW version 1.13 or earlier
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
+void UEndGpuTimer(GpuTimer& timer)
+{
+    if (timer.active)
+        glEndQuery(GL_TIME_ELAPSED);
+    timer.active = false;
+}
 
-    if (GLEW_OK != GlewInitResult)
+
+// Feeds the GPU times that have arrived to the resolution controller, then binds the scene target with a
+// viewport at the scale it picked and starts timing the frame
+void UBeginScenePass()
+{
+    if (UReadGpuTimer(gSceneTimer) && gDynamicResolution)
+        gResolution.update(gSceneTimer.seconds, gSceneTimer.tag);
+
+    gFramebuffer.drawSize(gDynamicResolution ? gResolution.scale() : 1.0f, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight);
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneTarget.samples > 0 ? gSceneTarget.msaaFbo : gSceneTarget.fbo);
+    glViewport(0, 0, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight);
+
+    // Tagged with the scale actually drawn at, lower than the controller's while a resize is settling
+    UBeginGpuTimer(gSceneTimer, (float)gSceneTarget.drawnHeight / (float)gFramebuffer.height());
+}
+
+
+// Draws a fullscreen pass over the drawn part of the scene into a post-processing target, reading
+// texture0 and texture1 from units 0 and 1
+void UDrawPostPass(GLuint programId, const PostTarget& target, GLuint texture0, GLuint texture1)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glViewport(0, 0, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight);
+    glUseProgram(programId);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, texture1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture0);
+
+    const float width = (float)gSceneTarget.width;
+    const float height = (float)gSceneTarget.height;
+    glUniform2i(glGetUniformLocation(programId, "drawnSize"), gSceneTarget.drawnWidth, gSceneTarget.drawnHeight);
+    glUniform2f(glGetUniformLocation(programId, "uvMax"), (gSceneTarget.drawnWidth - 0.5f) / width, (gSceneTarget.drawnHeight - 0.5f) / height);
+    glUniform2f(glGetUniformLocation(programId, "texelSize"), 1.0f / width, 1.0f / height);
+
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+
+// Runs the selected anti-aliasing over the drawn part of the scene, timed on its own, and returns the
+// texture holding the result
+GLuint UApplyAntiAliasing()
+{
+    if (gAntiAliasing == AA_NONE || (gAntiAliasing == AA_MSAA && gSceneTarget.samples == 0))
+        return gSceneTarget.color;
+
+    UReadGpuTimer(gAntiAliasingTimer);
+    UBeginGpuTimer(gAntiAliasingTimer, 0.0f);
+
+    GLuint result = gAntiAliased.texture;
+    glBindVertexArray(gFullscreenVao);
+    switch (gAntiAliasing)
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
-        return false;
+    case AA_MSAA:
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, gSceneTarget.msaaFbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, gSceneTarget.fbo);
+        glBlitFramebuffer(0, 0, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight, 0, 0, gSceneTarget.drawnWidth, gSceneTarget.drawnHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        result = gSceneTarget.color;
+        break;
+    case AA_FXAA:
+        UDrawPostPass(gFxaaProgramId, gAntiAliased, gSceneTarget.color, 0);
+        break;
+    case AA_SMAA:
+        UDrawPostPass(gSmaaEdgesProgramId, gSmaaEdges, gSceneTarget.color, 0);
+        UDrawPostPass(gSmaaWeightsProgramId, gSmaaWeights, gSmaaEdges.texture, 0);
+        UDrawPostPass(gSmaaBlendProgramId, gAntiAliased, gSceneTarget.color, gSmaaWeights.texture);
+        break;
+    default:
+        break;
+    }
+    glBindVertexArray(0);
+
+    UEndGpuTimer(gAntiAliasingTimer);
+    return result;
+}
+
+
+// Stops timing the frame, anti-aliases it and scales the drawn part of the scene target up to the window
+void UEndScenePass()
+{
+    UEndGpuTimer(gSceneTimer);
+
+    glDisable(GL_DEPTH_TEST);
+    const GLuint image = UApplyAntiAliasing();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFbo);
+    glViewport(0, 0, gFramebuffer.width(), gFramebuffer.height());
+
+    const float width = (float)gSceneTarget.width;
+    const float height = (float)gSceneTarget.height;
+    glUseProgram(gUpscaleProgramId);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, image);
+    glUniform1i(glGetUniformLocation(gUpscaleProgramId, "uScene"), 0);
+    glUniform2f(glGetUniformLocation(gUpscaleProgramId, "uvScale"), gSceneTarget.drawnWidth / width, gSceneTarget.drawnHeight / height);
+    glUniform2f(glGetUniformLocation(gUpscaleProgramId, "uvMax"), (gSceneTarget.drawnWidth - 0.5f) / width, (gSceneTarget.drawnHeight - 0.5f) / height);
+    glUniform2f(glGetUniformLocation(gUpscaleProgramId, "texelSize"), 1.0f / width, 1.0f / height);
+    glUniform1f(glGetUniformLocation(gUpscaleProgramId, "sharpness"), gSharpenUpscale ? gUpscaleSharpness : 0.0f);
+
+    glBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glEnable(GL_DEPTH_TEST);
+}
+
+
+// Creates the pixel buffers of a readback ring for frames of the given size. They are mapped for good,
+// in memory the CPU reads from quickly.
+void UCreateReadback(Readback& readback, int width, int height)
+{
+    readback.width = width;
+    readback.height = height;
+    readback.next = readback.oldest = readback.lost = 0;
+
+    const GLsizeiptr size = (GLsizeiptr)width * height * 4;
+    const GLbitfield access = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    for (ReadbackSlot& slot : readback.slots)
+    {
+        glGenBuffers(1, &slot.buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glBufferStorage(GL_PIXEL_PACK_BUFFER, size, nullptr, access | GL_CLIENT_STORAGE_BIT);
+        slot.pixels = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, access);
+        slot.fence = nullptr;
+        slot.state.store(READBACK_FREE, std::memory_order_relaxed);
+        slot.tag = 0;
     }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
 
-    // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
 
+// Every slot has to be released first
+void UDestroyReadback(Readback& readback)
+{
+    for (ReadbackSlot& slot : readback.slots)
+    {
+        glDeleteSync(slot.fence);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glDeleteBuffers(1, &slot.buffer);
+        slot.buffer = 0;
+        slot.pixels = nullptr;
+        slot.fence = nullptr;
+    }
+}
+
+
+// Queues the copy of a framebuffer into the next buffer of the ring. When that buffer is still in use,
+// the frame is dropped and false returned, or with block the call waits for the buffer instead.
+bool UReadbackFrame(Readback& readback, GLuint fbo, int tag, bool block)
+{
+    const unsigned int index = readback.next % READBACK_BUFFERS;
+    ReadbackSlot& slot = readback.slots[index];
+    if (slot.state.load(std::memory_order_acquire) != READBACK_FREE)
+    {
+        if (!block)
+            return false;
+
+        // The buffer is the oldest one: its copy has to land, then its pixels have to be released
+        while (slot.state.load(std::memory_order_acquire) == READBACK_COPYING)
+            UCollectReadbacks(readback, true);
+        while (slot.state.load(std::memory_order_acquire) != READBACK_FREE)
+            std::this_thread::yield();
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    glReadPixels(0, 0, readback.width, readback.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    slot.tag = tag;
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.state.store(READBACK_COPYING, std::memory_order_relaxed);
+    ++readback.next;
     return true;
 }
 
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
+// Hands the frames whose copies have landed to onReady, oldest first. With waitForOldest the oldest
+// copy is waited for if it has not landed yet; the others are only taken when already there.
+void UCollectReadbacks(Readback& readback, bool waitForOldest)
 {
-    static const float cameraSpeed = 2.5f;
+    bool wait = waitForOldest;
+    while (readback.oldest != readback.next)
+    {
+        const unsigned int index = readback.oldest % READBACK_BUFFERS;
+        ReadbackSlot& slot = readback.slots[index];
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+        const GLuint64 timeout = wait ? 1000000000ull : 0;   // Nanoseconds
+        const GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if (status == GL_TIMEOUT_EXPIRED)
+            return;
+        wait = false;
+
+        // A failed wait would fail again on every call; the frame is given up so the ring moves on
+        if (status == GL_WAIT_FAILED)
+        {
+            cout << "Failed to wait for the readback of frame " << slot.tag << endl;
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+            slot.state.store(READBACK_FREE, std::memory_order_release);
+            ++readback.oldest;
+            ++readback.lost;
+            continue;
+        }
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(UPWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(DOWNWARD, gDeltaTime);
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+        slot.state.store(READBACK_TAKEN, std::memory_order_relaxed);
+        ++readback.oldest;
+        readback.onReady(index);
+    }
 }
 
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
+// Gives a buffer back to the ring once its pixels are no longer needed; safe from any thread
+void UReleaseReadback(Readback& readback, unsigned int slot)
 {
-    glViewport(0, 0, width, height);
+    readback.slots[slot].state.store(READBACK_FREE, std::memory_order_release);
 }
 
 
-// glfw: whenever the mouse moves, this callback is called
-// -------------------------------------------------------
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+// Whether no buffer of the ring is copying or held by a consumer
+bool UReadbackIdle(const Readback& readback)
 {
-    if (gFirstMouse)
+    if (readback.oldest != readback.next)
+        return false;
+    for (const ReadbackSlot& slot : readback.slots)
     {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
+        if (slot.state.load(std::memory_order_acquire) != READBACK_FREE)
+            return false;
     }
+    return true;
+}
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
 
-    gLastX = xpos;
-    gLastY = ypos;
+// Writes the next frame to a PNG file. Like UCaptureNextFrame, the request is served by the next frame
+// rendered that finds a free buffer, and finishes in the background.
+void UCaptureScreenshot(const std::string& path)
+{
+    CaptureRequest request;
+    request.path = path;
+    gCaptureQueue.push_back(request);
+}
+
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
+// Hands the pixels of the next frame to callback on a capture thread: RGBA, bottom row first, valid
+// until the callback returns
+void UCaptureNextFrame(std::function<void(const unsigned char* pixels, int width, int height)> callback)
+{
+    CaptureRequest request;
+    request.callback = callback;
+    gCaptureQueue.push_back(request);
 }
 
 
-// glfw: whenever the mouse scroll wheel scrolls, this callback is called
-// ----------------------------------------------------------------------
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+// Waits until every frame captured so far is written or handed to its callback
+void UFinishCaptures()
 {
-    gCamera.ProcessMouseScroll(yoffset);
+    while (gCapture.oldest != gCapture.next)
+        UCollectReadbacks(gCapture, true);
+    if (gCaptureEncoders)
+        gCaptureEncoders->wait();
 }
 
-// glfw: handle mouse button events
-// --------------------------------
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+
+// Copies the frame just drawn into the capture ring when a capture was requested or a sequence is
+// being recorded, and hands the frames whose copies have landed to the encoders. A frame finding every
+// buffer busy is not captured rather than waited for: a screenshot moves on to the next frame, and a
+// recording counts it as dropped.
+void UCaptureFrame()
 {
-    switch (button)
+    UCollectReadbacks(gCapture, false);
+    if (gCaptureQueue.empty() && !gRecording)
+        return;
+
+    // The ring follows the framebuffer size, once the frames of the old size are done with
+    if (gCapture.width != gFramebuffer.width() || gCapture.height != gFramebuffer.height())
     {
-    case GLFW_MOUSE_BUTTON_LEFT:
+        if (!UReadbackIdle(gCapture))
+            return;
+        UDestroyReadback(gCapture);
+        UCreateReadback(gCapture, gFramebuffer.width(), gFramebuffer.height());
+    }
+
+    CaptureRequest request;
+    if (!gCaptureQueue.empty())
+        request = gCaptureQueue.front();
+    else
     {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
+        char name[32];
+        snprintf(name, sizeof(name), "_%05u.png", gRecordedFrames);
+        request.path = gCapturePrefix + name;
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
+    const unsigned int slot = gCapture.next % READBACK_BUFFERS;
+    if (!UReadbackFrame(gCapture, 0, 0, false))
     {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
+        if (gCaptureQueue.empty())
+            ++gDroppedFrames;
+        return;
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
+    gCaptureRequests[slot] = request;
+    if (!gCaptureQueue.empty())
+        gCaptureQueue.pop_front();
+    else
+        ++gRecordedFrames;
+}
+
+
+// Encodes a captured frame on a capture thread, or hands it to the callback of its request there
+void UEncodeCapture(unsigned int slot)
+{
+    if (!gCaptureEncoders)
+        gCaptureEncoders.reset(new TaskQueue(CAPTURE_ENCODER_THREADS));
+
+    const CaptureRequest request = gCaptureRequests[slot];
+    gCaptureRequests[slot] = CaptureRequest();
+    const int width = gCapture.width;
+    const int height = gCapture.height;
+    gCaptureEncoders->push([request, slot, width, height]()
     {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
+        const unsigned char* pixels = gCapture.slots[slot].pixels;
+        if (request.callback)
+            request.callback(pixels, width, height);
+        else if (!UWritePng(request.path, pixels + (size_t)(height - 1) * width * 4, width, height, -(ptrdiff_t)width * 4))
+            cout << "Failed to write " << request.path << endl;
+        UReleaseReadback(gCapture, slot);
+    });
+}
+
+
+// Checks the capture path end to end: frames cleared to colors that number them are captured through
+// UCaptureNextFrame, more of them than the ring has buffers, and every request has to come back whole,
+// from a frame no earlier than the one it was made in, in order. Run with --check-capture; like the GPU
+// culling check it also runs on software GL.
+bool UCheckCapture()
+{
+    const unsigned int requestCount = READBACK_BUFFERS * 4;
+    struct Result
+    {
+        bool received = false;
+        bool uniform = true;
+        unsigned int frame = 0;     // Frame the pixels came from, read back from their color
+    };
+    std::vector<Result> results(requestCount);
+
+    gCapture.onReady = UEncodeCapture;
+    UCreateReadback(gCapture, gFramebuffer.width(), gFramebuffer.height());
+
+    // A request finding every buffer busy waits for a later frame, so frames go on until all are taken
+    for (unsigned int frame = 0; frame < requestCount || !gCaptureQueue.empty(); ++frame)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glClearColor((frame & 0xff) / 255.0f, ((frame >> 8) & 0xff) / 255.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        if (frame < requestCount)
+        {
+            Result& result = results[frame];
+            UCaptureNextFrame([&result](const unsigned char* pixels, int width, int height)
+            {
+                const size_t bytes = (size_t)width * height * 4;
+                result.frame = pixels[0] | (pixels[1] << 8);
+                for (size_t i = 0; i < bytes && result.uniform; i += 4)
+                    result.uniform = pixels[i] == pixels[0] && pixels[i + 1] == pixels[1];
+                result.received = true;
+            });
+        }
+        UCaptureFrame();
+        glfwSwapBuffers(gWindow);
     }
-    break;
+    UFinishCaptures();
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
+    unsigned int failures = 0;
+    for (unsigned int request = 0; request < requestCount; ++request)
+    {
+        const Result& result = results[request];
+        const bool inOrder = request == 0 || result.frame > results[request - 1].frame;
+        if (!result.received || !result.uniform || result.frame < request || !inOrder)
+            ++failures;
+    }
+    cout << "Capture check: " << (failures == 0 ? "passed" : to_string(failures) + " of " + to_string(requestCount) + " captures wrong") << endl;
+    return failures == 0;
+}
+
+
+// Opens the stream the options ask for, if any, at a size kept for the whole stream:
+// --stream-video starts ffmpeg to encode into that file at --stream-fps frames per second, --stream-shm
+// creates a shared-memory ring of that name. --stream-backpressure picks between dropping frames the
+// consumer is too slow for and blocking until it catches up, for up to --stream-timeout seconds before
+// the consumer is taken for gone. Returns false when a stream was asked for but could not be opened.
+bool UStartStream(int width, int height, bool blockByDefault)
+{
+    const std::string video = gOptions.getString("stream-video", "");
+    const std::string shm = gOptions.getString("stream-shm", "");
+    if (video.empty() && shm.empty())
+        return true;
+
+    gStreamBlocking = gOptions.getString("stream-backpressure", blockByDefault ? "block" : "drop") == "block";
+    gStreamFps = std::max(gOptions.getNumber("stream-fps", gFramePacer.targetFps() > 0.0 ? gFramePacer.targetFps() : 60.0), 1.0);
+    if (!video.empty())
+    {
+        // Rows arrive bottom first, so the encoder flips them
+        std::ostringstream command;
+        command << gOptions.getString("stream-ffmpeg", "ffmpeg") << " -loglevel error -y -f rawvideo -pixel_format rgba"
+            << " -video_size " << width << "x" << height << " -framerate " << gStreamFps << " -i - -vf vflip "
+            << gOptions.getString("stream-encoder-args", "-c:v libx264 -preset veryfast -pix_fmt yuv420p") << " \"" << video << "\"";
+        if (!gStream.openPipe(command.str(), width, height))
+        {
+            cout << "Failed to start " << command.str() << endl;
+            return false;
+        }
+    }
+    else if (!gStream.openSharedMemory(shm, width, height, std::max(2u, (unsigned int)gOptions.getNumber("stream-shm-frames", 4))))
+    {
+        cout << "Failed to create the shared memory ring " << shm << endl;
+        return false;
     }
+    gStream.setTimeout(std::max(gOptions.getNumber("stream-timeout", 5.0), 0.0));
+
+    gStreamFrames = 0;
+    gStreamDropped = 0;
+    gStreamStart = -1.0;
+    gStreamLastFrame = -1;
+    gStreamWriter.reset(new TaskQueue(1));
+    UCreateReadback(gStreamReadback, width, height);
+    gStreamReadback.onReady = [](unsigned int slot)
+    {
+        gStreamWriter->push([slot]()
+        {
+            // An encoder reads the pipe as frames of a constant rate, so each frame fills the ticks of the
+            // clock up to its own: it is repeated over frames dropped or late, and left out when the frame
+            // before already took its tick. The ring hands every frame over once.
+            const int tick = gStreamReadback.slots[slot].tag;
+            const int copies = gStream.isPipe() ? tick - gStreamLastFrame : 1;
+            const bool failedBefore = gStream.failed();
+            bool written = true;
+            for (int copy = 0; copy < copies && written; ++copy)
+                written = gStream.write(gStreamReadback.slots[slot].pixels, gStreamBlocking);
+            if (!failedBefore && gStream.failed())
+                cout << "The stream consumer stopped taking frames; the rest are dropped" << endl;
+            if (!written)
+                ++gStreamDropped;
+            else if (copies > 0)
+            {
+                gStreamFrames += copies;
+                gStreamLastFrame = tick;
+            }
+            UReleaseReadback(gStreamReadback, slot);
+        });
+    };
+    return true;
 }
 
 
-// Functioned called to render a frame
-void URender()
+// Reads a frame of fbo back for the stream, scaled first when fbo has another size than the stream.
+// time, in seconds, places the frame on the stream's clock, counted from the first frame streamed.
+// Without blocking back-pressure, a frame finding every readback buffer still queued for the writer is
+// dropped, so rendering never waits for the consumer.
+void UStreamFrame(GLuint fbo, int width, int height, double time)
 {
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
+    if (!gStream.isOpen())
+        return;
+    if (gStreamStart < 0.0)
+        gStreamStart = time;
 
-    // Clear the frame and z buffers
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    UCollectReadbacks(gStreamReadback, false);
 
-    /// Pencil Part 1 - BODY
-    ///----------------------
-    glBindVertexArray(gMesh.vaoBP);
-    glUseProgram(gObjectsProgramId);
+    if (width != gStreamReadback.width || height != gStreamReadback.height)
+    {
+        if (gStreamTarget.fbo == 0)
+            UCreatePostTarget(gStreamTarget, GL_RGBA8, gStreamReadback.width, gStreamReadback.height);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, gStreamTarget.fbo);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, gStreamReadback.width, gStreamReadback.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        fbo = gStreamTarget.fbo;
+    }
 
-    glm::mat4 scale = glm::scale(glm::vec3(0.5f, 3.0f, 0.5f));
-    glm::mat4 rotation = glm::rotate(90.0f, glm::vec3(90.0, 10.0f, 0.0f));
-    glm::mat4 translation = glm::translate(glm::vec3(5.0f, 0.0f, 1.0f));
-    glm::mat4 model = translation * rotation * scale;
+    const int tick = (int)std::floor((time - gStreamStart) * gStreamFps + 0.5);
+    if (!UReadbackFrame(gStreamReadback, fbo, tick, gStreamBlocking))
+        ++gStreamDropped;
+}
 
-    glm::mat4 view = gCamera.GetViewMatrix();
 
-    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+// Sends the frames still in flight, then closes the stream, waiting for an encoder to finish its file
+void UStopStream()
+{
+    if (!gStream.isOpen())
+        return;
+
+    while (gStreamReadback.oldest != gStreamReadback.next)
+        UCollectReadbacks(gStreamReadback, true);
+    gStreamWriter->wait();
+    gStreamWriter.reset();
+    UDestroyReadback(gStreamReadback);
+    if (gStreamTarget.fbo != 0)
+        UDestroyPostTarget(gStreamTarget);
+
+    gStream.close();
+    cout << "Streamed " << gStreamFrames << " frames, dropped " << gStreamDropped << endl;
+}
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gObjectsProgramId, "projection");
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+// Reads camera poses, one per line as "x y z yaw pitch [zoom]", '#' starting a comment
+bool ULoadBatchPoses(const std::string& path, std::vector<BatchPose>& poses)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
 
-    // Reference matrix uniforms from the Cube Shader program for the cub color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gObjectsProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gObjectsProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gObjectsProgramId, "lightPos");
-    GLint lightPositionLoc2 = glGetUniformLocation(gObjectsProgramId, "lightPos2");
-    GLint viewPositionLoc = glGetUniformLocation(gObjectsProgramId, "viewPosition");
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number)
+    {
+        std::istringstream fields(line.substr(0, line.find('#')));
+        BatchPose pose;
+        pose.zoom = ZOOM;
+        if (!(fields >> pose.position.x))
+            continue;
+
+        // The zoom is optional, but whatever follows the pitch has to be one, and nothing may follow it
+        bool valid = (bool)(fields >> pose.position.y >> pose.position.z >> pose.yaw >> pose.pitch);
+        if (valid && !(fields >> std::ws).eof())
+            valid = (fields >> pose.zoom) && (fields >> std::ws).eof();
+        if (!valid)
+        {
+            cout << path << ":" << number << ": expected x y z yaw pitch [zoom]" << endl;
+            return false;
+        }
+        poses.push_back(pose);
+    }
+    return true;
+}
 
-    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
 
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    
-    GLint UVScaleLoc = glGetUniformLocation(gObjectsProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+// Renders every pose of the file into a PNG image named after --batch-output and the pose's index.
+// Frames go through the readback ring and are encoded on background threads while the next ones
+// render, so the GPU only waits when every buffer is still held by an encoder.
+bool URunBatch(const std::string& posesPath)
+{
+    std::vector<BatchPose> poses;
+    if (!ULoadBatchPoses(posesPath, poses))
+    {
+        cout << "Failed to read camera poses from " << posesPath << endl;
+        return false;
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdBody);
+    const int width = (int)gOptions.getNumber("batch-width", WINDOW_WIDTH);
+    const int height = (int)gOptions.getNumber("batch-height", WINDOW_HEIGHT);
+    const std::string prefix = gOptions.getString("batch-output", "pose");
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
+    // Stills are drawn at full resolution. Occlusion queries are answered within the frame, so they
+    // stay as the options set them even though every frame has a different camera.
+    gDynamicResolution = false;
 
-    /// Pencil Part 2 - NIB
-    ///--------------------
-    glBindVertexArray(gMesh.vaoNP);
-    glUseProgram(gObjectsProgramId);
-        
-    glm::mat4 scale2 = glm::scale(glm::vec3(0.25f, 0.5f, 0.25f));
-    glm::mat4 rotation2 = glm::rotate(45.0f, glm::vec3(-95.0f, 0.0f, 30.0f));
-    glm::mat4 translation2 = glm::translate(glm::vec3(4.6f, 0.9f, -0.8f));
-    glm::mat4 model2 = translation2 * rotation2 * scale2;
+    // Offscreen, the size is final at once
+    gFramebuffer.resize(width, height, 0.0);
+    UUpdateRenderTargets(FRAMEBUFFER_SETTLE_TIME);
+    PostTarget output = {};
+    UCreatePostTarget(output, GL_RGBA8, width, height);
+    gOutputFbo = output.fbo;
 
-    glm::mat4 view2 = gCamera.GetViewMatrix();
+    // With a stream configured the frames go to it, in place of the PNG files
+    if (!UStartStream(width, height, true))
+    {
+        gOutputFbo = 0;
+        UDestroyPostTarget(output);
+        return false;
+    }
+    const bool streaming = gStream.isOpen();
 
-    glm::mat4 projection2 = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    TaskQueue encoders(std::max(1u, std::thread::hardware_concurrency() - 1));
+    std::atomic<unsigned int> failures(0);
+    Readback readback;
+    UCreateReadback(readback, width, height);
+    readback.onReady = [&](unsigned int slot)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "_%05d.png", readback.slots[slot].tag);
+        const std::string path = prefix + name;
+        encoders.push([&readback, &failures, slot, path, width, height]()
+        {
+            // Rows come bottom first from OpenGL
+            const unsigned char* lastRow = readback.slots[slot].pixels + (size_t)(height - 1) * width * 4;
+            if (!UWritePng(path, lastRow, width, height, -(ptrdiff_t)width * 4))
+            {
+                cout << "Failed to write " << path << endl;
+                ++failures;
+            }
+            UReleaseReadback(readback, slot);
+        });
+    };
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc2 = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc2 = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc2 = glGetUniformLocation(gObjectsProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc2, 1, GL_FALSE, glm::value_ptr(model2));
-    glUniformMatrix4fv(viewLoc2, 1, GL_FALSE, glm::value_ptr(view2));
-    glUniformMatrix4fv(projLoc2, 1, GL_FALSE, glm::value_ptr(projection2));
-    
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdHead);
+    const double start = glfwGetTime();
+    for (size_t i = 0; i < poses.size(); ++i)
+    {
+        gCamera = Camera(poses[i].position, glm::vec3(0.0f, 1.0f, 0.0f), poses[i].yaw, poses[i].pitch);
+        gCamera.Zoom = poses[i].zoom;
 
-    glDrawArrays(GL_TRIANGLES, 0, 18);
+        URenderScene();
+        if (streaming)
+            UStreamFrame(gOutputFbo, width, height, i / gStreamFps);
+        else
+        {
+            UReadbackFrame(readback, gOutputFbo, (int)i, true);
+            UCollectReadbacks(readback, false);
+        }
+    }
+    while (readback.oldest != readback.next)
+        UCollectReadbacks(readback, true);
+    encoders.wait();
+    const unsigned int dropped = gStreamDropped;
+    UStopStream();
+
+    const double elapsed = glfwGetTime() - start;
+    cout << "Rendered " << poses.size() << " poses in " << elapsed << " s, " << poses.size() / elapsed << " frames per second" << endl;
+
+    UDestroyReadback(readback);
+    gOutputFbo = 0;
+    UDestroyPostTarget(output);
+    return failures == 0 && dropped == 0 && readback.lost == 0;
+}
 
-    /// Plane
-    ///---------
-    glBindVertexArray(gMesh.vaoBP);
-    glUseProgram(gObjectsProgramId);
 
-    glm::mat4 scale3 = glm::scale(glm::vec3(13.0f, 10.0f, 0.5f));
-    glm::mat4 rotation3 = glm::rotate(90.0f, glm::vec3(90.0f, 0.0f, 0.0f));
-    glm::mat4 translation3 = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
-    glm::mat4 model3 = translation3 * rotation3 * scale3;
+// Allocates the shadow atlas, a depth texture compared against in the shaders, filtered so each lookup
+// blends four comparisons
+void UCreateShadowAtlas()
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    gShadowTileSize = std::min(std::max(gShadowTileSize, 64), (int)maxSize / SHADOW_ATLAS_ROWS);
+
+    glGenTextures(1, &gShadowAtlas);
+    glBindTexture(GL_TEXTURE_2D, gShadowAtlas);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, SHADOW_ATLAS_COLUMNS * gShadowTileSize, SHADOW_ATLAS_ROWS * gShadowTileSize);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &gShadowFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gShadowFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gShadowAtlas, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "Shadow atlas is incomplete" << endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    gShadowCache.reset();
+}
 
-    glm::mat4 view3 = gCamera.GetViewMatrix();
 
-    glm::mat4 projection3 = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+void UDestroyShadowAtlas()
+{
+    glDeleteFramebuffers(1, &gShadowFbo);
+    glDeleteTextures(1, &gShadowAtlas);
+    gShadowFbo = 0;
+    gShadowAtlas = 0;
+}
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc3 = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc3 = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc3 = glGetUniformLocation(gObjectsProgramId, "projection");
 
-    glUniformMatrix4fv(modelLoc3, 1, GL_FALSE, glm::value_ptr(model3));
-    glUniformMatrix4fv(viewLoc3, 1, GL_FALSE, glm::value_ptr(view3));
-    glUniformMatrix4fv(projLoc3, 1, GL_FALSE, glm::value_ptr(projection3));
+// Brings the combined layer of the shadow atlas up to date. The static layer is drawn when the light
+// moved or the cache was reset, and a face of the combined layer when a movable object moved into or out
+// of it: its static tile is copied back, then the movable objects are drawn over it. In a still scene
+// nothing is drawn at all.
+void UUpdateShadows()
+{
+    if (!gShadows)
+        return;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdPlane);
+    // Immovable objects only move when the scene is edited, which is rare enough to start over
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (!gSceneObjects[i].movable && gSceneGraph.changed((int)i))
+        {
+            gShadowCache.reset();
+            break;
+        }
+    }
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
+    const bool drawStatic = gShadowCache.begin(gLightPosition, gSceneObjects.size());
+    if (drawStatic)
+    {
+        for (int face = 0; face < SHADOW_FACES; ++face)
+        {
+            gShadowFaceViewProjections[face] = UShadowFaceViewProjection(gLightPosition, face);
+            gShadowFaceFrusta[face] = UExtractFrustum(gShadowFaceViewProjections[face]);
+            gShadowMatrices[face] = UShadowTileMatrix(face) * gShadowFaceViewProjections[face];
+        }
+    }
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (!gSceneObjects[i].movable || !(drawStatic || gSceneGraph.changed((int)i)))
+            continue;
 
-    /// Keyboard
-    ///------------
-    glBindVertexArray(gMesh.vaoKB);
-    glUseProgram(gObjectsProgramId);
+        const glm::vec3 center(gObjectBounds.centerX[i], gObjectBounds.centerY[i], gObjectBounds.centerZ[i]);
+        const glm::vec3 extent(gObjectBounds.extentX[i], gObjectBounds.extentY[i], gObjectBounds.extentZ[i]);
+        gShadowCache.casterMoved(i, UShadowFacesOfBox(gShadowFaceFrusta, center, extent));
+    }
 
-    glm::mat4 scale4 = glm::scale(glm::vec3(7.0f, 4.0f, 0.1f));
-    glm::mat4 rotation4 = glm::rotate(90.0f, glm::vec3(90.0f, 0.0f, 0.0f));
-    glm::mat4 translation4 = glm::translate(glm::vec3(-2.1f, 1.5f, -2.3f));
-    glm::mat4 model4 = translation4 * rotation4 * scale4;
+    const unsigned int dirty = gShadowCache.dirtyFaces();
+    if (dirty == 0)
+        return;
+
+    // Slope-scaled offsets keep surfaces facing the light from shadowing themselves
+    glBindFramebuffer(GL_FRAMEBUFFER, gShadowFbo);
+    glEnable(GL_SCISSOR_TEST);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(SHADOW_SLOPE_BIAS, SHADOW_CONSTANT_BIAS);
+    glUseProgram(gDepthProgramId);
+    const glm::mat4 identity(1.0f);
+    glUniformMatrix4fv(glGetUniformLocation(gDepthProgramId, "view"), 1, GL_FALSE, glm::value_ptr(identity));
+    const GLint projectionLoc = glGetUniformLocation(gDepthProgramId, "projection");
+    const GLint modelLoc = glGetUniformLocation(gDepthProgramId, "model");
+
+    for (int face = 0; face < SHADOW_FACES; ++face)
+    {
+        if (!(dirty & (1u << face)))
+            continue;
+
+        glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(gShadowFaceViewProjections[face]));
+        if (drawStatic)
+            UDrawShadowCasters(face, SHADOW_STATIC, false, modelLoc);
+
+        const glm::ivec2 from = UShadowTile(face, SHADOW_STATIC) * gShadowTileSize;
+        const glm::ivec2 to = UShadowTile(face, SHADOW_COMBINED) * gShadowTileSize;
+        glCopyImageSubData(gShadowAtlas, GL_TEXTURE_2D, 0, from.x, from.y, 0, gShadowAtlas, GL_TEXTURE_2D, 0, to.x, to.y, 0, gShadowTileSize, gShadowTileSize, 1);
+        UDrawShadowCasters(face, SHADOW_COMBINED, true, modelLoc);
+        ++gShadowFacesDrawn;
+    }
 
-    glm::mat4 view4 = gCamera.GetViewMatrix();
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-    glm::mat4 projection4 = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc4 = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc4 = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc4 = glGetUniformLocation(gObjectsProgramId, "projection");
+// Draws the immovable or the movable objects reaching into a face into its tile of a layer, at their
+// finest level of detail. The static layer is cleared first; the combined one already holds the static
+// tile. The depth program has to be bound with the face's view-projection.
+void UDrawShadowCasters(int face, ShadowLayer layer, bool movable, GLint modelLoc)
+{
+    const glm::ivec2 tile = UShadowTile(face, layer) * gShadowTileSize;
+    glViewport(tile.x, tile.y, gShadowTileSize, gShadowTileSize);
+    glScissor(tile.x, tile.y, gShadowTileSize, gShadowTileSize);
+    if (layer == SHADOW_STATIC)
+        glClear(GL_DEPTH_BUFFER_BIT);
 
-    glUniformMatrix4fv(modelLoc4, 1, GL_FALSE, glm::value_ptr(model4));
-    glUniformMatrix4fv(viewLoc4, 1, GL_FALSE, glm::value_ptr(view4));
-    glUniformMatrix4fv(projLoc4, 1, GL_FALSE, glm::value_ptr(projection4));
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        const SceneObject& object = gSceneObjects[i];
+        if (object.movable != movable)
+            continue;
+        if (movable && !(gShadowCache.casterFaces(i) & (1u << face)))
+            continue;
+        if (!movable && !UBoxInFrustum(gShadowFaceFrusta[face], glm::vec3(gObjectBounds.centerX[i], gObjectBounds.centerY[i], gObjectBounds.centerZ[i]), glm::vec3(gObjectBounds.extentX[i], gObjectBounds.extentY[i], gObjectBounds.extentZ[i])))
+            continue;
+
+        const GLLodLevel& level = object.mesh == SCENE_MESH_CUBE ? gMesh.cubeLod[0] : USelectObjectLod(object, gObjectModels[i], 0);
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(gObjectModels[i]));
+        UDrawLodLevel(level);
+    }
+    glBindVertexArray(0);
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdKeyboard);
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
+// Replaces the point lights with count lights spread evenly over the desk, along a golden-angle
+// spiral, in colors going around the hue circle
+void UScatterPointLights(unsigned int count)
+{
+    const float GOLDEN_ANGLE = 2.39996323f;
+    const glm::vec2 deskHalfSize(6.0f, 4.5f);
 
-    ///Brown Paper
-    ///-----------
-    glBindVertexArray(gMesh.vaoBP);
-    glUseProgram(gObjectsProgramId);
+    gPointLights.resize(count);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        const float radius = std::sqrt((i + 0.5f) / count);
+        const float angle = i * GOLDEN_ANGLE;
+        const glm::vec2 position = glm::vec2(std::cos(angle), std::sin(angle)) * radius * deskHalfSize;
+        const float hue = std::fmod(i * 0.618034f, 1.0f) * 6.0f;
+        const glm::vec3 color = glm::clamp(glm::vec3(std::fabs(hue - 3.0f) - 1.0f, 2.0f - std::fabs(hue - 2.0f), 2.0f - std::fabs(hue - 4.0f)), 0.0f, 1.0f);
+
+        gPointLights[i].positionRadius = glm::vec4(position.x, POINT_LIGHT_HEIGHT, position.y, gPointLightRadius);
+        gPointLights[i].color = glm::vec4(color * POINT_LIGHT_INTENSITY, 0.0f);
+    }
+    gPointLightsChanged = true;
+}
 
-    glm::mat4 scale6 = glm::scale(glm::vec3(2.0f, 3.5f, 0.1f));
-    glm::mat4 rotation6 = glm::rotate(90.0f, glm::vec3(90.0f, -6.0f, 5.0f));
-    glm::mat4 translation6 = glm::translate(glm::vec3(0.0f, -0.5f, 1.7f));
-    glm::mat4 model6 = translation6 * rotation6 * scale6;
 
-    glm::mat4 view6 = gCamera.GetViewMatrix();
+// Lists the point lights of every cluster for this frame's camera on the job system, and hands the
+// lists, with the lights when they changed, to the storage buffers the objects shader reads
+void UUpdateLightClusters(const glm::mat4& view, const glm::mat4& projection)
+{
+    if (gPointLights.empty())
+        return;
 
-    glm::mat4 projection6 = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    if (gPointLightsChanged)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gPointLightBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, gPointLights.size() * sizeof(PointLight), gPointLights.data(), GL_STATIC_DRAW);
+        gPointLightsChanged = false;
+    }
 
-    //// Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc6 = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc6 = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc6 = glGetUniformLocation(gObjectsProgramId, "projection");
+    gLightClusters.build(gPointLights, view, projection, CAMERA_NEAR, CAMERA_FAR);
 
-    glUniformMatrix4fv(modelLoc6, 1, GL_FALSE, glm::value_ptr(model6));
-    glUniformMatrix4fv(viewLoc6, 1, GL_FALSE, glm::value_ptr(view6));
-    glUniformMatrix4fv(projLoc6, 1, GL_FALSE, glm::value_ptr(projection6));
+    const std::vector<glm::uvec2>& cells = gLightClusters.cells();
+    const std::vector<unsigned int>& indices = gLightClusters.indices();
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gClusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, cells.size() * sizeof(glm::uvec2), cells.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gClusterLightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STREAM_DRAW);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdPaper);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, gPointLightBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, gClusterBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, gClusterLightBuffer);
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-    
-    /// Lined Paper
-    ///-------------
-    glBindVertexArray(gMesh.vaoBP);
-    glUseProgram(gObjectsProgramId);
 
-    glm::mat4 scale7 = glm::scale(glm::vec3(2.0f, 3.5f, 0.1f));
-    glm::mat4 rotation7 = glm::rotate(90.0f, glm::vec3(90.0f, -6.0f, 5.0f));
-    glm::mat4 translation7 = glm::translate(glm::vec3(0.5f, -0.3f, 1.5f));
-    glm::mat4 model7 = translation7 * rotation7 * scale7;
+// Shows the culling counters of the frame and the enabled options in the window title whenever they change
+void UReportFrameStats()
+{
+    static string reported;
+
+    string title = string(WINDOW_TITLE) + " - drawn " + to_string(gFrameStats.drawn) + ", culled " + to_string(gFrameStats.culled);
+    if (gFrameStats.occluded > 0)
+        title += ", occluded " + to_string(gFrameStats.occluded);
+    if (gOcclusionCulling && !gIndirectDraw)
+        title += " [occlusion queries]";
+    if (gHiZCulling)
+        title += " [Hi-Z]";
+    if (gDepthPrePass)
+        title += " [depth pre-pass]";
+    if (gIndirectDraw)
+        title += " [multi-draw indirect]";
+    if (gGpuCulling && gIndirectDraw)
+        title += " [GPU culling, counts a frame late]";
+    if (gStaticBatching)
+        title += " [static batches: " + to_string(gStaticBatches.size()) + "]";
+
+    // Pacing figures change once a second, so the title is not set every frame
+    char pacing[64];
+    snprintf(pacing, sizeof(pacing), " - %.1f fps, jitter %.2f ms", gFramePacer.fps(), gFramePacer.jitter() * 1000.0);
+    title += pacing;
+
+    // GPU times are averaged over a second too
+    static double gpuReportTime = 0.0;
+    static string gpuTimes;
+    const double now = glfwGetTime();
+    if (now - gpuReportTime >= 1.0)
+    {
+        char text[64];
+        gpuReportTime = now;
+        gpuTimes.clear();
+        if (gSceneTimer.samples > 0)
+        {
+            snprintf(text, sizeof(text), ", GPU scene %.2f ms", gSceneTimer.total / gSceneTimer.samples * 1000.0);
+            gpuTimes += text;
+        }
+        if (gAntiAliasing != AA_NONE && gAntiAliasingTimer.samples > 0)
+        {
+            snprintf(text, sizeof(text), ", anti-aliasing %.2f ms", gAntiAliasingTimer.total / gAntiAliasingTimer.samples * 1000.0);
+            gpuTimes += text;
+        }
+        if (gShadows)
+        {
+            snprintf(text, sizeof(text), ", shadow faces drawn %u", gShadowFacesDrawn);
+            gpuTimes += text;
+        }
+        gShadowFacesDrawn = 0;
+        gSceneTimer.total = gAntiAliasingTimer.total = 0.0;
+        gSceneTimer.samples = gAntiAliasingTimer.samples = 0;
+    }
+    title += gpuTimes;
+    if (gFramePacer.lowLatency())
+        title += " [low latency]";
+    if (gDynamicResolution)
+        title += " [dynamic resolution " + to_string((int)(gResolution.scale() * 100.0f + 0.5f)) + "%]";
+    if (gSharpenUpscale)
+        title += " [sharpened]";
+    if (gShadows)
+        title += " [shadows]";
+    if (!gPointLights.empty())
+        title += " [lights: " + to_string(gPointLights.size()) + ", up to " + to_string(gLightClusters.maxLights()) + " per cluster]";
+    if (gRecording)
+        title += " [recording]";
+    if (gStream.isOpen())
+        title += " [streaming]";
+    if (gShading != SHADING_FORWARD)
+        title += " [shading: " + string(SHADING_MODE_NAMES[gShading]) + "]";
+    if (gAntiAliasing == AA_MSAA && gSceneTarget.samples == 0)
+        title += " [anti-aliasing: msaa, off with deferred shading]";
+    else if (gAntiAliasing == AA_MSAA)
+        title += " [anti-aliasing: msaa " + to_string(gSceneTarget.samples) + "x]";
+    else if (gAntiAliasing != AA_NONE)
+        title += " [anti-aliasing: " + string(AA_MODE_NAMES[gAntiAliasing]) + "]";
+
+    if (title != reported)
+    {
+        reported = title;
+        glfwSetWindowTitle(gWindow, title.c_str());
+    }
+}
 
-    glm::mat4 view7 = gCamera.GetViewMatrix();
 
-    glm::mat4 projection7 = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+// Rasterizes the occluders into the Hi-Z buffer, then tests the boxes of the other objects left by the
+// frustum test against it on worker threads, clearing the visibility of the hidden ones
+void UCullOccludedObjects(const glm::mat4& viewProjection)
+{
+    gHiZBuffer.clear();
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (!gSceneObjects[i].occluder || !gObjectVisible[i])
+            continue;
 
-    //////// Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc7 = glGetUniformLocation(gObjectsProgramId, "model");
-    GLint viewLoc7 = glGetUniformLocation(gObjectsProgramId, "view");
-    GLint projLoc7 = glGetUniformLocation(gObjectsProgramId, "projection");
+        // Occluders are drawn as their object-space boxes, which are exact for the box-shaped desk objects
+        const Bounds& local = USelectObjectLod(gSceneObjects[i], gObjectModels[i], 0).bounds;
+        gHiZBuffer.rasterizeBox(viewProjection * gObjectModels[i], local.center, local.extent);
+    }
+    gHiZBuffer.buildPyramid();
 
-    glUniformMatrix4fv(modelLoc7, 1, GL_FALSE, glm::value_ptr(model7));
-    glUniformMatrix4fv(viewLoc7, 1, GL_FALSE, glm::value_ptr(view7));
-    glUniformMatrix4fv(projLoc7, 1, GL_FALSE, glm::value_ptr(projection7));
+    // A hidden object baked into a batch is still drawn with it, so only the objects drawn alone count
+    std::atomic<unsigned int> occluded(0);
+    const unsigned int objectCount = (unsigned int)gSceneObjects.size();
+    UParallelForRange(objectCount, HIZ_TEST_BATCH, [&](unsigned int begin, unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            // An occluder would only hide itself
+            if (!gObjectVisible[i] || gSceneObjects[i].occluder)
+                continue;
+
+            glm::vec3 center(gObjectBounds.centerX[i], gObjectBounds.centerY[i], gObjectBounds.centerZ[i]);
+            glm::vec3 extent(gObjectBounds.extentX[i], gObjectBounds.extentY[i], gObjectBounds.extentZ[i]);
+            if (!gHiZBuffer.isBoxVisible(viewProjection, center, extent))
+            {
+                gObjectVisible[i] = 0;
+                if (UDrawnAlone(i))
+                    ++occluded;
+            }
+        }
+    });
+    gFrameStats.occluded = occluded;
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdNotebook);
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
+// Lays the depth of the visible occluders, then tests the boxes of the other objects of gDrawOrder against it.
+// The results drive the conditional rendering of this frame's draws; the depth is cleared before they start.
+void URenderOcclusionQueries(const glm::mat4& view, const glm::mat4& projection, int pencilLod)
+{
+    std::fill(gOcclusionIssued.begin(), gOcclusionIssued.end(), 0);
 
+    // Only the occluders go in the depth buffer, so a box is never hidden by the object it encloses
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    GLint modelLoc = UUseObjectsProgram(gDepthProgramId, view, projection);
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        if (!gSceneObjects[i].occluder || !gObjectVisible[i])
+            continue;
 
-    /// Lamp
-    ///---------
-    glBindVertexArray(gMesh.vaoKB);
-    glUseProgram(gLampProgramId);
+        const GLLodLevel& level = USelectObjectLod(gSceneObjects[i], gObjectModels[i], pencilLod);
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(gObjectModels[i]));
+        UDrawLodLevel(level);
+    }
 
-    glm::mat4 scale5 = glm::scale(glm::vec3(1.5f, 1.5f, 1.5f));
-    glm::mat4 rotation5 = glm::rotate(90.0f, glm::vec3(1.0, 1.0f, 1.0f));
-    glm::mat4 translation5 = glm::translate(glm::vec3(0.0f, 7.0f, -6.0f));
-    glm::mat4 model5 = translation5 * rotation5 * scale5;
+    // Boxes only need depth testing: no color or depth writes. A box face lying on an occluder still counts.
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL);
 
-    glm::mat4 view5 = gCamera.GetViewMatrix();
+    // The lamp program draws plain geometry, and the keyboard cube spans -0.5 to 0.5 like a unit box
+    glUseProgram(gLampProgramId);
+    glBindVertexArray(gMesh.vaoKB);
+    glUniformMatrix4fv(glGetUniformLocation(gLampProgramId, "view"), 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(glGetUniformLocation(gLampProgramId, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+    modelLoc = glGetUniformLocation(gLampProgramId, "model");
 
-    glm::mat4 projection5 = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    // Only the objects drawn one by one can be skipped; the occluders are always drawn
+    for (unsigned int i : gDrawOrder)
+    {
+        if (gSceneObjects[i].occluder)
+            continue;
 
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+        glm::vec3 center(gObjectBounds.centerX[i], gObjectBounds.centerY[i], gObjectBounds.centerZ[i]);
+        glm::vec3 extent(gObjectBounds.extentX[i], gObjectBounds.extentY[i], gObjectBounds.extentZ[i]);
 
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model5));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view5));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection5));
+        // With the camera inside (or nearly inside) the box, the near plane clips its faces away and the
+        // query would report a visible object as hidden
+        glm::vec3 fromCenter = glm::abs(gCamera.Position - center);
+        if (fromCenter.x <= extent.x + CAMERA_NEAR && fromCenter.y <= extent.y + CAMERA_NEAR && fromCenter.z <= extent.z + CAMERA_NEAR)
+            continue;
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
+        glm::mat4 model = glm::translate(center) * glm::scale(extent * 2.0f);
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
-    // Deactivate the Vertex Array Object
-    glBindVertexArray(0);
+        glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, gOcclusionQueries[i]);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+        gOcclusionIssued[i] = 1;
+    }
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glDepthFunc(GL_LESS);
+    glClear(GL_DEPTH_BUFFER_BIT);
 }
 
 
@@ -759,33 +4777,6 @@ void UCreateMesh(GLMesh& mesh)
        -0.5f,  0.5f,  0.5f,  0.0f, 0.0f,
        -0.5f,  0.5f, -0.5f,  0.0f, 1.0f
     };
-    GLfloat vertsNP[] = {
-        //Positions          //Texture Coordinates
-        0.0f, 1.0f, 0.0f,       0.5f, 1.0f,
-        -1.0f, -1.0f, 1.0f,     0.0f, 0.0f,
-        1.0, -1.0f, 1.0f,       1.0f, 0.0f,
-
-        0.0f, 1.0f, 0.0f,       0.5f, 1.0f,
-        1.0f, -1.0f, 1.0f,      1.0f, 0.0f,
-        1.0f, -1.0f, -1.0f,     0.0f, 0.0f,
-
-        0.0f, 1.0f, 0.0f,       0.5f, 1.0f,
-        1.0f, -1.0f, -1.0f,     1.0f, 0.0f,
-       -1.0f, -1.0f, -1.0f,     0.0f, 0.0f,
-
-        0.0f, 1.0f, 0.0f,       0.5f, 1.0f,
-       -1.0f, -1.0f, -1.0f,     1.0f, 0.0f,
-       -1.0f, -1.0f, 1.0f,      0.0f, 0.0f,
-
-       -1.0f, -1.0f, 1.0f,      0.0f, 0.0f,
-        1.0f, -1.0f, 1.0f,      1.0f, 0.0f,
-       -1.0f, -1.0f, -1.0f,     0.5f, 1.0f,
-
-       -1.0f, -1.0f, -1.0f,     1.0f, 0.0f,
-        1.0f, -1.0f, -1.0f,     0.0f, 0.0f,
-        1.0f, -1.0f, 1.0f,      0.5f, 1.0f,
-
-    };
     GLfloat vertsPL[] = {
         -1.0f, -0.05f, -0.5f,         0.8f, 0.8f, 0.8f, 0.8f,
          1.0f, -0.05f, -0.5f,         0.8f, 0.8f, 0.8f, 0.8f,
@@ -835,37 +4826,56 @@ void UCreateMesh(GLMesh& mesh)
 
     mesh.nVertices = sizeof(vertsBP) / (sizeof(vertsBP[0]) * (floatsPerVertex + floatsPerUV));
 
-    /// VAO and VBO for Pencil's Body
-    glGenVertexArrays(1, &mesh.vaoBP);
-    glBindVertexArray(mesh.vaoBP);
-
-    glGenBuffers(1, &mesh.vboBP);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vboBP);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertsBP), vertsBP, GL_STATIC_DRAW);
-
     // Strides between vertex coordinates
     GLint stride = sizeof(float) * (floatsPerVertex + floatsPerUV);
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(2);
-
-
-    /// VAO and VBO for Pencil's Nib
-    glGenVertexArrays(1, &mesh.vaoNP);
-    glBindVertexArray(mesh.vaoNP);
+    // Every level is also copied into the pool drawn by the multi-draw indirect path
+    MeshData pool;
+
+    /// Levels of detail for the Cube shared by the desk objects, and for the Pencil's Body and Nib. Meshes
+    /// listed here get their chain generated automatically; the chains are built in parallel, one mesh per
+    /// thread. The pencil levels are simplified from the finest pencil down to the triangles of a pencil
+    /// with fewer sides.
+    std::vector<MeshData> sources = { UMeshFromTriangleList(vertsBP, mesh.nVertices),
+        UGenerateCylinder(PENCIL_LOD_SEGMENTS[0], 0.5f, 1.0f, true), UGenerateCone(PENCIL_LOD_SEGMENTS[0], 1.0f, 2.0f) };
+    std::vector<std::vector<unsigned int>> targets = { ULodChainTargets(sources[0]), {}, {} };
+    std::vector<MeshData> bodyFallbacks, nibFallbacks;
+    for (int level = 0; level < PENCIL_LOD_COUNT; ++level)
+    {
+        const int segments = PENCIL_LOD_SEGMENTS[level];
+        // Smooth normals only pay off once the outline is round enough to pass for a cylinder
+        bodyFallbacks.push_back(UGenerateCylinder(segments, 0.5f, 1.0f, segments > 6));
+        nibFallbacks.push_back(UGenerateCone(segments, 1.0f, 2.0f));
+        if (level > 0)
+        {
+            targets[1].push_back(bodyFallbacks.back().triangleCount());
+            targets[2].push_back(nibFallbacks.back().triangleCount());
+        }
+    }
+    std::vector<LodChain> chains = UBuildLodChains(sources, targets);
 
-    glGenBuffers(1, &mesh.vboNP);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vboNP); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertsNP), vertsNP, GL_STATIC_DRAW);
+    mesh.cubeLod.resize(chains[0].size());
+    for (size_t level = 0; level < chains[0].size(); ++level)
+        UCreateLodLevel(chains[0][level].mesh, chains[0][level].error, mesh.cubeLod[level], &pool);
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    // A level the simplifier stops short of is generated with fewer sides instead
+    for (int level = 0; level < PENCIL_LOD_COUNT; ++level)
+    {
+        const int segments = PENCIL_LOD_SEGMENTS[level];
+        const LodChain& body = chains[1];
+        const LodChain& nib = chains[2];
+        if (level < (int)body.size() && body[level].mesh.triangleCount() <= bodyFallbacks[level].triangleCount())
+            UCreateLodLevel(body[level].mesh, body[level].error, mesh.bodyLod[level], &pool);
+        else
+            UCreateLodLevel(bodyFallbacks[level], UPolygonChordError(segments, 0.5f), mesh.bodyLod[level], &pool);
+        if (level < (int)nib.size() && nib[level].mesh.triangleCount() <= nibFallbacks[level].triangleCount())
+            UCreateLodLevel(nib[level].mesh, nib[level].error, mesh.nibLod[level], &pool);
+        else
+            UCreateLodLevel(nibFallbacks[level], UPolygonChordError(segments, 1.0f), mesh.nibLod[level], &pool);
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(2);
+    UCreateLodLevel(pool, 0.0f, mesh.pool, nullptr);
+    mesh.poolData = pool;
 
 
     /// VAO and VBO for Plane
@@ -902,10 +4912,14 @@ void UCreateMesh(GLMesh& mesh)
 
 void UDestroyMesh(GLMesh& mesh)
 {
-    glDeleteVertexArrays(1, &mesh.vaoBP);
-    glDeleteBuffers(1, &mesh.vboBP);
-    glDeleteVertexArrays(1, &mesh.vaoNP);
-    glDeleteBuffers(1, &mesh.vboNP);
+    for (GLLodLevel& level : mesh.cubeLod)
+        UDestroyLodLevel(level);
+    for (int level = 0; level < PENCIL_LOD_COUNT; ++level)
+    {
+        UDestroyLodLevel(mesh.bodyLod[level]);
+        UDestroyLodLevel(mesh.nibLod[level]);
+    }
+    UDestroyLodLevel(mesh.pool);
     glDeleteVertexArrays(1, &mesh.vaoPL);
     glDeleteBuffers(1, &mesh.vboPL);
     glDeleteVertexArrays(1, &mesh.vaoKB);
@@ -913,6 +4927,104 @@ void UDestroyMesh(GLMesh& mesh)
 }
 
 
+// Uploads an indexed mesh with position, normal and texture coordinate attributes.
+// When a pool is given, the mesh is only appended to it and the level records where; the pool is
+// uploaded once it holds every level.
+void UCreateLodLevel(const MeshData& data, float error, GLLodLevel& level, MeshData* pool)
+{
+    level.nIndices = (GLsizei)data.indices.size();
+    level.error = error;
+    level.bounds = UComputeBounds(data);
+    level.firstIndex = 0;
+    level.baseVertex = 0;
+    if (pool)
+    {
+        level.vao = level.vbo = level.ebo = 0;
+        level.firstIndex = (GLuint)pool->indices.size();
+        level.baseVertex = (GLint)pool->vertexCount();
+        pool->vertices.insert(pool->vertices.end(), data.vertices.begin(), data.vertices.end());
+        pool->indices.insert(pool->indices.end(), data.indices.begin(), data.indices.end());
+        return;
+    }
+
+    glGenVertexArrays(1, &level.vao);
+    glBindVertexArray(level.vao);
+
+    glGenBuffers(1, &level.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, level.vbo);
+    glBufferData(GL_ARRAY_BUFFER, data.vertices.size() * sizeof(float), data.vertices.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &level.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, level.ebo); // Stays bound to the vertex array object
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, data.indices.size() * sizeof(unsigned int), data.indices.data(), GL_STATIC_DRAW);
+
+    // Strides between vertex coordinates
+    GLint stride = sizeof(float) * MESH_FLOATS_PER_VERTEX;
+
+    glVertexAttribPointer(0, MESH_FLOATS_PER_POSITION, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, MESH_FLOATS_PER_NORMAL, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * MESH_FLOATS_PER_POSITION));
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(2, MESH_FLOATS_PER_UV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (MESH_FLOATS_PER_POSITION + MESH_FLOATS_PER_NORMAL)));
+    glEnableVertexAttribArray(2);
+
+    glBindVertexArray(0);
+}
+
+
+void UDestroyLodLevel(GLLodLevel& level)
+{
+    glDeleteVertexArrays(1, &level.vao);
+    glDeleteBuffers(1, &level.vbo);
+    glDeleteBuffers(1, &level.ebo);
+}
+
+
+// Draws a level with the bound program, from its own buffers or from the mesh pool it was appended to
+void UDrawLodLevel(const GLLodLevel& level)
+{
+    glBindVertexArray(level.vao ? level.vao : gMesh.pool.vao);
+    glDrawElementsBaseVertex(GL_TRIANGLES, level.nIndices, GL_UNSIGNED_INT, (void*)(sizeof(GLuint) * level.firstIndex), level.baseVertex);
+}
+
+
+// Picks the pencil level of detail from the size the object covers on screen
+int USelectPencilLod(const glm::mat4& model, float localRadius)
+{
+    // Bounding sphere in world space, grown by the largest axis scale of the model matrix
+    glm::vec3 center = glm::vec3(model[3]);
+    float maxScale = glm::max(glm::length(glm::vec3(model[0])), glm::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+    float radius = localRadius * maxScale;
+
+    float distance = glm::length(center - gCamera.Position);
+    float projectedRadius = UProjectedRadius(radius, distance, gCamera.Zoom, (float)gSceneTarget.drawnHeight);
+
+    return USelectLod(projectedRadius, PENCIL_LOD_MIN_RADIUS, PENCIL_LOD_COUNT);
+}
+
+
+// Picks the coarsest level whose geometric error stays under LOD_MAX_PIXEL_ERROR once projected on screen
+int USelectChainLod(const std::vector<GLLodLevel>& levels, const glm::mat4& model)
+{
+    glm::vec3 center = glm::vec3(model[3]);
+    float maxScale = glm::max(glm::length(glm::vec3(model[0])), glm::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+
+    float distance = glm::length(center - gCamera.Position);
+    float pixelsPerUnit = UPixelsPerUnit(distance, gCamera.Zoom, (float)gSceneTarget.drawnHeight) * maxScale;
+
+    int selected = 0;
+    for (int level = 1; level < (int)levels.size(); ++level)
+    {
+        if (levels[level].error * pixelsPerUnit > LOD_MAX_PIXEL_ERROR)
+            break;
+        selected = level;
+    }
+    return selected;
+}
+
+
 /*Generate and load the texture*/
 bool UCreateTexture(const char* filename, GLuint& textureId)
 {
@@ -963,6 +5075,13 @@ void UDestroyTexture(GLuint textureId)
 
 // Implements the UCreateShaders function
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+{
+    return UCreateShaderProgram(std::vector<const char*>{ vtxShaderSource }, std::vector<const char*>{ fragShaderSource }, programId);
+}
+
+
+// Builds a program from shaders given in several pieces, concatenated in order
+bool UCreateShaderProgram(const std::vector<const char*>& vtxShaderSources, const std::vector<const char*>& fragShaderSources, GLuint& programId)
 {
     // Compilation and linkage error reporting
     int success = 0;
@@ -976,8 +5095,8 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
     GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
 
     // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+    glShaderSource(vertexShaderId, (GLsizei)vtxShaderSources.size(), vtxShaderSources.data(), NULL);
+    glShaderSource(fragmentShaderId, (GLsizei)fragShaderSources.size(), fragShaderSources.data(), NULL);
 
     // Compile the vertex shader, and print compilation errors (if any)
     glCompileShader(vertexShaderId); // compile the vertex shader
@@ -1023,6 +5142,44 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
 }
 
 
+// Builds a program from a single compute shader
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId)
+{
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+
+    programId = glCreateProgram();
+
+    GLuint computeShaderId = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShaderId, 1, &computeShaderSource, NULL);
+
+    glCompileShader(computeShaderId);
+    glGetShaderiv(computeShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(computeShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
+    glAttachShader(programId, computeShaderId);
+
+    glLinkProgram(programId);
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
+    return true;
+}
+
+
 void UDestroyShaderProgram(GLuint programId)
 {
     glDeleteProgram(programId);
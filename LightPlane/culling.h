@@ -0,0 +1,215 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include "mesh.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+// SIMD width used by the frustum test: 8 boxes per step with AVX, 4 with SSE, otherwise scalar
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULLING_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE 1
+#endif
+
+// Bounding volumes of a mesh or object
+struct Bounds
+{
+    glm::vec3 center;   // Center of the axis-aligned box, also used as the sphere center
+    glm::vec3 extent;   // Half size of the axis-aligned box along each axis
+    float radius;       // Radius of the bounding sphere around center
+};
+
+
+// Computes the axis-aligned box and bounding sphere of a mesh
+inline Bounds UComputeBounds(const MeshData& mesh)
+{
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    for (unsigned int v = 0; v < mesh.vertexCount(); ++v)
+    {
+        const float* p = &mesh.vertices[v * MESH_FLOATS_PER_VERTEX];
+        glm::vec3 position(p[0], p[1], p[2]);
+        lo = glm::min(lo, position);
+        hi = glm::max(hi, position);
+    }
+
+    Bounds bounds;
+    bounds.center = (lo + hi) * 0.5f;
+    bounds.extent = (hi - lo) * 0.5f;
+    bounds.radius = 0.0f;
+    for (unsigned int v = 0; v < mesh.vertexCount(); ++v)
+    {
+        const float* p = &mesh.vertices[v * MESH_FLOATS_PER_VERTEX];
+        bounds.radius = std::max(bounds.radius, glm::length(glm::vec3(p[0], p[1], p[2]) - bounds.center));
+    }
+    return bounds;
+}
+
+
+// Transforms bounds by a model matrix. The box is the world-aligned box around the transformed box
+// (Arvo's method); the sphere grows by the largest axis scale.
+inline Bounds UTransformBounds(const Bounds& local, const glm::mat4& model)
+{
+    Bounds world;
+    world.center = glm::vec3(model * glm::vec4(local.center, 1.0f));
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        world.extent[axis] = std::fabs(model[0][axis]) * local.extent.x
+                           + std::fabs(model[1][axis]) * local.extent.y
+                           + std::fabs(model[2][axis]) * local.extent.z;
+    }
+    float maxScale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+    world.radius = local.radius * maxScale;
+    return world;
+}
+
+
+// Six planes (a, b, c, d) with a*x + b*y + c*z + d >= 0 on the inside: left, right, bottom, top, near, far
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+
+// Extracts the world-space frustum planes from a view-projection matrix (Gribb and Hartmann)
+inline Frustum UExtractFrustum(const glm::mat4& viewProjection)
+{
+    // Rows of the matrix; glm stores columns
+    glm::vec4 row[4];
+    for (int r = 0; r < 4; ++r)
+        row[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+
+    Frustum frustum;
+    frustum.planes[0] = row[3] + row[0];
+    frustum.planes[1] = row[3] - row[0];
+    frustum.planes[2] = row[3] + row[1];
+    frustum.planes[3] = row[3] - row[1];
+    frustum.planes[4] = row[3] + row[2];
+    frustum.planes[5] = row[3] - row[2];
+
+    for (glm::vec4& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+
+// World-space boxes of every object in structure-of-arrays form, so the frustum test loads one
+// component of several boxes at a time
+struct CullingSet
+{
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+
+    void resize(size_t count)
+    {
+        centerX.resize(count); centerY.resize(count); centerZ.resize(count);
+        extentX.resize(count); extentY.resize(count); extentZ.resize(count);
+    }
+
+    size_t size() const { return centerX.size(); }
+
+    void set(size_t index, const Bounds& bounds)
+    {
+        centerX[index] = bounds.center.x; centerY[index] = bounds.center.y; centerZ[index] = bounds.center.z;
+        extentX[index] = bounds.extent.x; extentY[index] = bounds.extent.y; extentZ[index] = bounds.extent.z;
+    }
+};
+
+
+// Tests one box against the frustum; true when it is at least partly inside
+inline bool UBoxInFrustum(const Frustum& frustum, glm::vec3 center, glm::vec3 extent)
+{
+    for (const glm::vec4& plane : frustum.planes)
+    {
+        float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+        float reach = std::fabs(plane.x) * extent.x + std::fabs(plane.y) * extent.y + std::fabs(plane.z) * extent.z;
+        if (distance + reach < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+
+// Tests the boxes [first, end) of the set against the frustum, writing 1 (visible) or 0 (culled) per box.
+// Returns the number of visible boxes. Separate ranges can be tested on separate threads.
+inline unsigned int UCullBoxes(const Frustum& frustum, const CullingSet& set, unsigned char* visible, size_t first, size_t end)
+{
+    size_t i = first;
+    unsigned int visibleCount = 0;
+
+#if defined(CULLING_AVX)
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 cx = _mm256_loadu_ps(&set.centerX[i]), cy = _mm256_loadu_ps(&set.centerY[i]), cz = _mm256_loadu_ps(&set.centerZ[i]);
+        __m256 ex = _mm256_loadu_ps(&set.extentX[i]), ey = _mm256_loadu_ps(&set.extentY[i]), ez = _mm256_loadu_ps(&set.extentZ[i]);
+        __m256 outside = _mm256_setzero_ps();
+        for (const glm::vec4& plane : frustum.planes)
+        {
+            __m256 px = _mm256_set1_ps(plane.x), py = _mm256_set1_ps(plane.y), pz = _mm256_set1_ps(plane.z);
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, cx), _mm256_mul_ps(py, cy)),
+                                            _mm256_add_ps(_mm256_mul_ps(pz, cz), _mm256_set1_ps(plane.w)));
+            __m256 reach = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_andnot_ps(signMask, px), ex),
+                                                       _mm256_mul_ps(_mm256_andnot_ps(signMask, py), ey)),
+                                         _mm256_mul_ps(_mm256_andnot_ps(signMask, pz), ez));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, reach), _mm256_setzero_ps(), _CMP_LT_OQ));
+        }
+        int mask = _mm256_movemask_ps(outside);
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+            visibleCount += visible[i + lane];
+        }
+    }
+#elif defined(CULLING_SSE)
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&set.centerX[i]), cy = _mm_loadu_ps(&set.centerY[i]), cz = _mm_loadu_ps(&set.centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&set.extentX[i]), ey = _mm_loadu_ps(&set.extentY[i]), ez = _mm_loadu_ps(&set.extentZ[i]);
+        __m128 outside = _mm_setzero_ps();
+        for (const glm::vec4& plane : frustum.planes)
+        {
+            __m128 px = _mm_set1_ps(plane.x), py = _mm_set1_ps(plane.y), pz = _mm_set1_ps(plane.z);
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, cx), _mm_mul_ps(py, cy)),
+                                         _mm_add_ps(_mm_mul_ps(pz, cz), _mm_set1_ps(plane.w)));
+            __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, px), ex),
+                                                 _mm_mul_ps(_mm_andnot_ps(signMask, py), ey)),
+                                      _mm_mul_ps(_mm_andnot_ps(signMask, pz), ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+        }
+        int mask = _mm_movemask_ps(outside);
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+            visibleCount += visible[i + lane];
+        }
+    }
+#endif
+
+    // Remaining boxes that do not fill a whole SIMD register
+    for (; i < end; ++i)
+    {
+        glm::vec3 center(set.centerX[i], set.centerY[i], set.centerZ[i]);
+        glm::vec3 extent(set.extentX[i], set.extentY[i], set.extentZ[i]);
+        visible[i] = UBoxInFrustum(frustum, center, extent) ? 1 : 0;
+        visibleCount += visible[i];
+    }
+    return visibleCount;
+}
+
+
+// Tests every box of the set against the frustum
+inline unsigned int UCullBoxes(const Frustum& frustum, const CullingSet& set, unsigned char* visible)
+{
+    return UCullBoxes(frustum, set, visible, 0, set.size());
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+
+const double FRAMEBUFFER_SETTLE_TIME = 0.2; // Seconds a new size has to hold before the targets follow it
+
+// Tracks the size of the window's framebuffer in pixels, larger than the window size in screen coordinates
+// on high-DPI displays, and decides when the render targets sized after it are reallocated.
+// A drag-resize changes the size on nearly every event, so the targets are only reallocated once the size
+// has held still for a moment; until then frames are drawn into the old targets at the new aspect ratio.
+class FramebufferManager
+{
+public:
+    // From the framebuffer size callback. A minimized window reports 0 x 0, which is ignored: nothing is
+    // shown, and the targets would have to come back at the same size anyway.
+    void resize(int width, int height, double now)
+    {
+        if (width <= 0 || height <= 0 || (width == mWidth && height == mHeight))
+            return;
+
+        mWidth = width;
+        mHeight = height;
+        mChangedAt = now;
+    }
+
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+    float aspect() const { return mHeight > 0 ? (float)mWidth / (float)mHeight : 1.0f; }
+
+    // Whether the targets should be reallocated now: they do not exist yet, or the framebuffer settled
+    // at a size other than theirs
+    bool reallocationDue(double now) const
+    {
+        if (mWidth == mTargetWidth && mHeight == mTargetHeight)
+            return false;
+        return mTargetWidth == 0 || now - mChangedAt >= FRAMEBUFFER_SETTLE_TIME;
+    }
+
+    // Records that the targets were reallocated at the framebuffer's size
+    void allocated()
+    {
+        mTargetWidth = mWidth;
+        mTargetHeight = mHeight;
+    }
+
+    int targetWidth() const { return mTargetWidth; }
+    int targetHeight() const { return mTargetHeight; }
+
+    // Size to draw the scene at for a resolution scale: the framebuffer size scaled, and shrunk further
+    // while the targets still have an older size they cannot hold it in. The aspect ratio is always the
+    // framebuffer's, so the projection stays right during a resize.
+    void drawSize(float scale, int& width, int& height) const
+    {
+        float fit = std::min(scale, std::min((float)mTargetWidth / (float)mWidth, (float)mTargetHeight / (float)mHeight));
+        width = std::min(mTargetWidth, std::max(1, (int)(mWidth * fit + 0.5f)));
+        height = std::min(mTargetHeight, std::max(1, (int)(mHeight * fit + 0.5f)));
+    }
+
+private:
+    int mWidth = 0;                 // Framebuffer size in pixels
+    int mHeight = 0;
+    int mTargetWidth = 0;           // Size the targets were allocated at, 0 before the first allocation
+    int mTargetHeight = 0;
+    double mChangedAt = 0.0;        // When the framebuffer last changed size
+};
+
+#endif
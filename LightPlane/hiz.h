@@ -0,0 +1,280 @@
+#ifndef HIZ_H
+#define HIZ_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HIZ_SSE 1
+#endif
+
+// Low resolution depth buffer filled by a software rasterizer with a few large occluders, plus a
+// hierarchical-Z pyramid built from it. Each pyramid texel holds the farthest depth of the area it
+// covers, so a box whose nearest point is behind that depth is hidden by the occluders.
+// Depths are window-space values in [0, 1] as OpenGL writes them, with 1 the far plane.
+class HiZBuffer
+{
+public:
+    static const int WIDTH = 256;   // Multiple of 4 so rows split evenly into SSE registers
+    static const int HEIGHT = 128;
+    static const int LEVELS = 9;    // Down to a single texel
+
+    HiZBuffer()
+    {
+        for (int level = 0; level < LEVELS; ++level)
+            mLevels[level].resize(levelWidth(level) * levelHeight(level));
+        clear();
+    }
+
+    static int levelWidth(int level) { return std::max(1, WIDTH >> level); }
+    static int levelHeight(int level) { return std::max(1, HEIGHT >> level); }
+
+    void clear()
+    {
+        std::fill(mLevels[0].begin(), mLevels[0].end(), 1.0f);
+    }
+
+    // Rasterizes the 12 triangles of a box given in object space, transformed by modelViewProjection
+    void rasterizeBox(const glm::mat4& modelViewProjection, glm::vec3 center, glm::vec3 extent)
+    {
+        // Corner i takes the max extent along the axes whose bit is set in i
+        glm::vec4 corners[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            glm::vec3 sign((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : -1.0f);
+            corners[i] = modelViewProjection * glm::vec4(center + sign * extent, 1.0f);
+        }
+
+        static const int faces[12][3] = {
+            { 0, 2, 3 }, { 0, 3, 1 },   // -z
+            { 4, 5, 7 }, { 4, 7, 6 },   // +z
+            { 0, 1, 5 }, { 0, 5, 4 },   // -y
+            { 2, 6, 7 }, { 2, 7, 3 },   // +y
+            { 0, 4, 6 }, { 0, 6, 2 },   // -x
+            { 1, 3, 7 }, { 1, 7, 5 }    // +x
+        };
+        for (const int* face : faces)
+            rasterizeTriangle(corners[face[0]], corners[face[1]], corners[face[2]]);
+    }
+
+    // Rasterizes a clip-space triangle, clipping it against the near plane first
+    void rasterizeTriangle(glm::vec4 a, glm::vec4 b, glm::vec4 c)
+    {
+        // Sutherland-Hodgman against z + w >= 0; a triangle becomes at most a quad
+        glm::vec4 input[3] = { a, b, c };
+        glm::vec4 clipped[4];
+        int count = 0;
+        for (int i = 0; i < 3; ++i)
+        {
+            const glm::vec4& p = input[i];
+            const glm::vec4& q = input[(i + 1) % 3];
+            float dp = p.z + p.w;
+            float dq = q.z + q.w;
+            if (dp >= 0.0f)
+                clipped[count++] = p;
+            if ((dp >= 0.0f) != (dq >= 0.0f))
+                clipped[count++] = p + (q - p) * (dp / (dp - dq));
+        }
+
+        if (count < 3)
+            return;
+
+        glm::vec3 screen[4];
+        for (int i = 0; i < count; ++i)
+            screen[i] = toScreen(clipped[i]);
+        for (int i = 1; i + 1 < count; ++i)
+            rasterizeScreenTriangle(screen[0], screen[i], screen[i + 1]);
+    }
+
+    // Builds every pyramid level from the one below, keeping the farthest depth of each 2x2 block
+    void buildPyramid()
+    {
+        for (int level = 1; level < LEVELS; ++level)
+        {
+            const std::vector<float>& below = mLevels[level - 1];
+            std::vector<float>& current = mLevels[level];
+            const int belowWidth = levelWidth(level - 1), belowHeight = levelHeight(level - 1);
+            const int width = levelWidth(level), height = levelHeight(level);
+
+            for (int y = 0; y < height; ++y)
+            {
+                int y0 = std::min(y * 2, belowHeight - 1), y1 = std::min(y * 2 + 1, belowHeight - 1);
+                for (int x = 0; x < width; ++x)
+                {
+                    int x0 = std::min(x * 2, belowWidth - 1), x1 = std::min(x * 2 + 1, belowWidth - 1);
+                    current[y * width + x] = std::max(std::max(below[y0 * belowWidth + x0], below[y0 * belowWidth + x1]),
+                                                      std::max(below[y1 * belowWidth + x0], below[y1 * belowWidth + x1]));
+                }
+            }
+        }
+    }
+
+    // Tests a world-space axis-aligned box against the pyramid. Returns false only when the box is
+    // certainly hidden; boxes crossing the near plane always count as visible.
+    bool isBoxVisible(const glm::mat4& viewProjection, glm::vec3 center, glm::vec3 extent) const
+    {
+        // Corners are the projected center plus or minus the projected half axes
+        const glm::vec4 c = viewProjection * glm::vec4(center, 1.0f);
+        const glm::vec4 ax = viewProjection[0] * extent.x;
+        const glm::vec4 ay = viewProjection[1] * extent.y;
+        const glm::vec4 az = viewProjection[2] * extent.z;
+
+        // Normalized device coordinates bounds of the corners
+        float loX, loY, hiX, hiY, nearest;
+#if defined(HIZ_SSE)
+        const __m128 signX = _mm_set_ps(1.0f, -1.0f, 1.0f, -1.0f);
+        const __m128 signY = _mm_set_ps(1.0f, 1.0f, -1.0f, -1.0f);
+        __m128 lo = _mm_set1_ps(1e30f), hi = _mm_set1_ps(-1e30f), zMin = _mm_set1_ps(1e30f);
+        for (int half = 0; half < 2; ++half)
+        {
+            // Four corners at a time: x and y signs vary across the lanes, z sign across the halves
+            const float sz = half == 0 ? -1.0f : 1.0f;
+            __m128 x = _mm_add_ps(_mm_set1_ps(c.x + az.x * sz), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ax.x), signX), _mm_mul_ps(_mm_set1_ps(ay.x), signY)));
+            __m128 y = _mm_add_ps(_mm_set1_ps(c.y + az.y * sz), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ax.y), signX), _mm_mul_ps(_mm_set1_ps(ay.y), signY)));
+            __m128 z = _mm_add_ps(_mm_set1_ps(c.z + az.z * sz), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ax.z), signX), _mm_mul_ps(_mm_set1_ps(ay.z), signY)));
+            __m128 w = _mm_add_ps(_mm_set1_ps(c.w + az.w * sz), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ax.w), signX), _mm_mul_ps(_mm_set1_ps(ay.w), signY)));
+            if (_mm_movemask_ps(_mm_cmple_ps(_mm_add_ps(z, w), _mm_setzero_ps())) != 0)
+                return true;
+
+            __m128 invW = _mm_div_ps(_mm_set1_ps(1.0f), w);
+            __m128 xy = _mm_unpacklo_ps(_mm_mul_ps(x, invW), _mm_mul_ps(y, invW));      // x0 y0 x1 y1
+            __m128 xy2 = _mm_unpackhi_ps(_mm_mul_ps(x, invW), _mm_mul_ps(y, invW));     // x2 y2 x3 y3
+            lo = _mm_min_ps(lo, _mm_min_ps(xy, xy2));
+            hi = _mm_max_ps(hi, _mm_max_ps(xy, xy2));
+            zMin = _mm_min_ps(zMin, _mm_mul_ps(z, invW));
+        }
+        lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+        hi = _mm_max_ps(hi, _mm_movehl_ps(hi, hi));
+        zMin = _mm_min_ps(zMin, _mm_movehl_ps(zMin, zMin));
+        zMin = _mm_min_ss(zMin, _mm_shuffle_ps(zMin, zMin, 1));
+        float loXY[4], hiXY[4];
+        _mm_storeu_ps(loXY, lo);
+        _mm_storeu_ps(hiXY, hi);
+        loX = loXY[0]; loY = loXY[1]; hiX = hiXY[0]; hiY = hiXY[1];
+        nearest = _mm_cvtss_f32(zMin);
+#else
+        loX = loY = nearest = 1e30f;
+        hiX = hiY = -1e30f;
+        for (int i = 0; i < 8; ++i)
+        {
+            glm::vec4 clip = c + ax * ((i & 1) ? 1.0f : -1.0f) + ay * ((i & 2) ? 1.0f : -1.0f) + az * ((i & 4) ? 1.0f : -1.0f);
+            if (clip.z + clip.w <= 0.0f)
+                return true;
+
+            float invW = 1.0f / clip.w;
+            loX = std::min(loX, clip.x * invW); hiX = std::max(hiX, clip.x * invW);
+            loY = std::min(loY, clip.y * invW); hiY = std::max(hiY, clip.y * invW);
+            nearest = std::min(nearest, clip.z * invW);
+        }
+#endif
+        const glm::vec3 screenLo = toScreen(glm::vec4(loX, loY, nearest, 1.0f));
+        const glm::vec3 screenHi = toScreen(glm::vec4(hiX, hiY, nearest, 1.0f));
+        nearest = screenLo.z;
+
+        int x0 = std::max(0, (int)std::floor(screenLo.x)), x1 = std::min(WIDTH - 1, (int)std::floor(screenHi.x));
+        int y0 = std::max(0, (int)std::floor(screenLo.y)), y1 = std::min(HEIGHT - 1, (int)std::floor(screenHi.y));
+        if (x0 > x1 || y0 > y1)
+            return true; // Off screen: left to the frustum test
+
+        // Level at which the rectangle spans at most two texels per axis
+        int level = 0;
+        while (level < LEVELS - 1 && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+            ++level;
+
+        const std::vector<float>& depth = mLevels[level];
+        const int width = levelWidth(level);
+        for (int y = y0 >> level; y <= (y1 >> level); ++y)
+        {
+            for (int x = x0 >> level; x <= (x1 >> level); ++x)
+            {
+                if (nearest <= depth[y * width + x])
+                    return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static glm::vec3 toScreen(const glm::vec4& clip)
+    {
+        float invW = 1.0f / clip.w;
+        return glm::vec3((clip.x * invW * 0.5f + 0.5f) * WIDTH,
+                         (clip.y * invW * 0.5f + 0.5f) * HEIGHT,
+                         clip.z * invW * 0.5f + 0.5f);
+    }
+
+    // Rasterizes a screen-space triangle, keeping the nearest depth at every covered pixel center
+    void rasterizeScreenTriangle(glm::vec3 a, glm::vec3 b, glm::vec3 c)
+    {
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (area == 0.0f)
+            return;
+        if (area < 0.0f)
+        {
+            std::swap(b, c);
+            area = -area;
+        }
+
+        int minX = std::max(0, (int)std::floor(std::min(a.x, std::min(b.x, c.x))));
+        int maxX = std::min(WIDTH - 1, (int)std::ceil(std::max(a.x, std::max(b.x, c.x))));
+        int minY = std::max(0, (int)std::floor(std::min(a.y, std::min(b.y, c.y))));
+        int maxY = std::min(HEIGHT - 1, (int)std::ceil(std::max(a.y, std::max(b.y, c.y))));
+        if (minX > maxX || minY > maxY)
+            return;
+        minX &= ~3; // Start on an SSE register boundary
+
+        // Edge functions e(x, y) = ex * x + ey * y + e0, positive inside
+        const float e0x = a.y - b.y, e0y = b.x - a.x, e00 = a.x * b.y - a.y * b.x;
+        const float e1x = b.y - c.y, e1y = c.x - b.x, e10 = b.x * c.y - b.y * c.x;
+        const float e2x = c.y - a.y, e2y = a.x - c.x, e20 = c.x * a.y - c.y * a.x;
+
+        // Depth is affine in screen space: z(x, y) = a.z + zx * (x - a.x) + zy * (y - a.y)
+        const float zx = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) / area;
+        const float zy = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) / area;
+
+        std::vector<float>& depth = mLevels[0];
+        for (int y = minY; y <= maxY; ++y)
+        {
+            const float py = y + 0.5f;
+            float* row = &depth[y * WIDTH];
+            int x = minX;
+#if defined(HIZ_SSE)
+            const __m128 laneOffsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+            for (; x <= maxX; x += 4)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+                __m128 w0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e0x), px), _mm_set1_ps(e0y * py + e00));
+                __m128 w1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e1x), px), _mm_set1_ps(e1y * py + e10));
+                __m128 w2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e2x), px), _mm_set1_ps(e2y * py + e20));
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, _mm_setzero_ps()), _mm_cmpge_ps(w1, _mm_setzero_ps())),
+                                           _mm_cmpge_ps(w2, _mm_setzero_ps()));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zx), _mm_sub_ps(px, _mm_set1_ps(a.x))),
+                                      _mm_set1_ps(a.z + zy * (py - a.y)));
+                __m128 stored = _mm_loadu_ps(row + x);
+                __m128 nearer = _mm_min_ps(stored, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, stored)));
+            }
+#else
+            for (; x <= maxX; ++x)
+            {
+                const float px = x + 0.5f;
+                if (e0x * px + e0y * py + e00 < 0.0f || e1x * px + e1y * py + e10 < 0.0f || e2x * px + e2y * py + e20 < 0.0f)
+                    continue;
+                float z = a.z + zx * (px - a.x) + zy * (py - a.y);
+                row[x] = std::min(row[x], z);
+            }
+#endif
+        }
+    }
+
+    std::vector<float> mLevels[LEVELS];
+};
+
+#endif
@@ -0,0 +1,634 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include "mesh.h"
+#include "parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Lightmaps: the immovable objects get a second set of texture coordinates laying all of their triangles
+// out, without overlaps, in one square atlas. Triangles are grouped into charts of neighbours facing about
+// the same way; each chart is flattened onto its own plane and the charts are packed in shelves. The
+// lighting the lamp leaves on every texel of the atlas is then path-traced once, offline.
+const float LIGHTMAP_CHART_COSINE = 0.9f;   // Least cosine between the normals of a chart and of its first triangle
+const int LIGHTMAP_PADDING = 2;             // Texels around each chart, filled from its edges so filtering stays inside
+const float LIGHTMAP_FILL = 0.6f;           // Share of the atlas the charts are first sized to cover
+const float LIGHTMAP_RANGE = 2.0f;          // Brightest baked lighting; stored texels are lighting / range
+const float LIGHTMAP_RAY_OFFSET = 1e-3f;    // Rays start off their surface by this much, so they do not hit it again
+const unsigned int LIGHTMAP_BVH_LEAF = 4;   // Most triangles in a leaf of the bounding volume hierarchy
+
+// Mesh with its lightmap coordinates, two floats per vertex, kept apart from the interleaved attributes
+struct LightmapMesh
+{
+    MeshData mesh;
+    std::vector<float> uv2;
+};
+
+// How hard the baker works on each texel
+struct LightmapBakeSettings
+{
+    unsigned int samples = 64;      // Paths traced for the indirect lighting
+    unsigned int bounces = 2;       // Surfaces a path bounces off before it gives up
+};
+
+
+// Splits the triangles of a mesh into charts: a chart grows over the edges its triangles share as long as
+// the normals stay close to the normal of the triangle it started from. Returns the chart of every triangle.
+inline std::vector<unsigned int> ULightmapCharts(const MeshData& mesh, unsigned int& chartCount)
+{
+    const unsigned int triangleCount = mesh.triangleCount();
+    std::vector<glm::vec3> normals(triangleCount);
+    for (unsigned int t = 0; t < triangleCount; ++t)
+    {
+        glm::vec3 corners[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            const float* p = &mesh.vertices[mesh.indices[t * 3 + k] * MESH_FLOATS_PER_VERTEX];
+            corners[k] = glm::vec3(p[0], p[1], p[2]);
+        }
+        const glm::vec3 cross = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+        const float length = glm::length(cross);
+        normals[t] = length > 0.0f ? cross / length : glm::vec3(0.0f, 0.0f, 1.0f);
+    }
+
+    // Triangles around every vertex, to find the neighbours across an edge
+    std::vector<std::vector<unsigned int>> vertexTriangles(mesh.vertexCount());
+    for (unsigned int t = 0; t < triangleCount; ++t)
+    {
+        for (int k = 0; k < 3; ++k)
+            vertexTriangles[mesh.indices[t * 3 + k]].push_back(t);
+    }
+
+    const unsigned int NONE = ~0u;
+    std::vector<unsigned int> charts(triangleCount, NONE);
+    std::vector<unsigned int> front;
+    chartCount = 0;
+    for (unsigned int seed = 0; seed < triangleCount; ++seed)
+    {
+        if (charts[seed] != NONE)
+            continue;
+
+        charts[seed] = chartCount;
+        front.assign(1, seed);
+        while (!front.empty())
+        {
+            const unsigned int t = front.back();
+            front.pop_back();
+            for (int k = 0; k < 3; ++k)
+            {
+                const unsigned int a = mesh.indices[t * 3 + k];
+                const unsigned int b = mesh.indices[t * 3 + (k + 1) % 3];
+                for (unsigned int neighbour : vertexTriangles[a])
+                {
+                    if (charts[neighbour] != NONE || glm::dot(normals[neighbour], normals[seed]) < LIGHTMAP_CHART_COSINE)
+                        continue;
+                    const unsigned int* n = &mesh.indices[neighbour * 3];
+                    if (n[0] == b || n[1] == b || n[2] == b)
+                    {
+                        charts[neighbour] = chartCount;
+                        front.push_back(neighbour);
+                    }
+                }
+            }
+        }
+        ++chartCount;
+    }
+    return charts;
+}
+
+
+// Lays the triangles of the meshes out in one atlas of size by size texels. Every chart gets vertices of
+// its own, so a vertex on the border of two charts can sit at two places of the atlas. Charts keep the
+// same texel density; it starts high enough to fill LIGHTMAP_FILL of the atlas and shrinks until the
+// shelves fit. Returns false when they never do.
+inline bool UUnwrapLightmap(const std::vector<MeshData>& meshes, int size, std::vector<LightmapMesh>& unwrapped)
+{
+    // Charts of every mesh, each with the plane it is flattened onto
+    struct Chart
+    {
+        size_t mesh;
+        std::vector<unsigned int> triangles;
+        glm::vec3 axisU;
+        glm::vec3 axisV;
+        glm::vec2 lo;
+        glm::vec2 hi;
+        glm::ivec2 texels;      // Size in the atlas, padding included
+        glm::ivec2 offset;
+    };
+    std::vector<Chart> charts;
+    float area = 0.0f;
+    for (size_t m = 0; m < meshes.size(); ++m)
+    {
+        const MeshData& mesh = meshes[m];
+        unsigned int chartCount = 0;
+        const std::vector<unsigned int> triangleCharts = ULightmapCharts(mesh, chartCount);
+        const size_t first = charts.size();
+        charts.resize(first + chartCount);
+        for (unsigned int t = 0; t < mesh.triangleCount(); ++t)
+            charts[first + triangleCharts[t]].triangles.push_back(t);
+
+        for (size_t c = first; c < charts.size(); ++c)
+        {
+            Chart& chart = charts[c];
+            chart.mesh = m;
+
+            // The plane faces the area-weighted normal of the chart
+            glm::vec3 normal(0.0f);
+            for (unsigned int t : chart.triangles)
+            {
+                const float* a = &mesh.vertices[mesh.indices[t * 3] * MESH_FLOATS_PER_VERTEX];
+                const float* b = &mesh.vertices[mesh.indices[t * 3 + 1] * MESH_FLOATS_PER_VERTEX];
+                const float* c2 = &mesh.vertices[mesh.indices[t * 3 + 2] * MESH_FLOATS_PER_VERTEX];
+                const glm::vec3 pa(a[0], a[1], a[2]);
+                const glm::vec3 cross = glm::cross(glm::vec3(b[0], b[1], b[2]) - pa, glm::vec3(c2[0], c2[1], c2[2]) - pa);
+                normal += cross;
+                area += 0.5f * glm::length(cross);
+            }
+            normal = glm::length(normal) > 0.0f ? glm::normalize(normal) : glm::vec3(0.0f, 0.0f, 1.0f);
+            const glm::vec3 helper = std::fabs(normal.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+            chart.axisU = glm::normalize(glm::cross(helper, normal));
+            chart.axisV = glm::cross(normal, chart.axisU);
+
+            chart.lo = glm::vec2(1e30f);
+            chart.hi = glm::vec2(-1e30f);
+            for (unsigned int t : chart.triangles)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    const float* p = &mesh.vertices[mesh.indices[t * 3 + k] * MESH_FLOATS_PER_VERTEX];
+                    const glm::vec3 position(p[0], p[1], p[2]);
+                    const glm::vec2 flat(glm::dot(position, chart.axisU), glm::dot(position, chart.axisV));
+                    chart.lo = glm::min(chart.lo, flat);
+                    chart.hi = glm::max(chart.hi, flat);
+                }
+            }
+        }
+    }
+    if (charts.empty() || area <= 0.0f)
+        return false;
+
+    // Shelves of charts sorted from the tallest, each shelf as tall as its first chart
+    std::vector<size_t> order(charts.size());
+    float density = std::sqrt(LIGHTMAP_FILL * size * size / area);
+    bool packed = false;
+    for (int attempt = 0; attempt < 64 && !packed; ++attempt, density *= 0.9f)
+    {
+        for (Chart& chart : charts)
+        {
+            const glm::vec2 extent = (chart.hi - chart.lo) * density;
+            chart.texels = glm::ivec2((int)std::ceil(extent.x) + 2 * LIGHTMAP_PADDING, (int)std::ceil(extent.y) + 2 * LIGHTMAP_PADDING);
+        }
+        for (size_t c = 0; c < order.size(); ++c)
+            order[c] = c;
+        std::sort(order.begin(), order.end(), [&charts](size_t a, size_t b) { return charts[a].texels.y > charts[b].texels.y; });
+
+        packed = true;
+        glm::ivec2 cursor(0);
+        int shelfHeight = 0;
+        for (size_t c : order)
+        {
+            Chart& chart = charts[c];
+            if (cursor.x + chart.texels.x > size)
+            {
+                cursor = glm::ivec2(0, cursor.y + shelfHeight);
+                shelfHeight = 0;
+            }
+            if (cursor.x + chart.texels.x > size || cursor.y + chart.texels.y > size)
+            {
+                packed = false;
+                break;
+            }
+            chart.offset = cursor;
+            cursor.x += chart.texels.x;
+            shelfHeight = std::max(shelfHeight, chart.texels.y);
+        }
+        if (packed)
+            break;
+    }
+    if (!packed)
+        return false;
+
+    unwrapped.assign(meshes.size(), LightmapMesh());
+    std::vector<unsigned int> remap;
+    for (const Chart& chart : charts)
+    {
+        const MeshData& mesh = meshes[chart.mesh];
+        LightmapMesh& target = unwrapped[chart.mesh];
+        remap.assign(mesh.vertexCount(), ~0u);
+        for (unsigned int t : chart.triangles)
+        {
+            unsigned int corners[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                const unsigned int index = mesh.indices[t * 3 + k];
+                if (remap[index] == ~0u)
+                {
+                    const float* p = &mesh.vertices[index * MESH_FLOATS_PER_VERTEX];
+                    remap[index] = target.mesh.vertexCount();
+                    target.mesh.vertices.insert(target.mesh.vertices.end(), p, p + MESH_FLOATS_PER_VERTEX);
+
+                    const glm::vec3 position(p[0], p[1], p[2]);
+                    const glm::vec2 flat(glm::dot(position, chart.axisU), glm::dot(position, chart.axisV));
+                    const glm::vec2 texel = glm::vec2(chart.offset) + (float)LIGHTMAP_PADDING + (flat - chart.lo) * density;
+                    target.uv2.push_back(texel.x / size);
+                    target.uv2.push_back(texel.y / size);
+                }
+                corners[k] = remap[index];
+            }
+            target.mesh.addTriangle(corners[0], corners[1], corners[2]);
+        }
+    }
+    return true;
+}
+
+
+// Bounding volume hierarchy over the triangles of the scene, for the rays of the baker. Nodes split their
+// triangles at the median of the longest axis of their centers; a node's first child follows it, and the
+// second is stored at its index.
+class TriangleBvh
+{
+public:
+    struct Triangle
+    {
+        glm::vec3 a;
+        glm::vec3 b;
+        glm::vec3 c;
+        unsigned int surface;   // Caller's tag, such as the mesh the triangle comes from
+    };
+
+    void build(std::vector<Triangle> triangles)
+    {
+        mTriangles = std::move(triangles);
+        mNodes.clear();
+        if (mTriangles.empty())
+            return;
+        mNodes.reserve(2 * mTriangles.size());
+        buildNode(0, (unsigned int)mTriangles.size());
+    }
+
+    const Triangle& triangle(unsigned int index) const { return mTriangles[index]; }
+
+    // Nearest triangle along the ray before maxDistance, or false when there is none. With anyHit the
+    // first triangle found is taken, which is all a shadow ray needs to know.
+    bool intersect(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& distance, unsigned int& hit, bool anyHit = false) const
+    {
+        if (mNodes.empty())
+            return false;
+
+        const glm::vec3 inverse = 1.0f / direction;
+        distance = maxDistance;
+        bool found = false;
+        unsigned int stack[64];
+        int depth = 0;
+        stack[depth++] = 0;
+        while (depth > 0)
+        {
+            const Node& node = mNodes[stack[--depth]];
+            if (!boxHit(node, origin, inverse, distance))
+                continue;
+
+            if (node.count > 0)
+            {
+                for (unsigned int t = node.first; t < node.first + node.count; ++t)
+                {
+                    if (triangleHit(mTriangles[t], origin, direction, distance))
+                    {
+                        hit = t;
+                        found = true;
+                        if (anyHit)
+                            return true;
+                    }
+                }
+            }
+            else
+            {
+                stack[depth++] = node.first;
+                stack[depth++] = (unsigned int)(&node - mNodes.data()) + 1;
+            }
+        }
+        return found;
+    }
+
+private:
+    struct Node
+    {
+        glm::vec3 lo;
+        glm::vec3 hi;
+        unsigned int first;     // First triangle of a leaf, or second child of an inner node
+        unsigned int count;     // Triangles of a leaf; 0 for an inner node
+    };
+
+    unsigned int buildNode(unsigned int begin, unsigned int end)
+    {
+        const unsigned int index = (unsigned int)mNodes.size();
+        mNodes.push_back(Node());
+
+        glm::vec3 lo(1e30f), hi(-1e30f), centerLo(1e30f), centerHi(-1e30f);
+        for (unsigned int t = begin; t < end; ++t)
+        {
+            const Triangle& triangle = mTriangles[t];
+            lo = glm::min(lo, glm::min(triangle.a, glm::min(triangle.b, triangle.c)));
+            hi = glm::max(hi, glm::max(triangle.a, glm::max(triangle.b, triangle.c)));
+            const glm::vec3 center = (triangle.a + triangle.b + triangle.c) / 3.0f;
+            centerLo = glm::min(centerLo, center);
+            centerHi = glm::max(centerHi, center);
+        }
+        mNodes[index].lo = lo;
+        mNodes[index].hi = hi;
+
+        const glm::vec3 extent = centerHi - centerLo;
+        if (end - begin <= LIGHTMAP_BVH_LEAF || std::max(extent.x, std::max(extent.y, extent.z)) <= 0.0f)
+        {
+            mNodes[index].first = begin;
+            mNodes[index].count = end - begin;
+            return index;
+        }
+
+        const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        const unsigned int middle = (begin + end) / 2;
+        std::nth_element(mTriangles.begin() + begin, mTriangles.begin() + middle, mTriangles.begin() + end,
+            [axis](const Triangle& x, const Triangle& y) { return x.a[axis] + x.b[axis] + x.c[axis] < y.a[axis] + y.b[axis] + y.c[axis]; });
+
+        buildNode(begin, middle);
+        const unsigned int second = buildNode(middle, end);
+        mNodes[index].first = second;
+        mNodes[index].count = 0;
+        return index;
+    }
+
+    // Slab test of the ray against the box of a node, up to maxDistance
+    static bool boxHit(const Node& node, const glm::vec3& origin, const glm::vec3& inverse, float maxDistance)
+    {
+        const glm::vec3 t0 = (node.lo - origin) * inverse;
+        const glm::vec3 t1 = (node.hi - origin) * inverse;
+        const glm::vec3 entries = glm::min(t0, t1);
+        const glm::vec3 exits = glm::max(t0, t1);
+        const float enter = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+        const float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, maxDistance));
+        return enter <= exit;
+    }
+
+    // Möller-Trumbore test from either side of the triangle; shortens distance on a nearer hit
+    static bool triangleHit(const Triangle& triangle, const glm::vec3& origin, const glm::vec3& direction, float& distance)
+    {
+        const glm::vec3 edge1 = triangle.b - triangle.a;
+        const glm::vec3 edge2 = triangle.c - triangle.a;
+        const glm::vec3 p = glm::cross(direction, edge2);
+        const float determinant = glm::dot(edge1, p);
+        if (std::fabs(determinant) < 1e-12f)
+            return false;
+
+        const float inverse = 1.0f / determinant;
+        const glm::vec3 s = origin - triangle.a;
+        const float u = glm::dot(s, p) * inverse;
+        if (u < 0.0f || u > 1.0f)
+            return false;
+        const glm::vec3 q = glm::cross(s, edge1);
+        const float v = glm::dot(direction, q) * inverse;
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+        const float t = glm::dot(edge2, q) * inverse;
+        if (t <= 0.0f || t >= distance)
+            return false;
+        distance = t;
+        return true;
+    }
+
+    std::vector<Triangle> mTriangles;
+    std::vector<Node> mNodes;
+};
+
+
+// Small generator for the baker, seeded per texel so a bake comes out the same on any number of threads
+struct BakeRandom
+{
+    uint32_t state;
+
+    explicit BakeRandom(uint32_t seed) : state(seed * 2654435761u + 0x9e3779b9u) { next(); }
+
+    // Uniform in [0, 1)
+    float next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+
+// Path-traces the lighting of a point light on the unwrapped meshes into an atlas of size by size texels,
+// bottom row first. Every texel is lit as the Phong shader lights a surface, with the diffuse term only:
+// light color times the cosine to the light, where the light is not blocked. Indirect lighting follows
+// cosine-distributed paths that pick up the diffuse light of what they hit, tinted by the albedo of each
+// surface on the way. Ambient light stays out of the atlas, since shaders add it. Texels no triangle
+// covers are filled from their neighbours, over the padding of the charts.
+inline void UBakeLightmap(const std::vector<LightmapMesh>& meshes, const std::vector<glm::vec3>& albedos, const glm::vec3& lightPosition,
+    const glm::vec3& lightColor, const LightmapBakeSettings& settings, int size, std::vector<glm::vec3>& lighting)
+{
+    std::vector<TriangleBvh::Triangle> triangles;
+    for (size_t m = 0; m < meshes.size(); ++m)
+    {
+        const MeshData& mesh = meshes[m].mesh;
+        for (unsigned int t = 0; t < mesh.triangleCount(); ++t)
+        {
+            glm::vec3 corners[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                const float* p = &mesh.vertices[mesh.indices[t * 3 + k] * MESH_FLOATS_PER_VERTEX];
+                corners[k] = glm::vec3(p[0], p[1], p[2]);
+            }
+            triangles.push_back({ corners[0], corners[1], corners[2], (unsigned int)m });
+        }
+    }
+    TriangleBvh bvh;
+    bvh.build(std::move(triangles));
+
+    // Diffuse light reaching a point, straight from the light
+    auto direct = [&](const glm::vec3& position, const glm::vec3& normal)
+    {
+        const glm::vec3 toLight = lightPosition - position;
+        const float distance = glm::length(toLight);
+        const glm::vec3 direction = toLight / distance;
+        const float cosine = glm::dot(normal, direction);
+        float hitDistance = 0.0f;
+        unsigned int hit = 0;
+        if (cosine <= 0.0f || bvh.intersect(position + normal * LIGHTMAP_RAY_OFFSET, direction, distance, hitDistance, hit, true))
+            return glm::vec3(0.0f);
+        return lightColor * cosine;
+    };
+
+    // Texels covered by a triangle, with the point and normal they stand for. A texel shared by two
+    // triangles keeps the first.
+    struct Texel
+    {
+        unsigned int index;
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+    std::vector<Texel> texels;
+    std::vector<char> covered(size * size, 0);
+    for (const LightmapMesh& lightmapMesh : meshes)
+    {
+        const MeshData& mesh = lightmapMesh.mesh;
+        for (unsigned int t = 0; t < mesh.triangleCount(); ++t)
+        {
+            glm::vec2 uv[3];
+            glm::vec3 positions[3];
+            glm::vec3 normals[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                const unsigned int index = mesh.indices[t * 3 + k];
+                const float* p = &mesh.vertices[index * MESH_FLOATS_PER_VERTEX];
+                uv[k] = glm::vec2(lightmapMesh.uv2[index * 2], lightmapMesh.uv2[index * 2 + 1]) * (float)size;
+                positions[k] = glm::vec3(p[0], p[1], p[2]);
+                normals[k] = glm::vec3(p[3], p[4], p[5]);
+            }
+            const float area = (uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y);
+            if (std::fabs(area) < 1e-12f)
+                continue;
+
+            const glm::vec2 lo = glm::min(uv[0], glm::min(uv[1], uv[2]));
+            const glm::vec2 hi = glm::max(uv[0], glm::max(uv[1], uv[2]));
+            for (int y = std::max((int)std::floor(lo.y), 0); y <= std::min((int)std::ceil(hi.y), size - 1); ++y)
+            {
+                for (int x = std::max((int)std::floor(lo.x), 0); x <= std::min((int)std::ceil(hi.x), size - 1); ++x)
+                {
+                    const glm::vec2 center(x + 0.5f, y + 0.5f);
+                    const float w0 = ((uv[1].x - center.x) * (uv[2].y - center.y) - (uv[2].x - center.x) * (uv[1].y - center.y)) / area;
+                    const float w1 = ((uv[2].x - center.x) * (uv[0].y - center.y) - (uv[0].x - center.x) * (uv[2].y - center.y)) / area;
+                    const float w2 = 1.0f - w0 - w1;
+                    const unsigned int index = (unsigned int)(y * size + x);
+                    if (w0 < -1e-5f || w1 < -1e-5f || w2 < -1e-5f || covered[index])
+                        continue;
+
+                    covered[index] = 1;
+                    texels.push_back({ index, w0 * positions[0] + w1 * positions[1] + w2 * positions[2],
+                        glm::normalize(w0 * normals[0] + w1 * normals[1] + w2 * normals[2]) });
+                }
+            }
+        }
+    }
+
+    lighting.assign(size * size, glm::vec3(0.0f));
+    UParallelForRange((unsigned int)texels.size(), 256, [&](unsigned int begin, unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            const Texel& texel = texels[i];
+            BakeRandom random(texel.index);
+            glm::vec3 indirect(0.0f);
+            for (unsigned int sample = 0; sample < settings.samples; ++sample)
+            {
+                glm::vec3 position = texel.position;
+                glm::vec3 normal = texel.normal;
+                glm::vec3 throughput(1.0f);
+                for (unsigned int bounce = 0; bounce < settings.bounces; ++bounce)
+                {
+                    // Cosine-distributed direction around the normal, whose weight cancels the cosine
+                    const float radius = std::sqrt(random.next());
+                    const float angle = 6.28318531f * random.next();
+                    const glm::vec3 helper = std::fabs(normal.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+                    const glm::vec3 tangent = glm::normalize(glm::cross(helper, normal));
+                    const glm::vec3 bitangent = glm::cross(normal, tangent);
+                    const glm::vec3 direction = radius * std::cos(angle) * tangent + radius * std::sin(angle) * bitangent
+                        + std::sqrt(std::max(0.0f, 1.0f - radius * radius)) * normal;
+
+                    float distance = 0.0f;
+                    unsigned int hit = 0;
+                    if (!bvh.intersect(position + normal * LIGHTMAP_RAY_OFFSET, direction, 1e30f, distance, hit))
+                        break;
+
+                    const TriangleBvh::Triangle& triangle = bvh.triangle(hit);
+                    position += direction * distance;
+                    normal = glm::normalize(glm::cross(triangle.b - triangle.a, triangle.c - triangle.a));
+                    if (glm::dot(normal, direction) > 0.0f)
+                        normal = -normal;
+                    throughput *= albedos[triangle.surface];
+                    indirect += throughput * direct(position, normal);
+                }
+            }
+            lighting[texel.index] = direct(texel.position, texel.normal) + indirect / (float)std::max(settings.samples, 1u);
+        }
+    });
+
+    // Each pass fills the empty texels next to filled ones with the mean of their filled neighbours
+    std::vector<char> filled = covered;
+    for (int pass = 0; pass < LIGHTMAP_PADDING; ++pass)
+    {
+        std::vector<char> next = filled;
+        for (int y = 0; y < size; ++y)
+        {
+            for (int x = 0; x < size; ++x)
+            {
+                if (filled[y * size + x])
+                    continue;
+
+                glm::vec3 sum(0.0f);
+                int count = 0;
+                for (int dy = -1; dy <= 1; ++dy)
+                {
+                    for (int dx = -1; dx <= 1; ++dx)
+                    {
+                        const int nx = x + dx;
+                        const int ny = y + dy;
+                        if (nx >= 0 && ny >= 0 && nx < size && ny < size && filled[ny * size + nx])
+                        {
+                            sum += lighting[ny * size + nx];
+                            ++count;
+                        }
+                    }
+                }
+                if (count > 0)
+                {
+                    lighting[y * size + x] = sum / (float)count;
+                    next[y * size + x] = 1;
+                }
+            }
+        }
+        filled.swap(next);
+    }
+}
+
+
+// Key of everything a bake depends on: the unwrapped meshes with their lightmap coordinates, their albedos,
+// the light and the settings. It is kept with a baked file, so a file baked from other inputs is not taken
+// for the current scene. FNV-1a over the bytes of the inputs; sizes go in too, so inputs cannot run together.
+inline uint64_t ULightmapInputKey(const std::vector<LightmapMesh>& meshes, const std::vector<glm::vec3>& albedos, const glm::vec3& lightPosition,
+    const glm::vec3& lightColor, const LightmapBakeSettings& settings, int size)
+{
+    uint64_t key = 14695981039346656037ull;
+    auto add = [&key](const void* data, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            key = (key ^ ((const unsigned char*)data)[i]) * 1099511628211ull;
+    };
+    auto addVector = [&add](const auto& values)
+    {
+        const uint64_t count = values.size();
+        add(&count, sizeof(count));
+        add(values.data(), values.size() * sizeof(values[0]));
+    };
+
+    for (const LightmapMesh& mesh : meshes)
+    {
+        addVector(mesh.mesh.vertices);
+        addVector(mesh.mesh.indices);
+        addVector(mesh.uv2);
+    }
+    addVector(albedos);
+    add(&lightPosition, sizeof(lightPosition));
+    add(&lightColor, sizeof(lightColor));
+    add(&settings.samples, sizeof(settings.samples));
+    add(&settings.bounces, sizeof(settings.bounces));
+    add(&size, sizeof(size));
+    add(&LIGHTMAP_RANGE, sizeof(LIGHTMAP_RANGE));
+    return key;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Clustered lighting: the view frustum is cut into CLUSTER_COLUMNS by CLUSTER_ROWS screen tiles, and
+// each tile into CLUSTER_SLICES depth slices spaced logarithmically, so clusters keep about the same
+// proportions from near to far. Every cluster gets the list of the lights whose spheres reach it, and a
+// fragment only goes through the list of its own cluster.
+const int CLUSTER_COLUMNS = 16;
+const int CLUSTER_ROWS = 9;
+const int CLUSTER_SLICES = 24;
+const int CLUSTER_COUNT = CLUSTER_COLUMNS * CLUSTER_ROWS * CLUSTER_SLICES;
+
+// Point light, laid out as the PointLight struct of the objects shader (std430)
+struct PointLight
+{
+    glm::vec4 positionRadius;   // World-space position; the light reaches no further than the radius
+    glm::vec4 color;            // Color times intensity; w unused
+};
+
+
+// Cluster of a tile and slice, as the shaders index them
+inline int UClusterIndex(int column, int row, int slice)
+{
+    return (slice * CLUSTER_ROWS + row) * CLUSTER_COLUMNS + column;
+}
+
+
+// Builds the light lists of the clusters for a camera. Slices are independent and built as jobs; each
+// lists its lights apart, and the lists are joined in slice order into one index array, with an
+// offset and a count per cluster pointing into it.
+class LightClusters
+{
+public:
+    // near and far bound the slices; lights beyond them are left out
+    void build(const std::vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection, float near, float far)
+    {
+        if (projection != mProjection || near != mNear || far != mFar)
+            updateBounds(projection, near, far);
+
+        mViewLights.resize(lights.size());
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            const glm::vec3 center(view * glm::vec4(glm::vec3(lights[i].positionRadius), 1.0f));
+            mViewLights[i] = glm::vec4(center, lights[i].positionRadius.w);
+        }
+
+        mSliceIndices.resize(CLUSTER_SLICES);
+        mCells.resize(CLUSTER_COUNT);
+        UParallelFor(CLUSTER_SLICES, [this](unsigned int slice) { buildSlice((int)slice); });
+
+        // Offsets are local to each slice until the slices are joined
+        mIndices.clear();
+        mMaxLights = 0;
+        for (int slice = 0; slice < CLUSTER_SLICES; ++slice)
+        {
+            const unsigned int base = (unsigned int)mIndices.size();
+            for (int cell = UClusterIndex(0, 0, slice); cell < UClusterIndex(0, 0, slice + 1); ++cell)
+            {
+                mCells[cell].x += base;
+                mMaxLights = std::max(mMaxLights, mCells[cell].y);
+            }
+            mIndices.insert(mIndices.end(), mSliceIndices[slice].begin(), mSliceIndices[slice].end());
+        }
+        if (mIndices.empty())
+            mIndices.push_back(0);      // Keeps the buffer bindable
+    }
+
+    // Offset into indices() and light count of each cluster
+    const std::vector<glm::uvec2>& cells() const { return mCells; }
+    const std::vector<unsigned int>& indices() const { return mIndices; }
+    // Most lights listed in one cluster
+    unsigned int maxLights() const { return mMaxLights; }
+
+    // The slice of a view depth d is floor(log(d) * sliceScale() + sliceBias())
+    float sliceScale() const { return CLUSTER_SLICES / std::log(mFar / mNear); }
+    float sliceBias() const { return -std::log(mNear) * sliceScale(); }
+
+private:
+    // View-space box of every cluster, from the corners of its tile at the near and far depth of its slice
+    void updateBounds(const glm::mat4& projection, float near, float far)
+    {
+        mProjection = projection;
+        mNear = near;
+        mFar = far;
+
+        mBoundsMin.resize(CLUSTER_COUNT);
+        mBoundsMax.resize(CLUSTER_COUNT);
+        for (int slice = 0; slice < CLUSTER_SLICES; ++slice)
+        {
+            const float depths[2] = { sliceDepth(slice), sliceDepth(slice + 1) };
+            for (int row = 0; row < CLUSTER_ROWS; ++row)
+            {
+                for (int column = 0; column < CLUSTER_COLUMNS; ++column)
+                {
+                    glm::vec3 lo(1e30f), hi(-1e30f);
+                    for (float depth : depths)
+                    {
+                        for (int corner = 0; corner < 4; ++corner)
+                        {
+                            const float x = -1.0f + 2.0f * (column + (corner & 1)) / CLUSTER_COLUMNS;
+                            const float y = -1.0f + 2.0f * (row + (corner >> 1)) / CLUSTER_ROWS;
+                            const glm::vec3 point(x * depth / projection[0][0], y * depth / projection[1][1], -depth);
+                            lo = glm::min(lo, point);
+                            hi = glm::max(hi, point);
+                        }
+                    }
+                    mBoundsMin[UClusterIndex(column, row, slice)] = lo;
+                    mBoundsMax[UClusterIndex(column, row, slice)] = hi;
+                }
+            }
+        }
+    }
+
+    float sliceDepth(int slice) const
+    {
+        return mNear * std::pow(mFar / mNear, (float)slice / CLUSTER_SLICES);
+    }
+
+    // Lists the lights of the clusters of a slice. The tiles a light can reach come from the box around
+    // its sphere within the slice, projected; each of those clusters then tests the sphere against its box.
+    void buildSlice(int slice)
+    {
+        const float nearDepth = sliceDepth(slice);
+        const float farDepth = sliceDepth(slice + 1);
+        std::vector<unsigned int>& indices = mSliceIndices[slice];
+        indices.clear();
+
+        // Lights of each cluster of the slice, gathered first so the list of a cluster is contiguous
+        std::vector<std::vector<unsigned int>> lists(CLUSTER_COLUMNS * CLUSTER_ROWS);
+        for (size_t i = 0; i < mViewLights.size(); ++i)
+        {
+            const glm::vec3 center(mViewLights[i]);
+            const float radius = mViewLights[i].w;
+            const float depthLo = std::max(-center.z - radius, nearDepth);
+            const float depthHi = std::min(-center.z + radius, farDepth);
+            if (depthLo > depthHi)
+                continue;
+
+            float xLo = 1e30f, xHi = -1e30f, yLo = 1e30f, yHi = -1e30f;
+            for (float depth : { depthLo, depthHi })
+            {
+                for (float x : { center.x - radius, center.x + radius })
+                {
+                    xLo = std::min(xLo, x * mProjection[0][0] / depth);
+                    xHi = std::max(xHi, x * mProjection[0][0] / depth);
+                }
+                for (float y : { center.y - radius, center.y + radius })
+                {
+                    yLo = std::min(yLo, y * mProjection[1][1] / depth);
+                    yHi = std::max(yHi, y * mProjection[1][1] / depth);
+                }
+            }
+            const int columnLo = std::max((int)std::floor((xLo + 1.0f) * 0.5f * CLUSTER_COLUMNS), 0);
+            const int columnHi = std::min((int)std::floor((xHi + 1.0f) * 0.5f * CLUSTER_COLUMNS), CLUSTER_COLUMNS - 1);
+            const int rowLo = std::max((int)std::floor((yLo + 1.0f) * 0.5f * CLUSTER_ROWS), 0);
+            const int rowHi = std::min((int)std::floor((yHi + 1.0f) * 0.5f * CLUSTER_ROWS), CLUSTER_ROWS - 1);
+
+            for (int row = rowLo; row <= rowHi; ++row)
+            {
+                for (int column = columnLo; column <= columnHi; ++column)
+                {
+                    const int cluster = UClusterIndex(column, row, slice);
+                    const glm::vec3 nearest = glm::clamp(center, mBoundsMin[cluster], mBoundsMax[cluster]);
+                    const glm::vec3 offset = nearest - center;
+                    if (glm::dot(offset, offset) <= radius * radius)
+                        lists[row * CLUSTER_COLUMNS + column].push_back((unsigned int)i);
+                }
+            }
+        }
+
+        for (int tile = 0; tile < CLUSTER_COLUMNS * CLUSTER_ROWS; ++tile)
+        {
+            mCells[UClusterIndex(0, 0, slice) + tile] = glm::uvec2((unsigned int)indices.size(), (unsigned int)lists[tile].size());
+            indices.insert(indices.end(), lists[tile].begin(), lists[tile].end());
+        }
+    }
+
+    glm::mat4 mProjection = glm::mat4(0.0f);
+    float mNear = 0.0f;
+    float mFar = 0.0f;
+    std::vector<glm::vec3> mBoundsMin;
+    std::vector<glm::vec3> mBoundsMax;
+    std::vector<glm::vec4> mViewLights;                 // Center in view space, radius in w
+    std::vector<std::vector<unsigned int>> mSliceIndices;
+    std::vector<glm::uvec2> mCells;
+    std::vector<unsigned int> mIndices;
+    unsigned int mMaxLights = 0;
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
+// Generated meshes interleave position (3), normal (3) and texture coordinates (2)
+const int MESH_FLOATS_PER_POSITION = 3;
+const int MESH_FLOATS_PER_NORMAL = 3;
+const int MESH_FLOATS_PER_UV = 2;
+const int MESH_FLOATS_PER_VERTEX = MESH_FLOATS_PER_POSITION + MESH_FLOATS_PER_NORMAL + MESH_FLOATS_PER_UV;
+
+// Indexed triangle mesh kept on the CPU until it is uploaded to the GPU
+struct MeshData
+{
+    std::vector<float> vertices;        // Interleaved vertex attributes
+    std::vector<unsigned int> indices;  // Three indices per triangle
+
+    unsigned int vertexCount() const { return (unsigned int)(vertices.size() / MESH_FLOATS_PER_VERTEX); }
+    unsigned int triangleCount() const { return (unsigned int)(indices.size() / 3); }
+
+    // appends a vertex and returns its index
+    unsigned int addVertex(glm::vec3 position, glm::vec3 normal, glm::vec2 uv)
+    {
+        vertices.insert(vertices.end(), { position.x, position.y, position.z, normal.x, normal.y, normal.z, uv.x, uv.y });
+        return vertexCount() - 1;
+    }
+
+    void addTriangle(unsigned int a, unsigned int b, unsigned int c)
+    {
+        indices.insert(indices.end(), { a, b, c });
+    }
+};
+
+
+// Builds an indexed mesh from a non-indexed triangle list of position (3) and texture coordinate (2) floats,
+// such as the hand-written vertex arrays of UCreateMesh. Normals are taken from each triangle's plane and
+// corners with identical attributes are merged. The hand-written arrays do not keep a consistent winding,
+// so triangles are turned to face away from the mesh center, which holds for the convex shapes they describe.
+inline MeshData UMeshFromTriangleList(const float* positionsAndUVs, unsigned int vertexCount)
+{
+    MeshData mesh;
+    std::map<std::vector<float>, unsigned int> unique;
+
+    glm::vec3 center(0.0f);
+    for (unsigned int i = 0; i < vertexCount; ++i)
+        center += glm::vec3(positionsAndUVs[i * 5], positionsAndUVs[i * 5 + 1], positionsAndUVs[i * 5 + 2]);
+    center /= (float)std::max(vertexCount, 1u);
+
+    for (unsigned int first = 0; first + 2 < vertexCount; first += 3)
+    {
+        glm::vec3 corners[3];
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            const float* v = positionsAndUVs + (first + corner) * 5;
+            corners[corner] = glm::vec3(v[0], v[1], v[2]);
+        }
+        glm::vec3 normal = glm::normalize(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+        const bool flip = glm::dot(normal, (corners[0] + corners[1] + corners[2]) / 3.0f - center) < 0.0f;
+        if (flip)
+            normal = -normal;
+
+        unsigned int indices[3];
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            const float* v = positionsAndUVs + (first + corner) * 5;
+            std::vector<float> key = { v[0], v[1], v[2], normal.x, normal.y, normal.z, v[3], v[4] };
+
+            auto found = unique.find(key);
+            if (found == unique.end())
+                found = unique.emplace(key, mesh.addVertex(corners[corner], normal, glm::vec2(v[3], v[4]))).first;
+            indices[corner] = found->second;
+        }
+        if (flip)
+            mesh.addTriangle(indices[0], indices[2], indices[1]);
+        else
+            mesh.addTriangle(indices[0], indices[1], indices[2]);
+    }
+    return mesh;
+}
+
+
+// Applies a model matrix to the positions and normals of a mesh. Triangles are turned around when the
+// matrix mirrors the mesh, so they keep facing outwards.
+inline MeshData UTransformMesh(const MeshData& mesh, const glm::mat4& model)
+{
+    MeshData transformed = mesh;
+    const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+    for (unsigned int v = 0; v < transformed.vertexCount(); ++v)
+    {
+        float* p = &transformed.vertices[v * MESH_FLOATS_PER_VERTEX];
+        glm::vec3 position = glm::vec3(model * glm::vec4(p[0], p[1], p[2], 1.0f));
+        glm::vec3 normal = glm::normalize(normalMatrix * glm::vec3(p[3], p[4], p[5]));
+        p[0] = position.x; p[1] = position.y; p[2] = position.z;
+        p[3] = normal.x; p[4] = normal.y; p[5] = normal.z;
+    }
+
+    if (glm::determinant(glm::mat3(model)) < 0.0f)
+    {
+        for (size_t i = 0; i + 2 < transformed.indices.size(); i += 3)
+            std::swap(transformed.indices[i + 1], transformed.indices[i + 2]);
+    }
+    return transformed;
+}
+
+
+// Appends the vertices and triangles of source to target
+inline void UAppendMesh(MeshData& target, const MeshData& source)
+{
+    const unsigned int offset = target.vertexCount();
+    target.vertices.insert(target.vertices.end(), source.vertices.begin(), source.vertices.end());
+    for (unsigned int index : source.indices)
+        target.indices.push_back(index + offset);
+}
+
+
+// Largest distance between a regular n-gon and the circle it approximates
+inline float UPolygonChordError(int segments, float radius)
+{
+    return radius * (1.0f - std::cos(glm::pi<float>() / segments));
+}
+
+
+// Generates a prism of the given number of sides along the Y axis, centered on the origin.
+// Few sides with flat normals give a hexagonal pencil; many sides with smooth normals a cylinder.
+inline MeshData UGenerateCylinder(int segments, float radius, float height, bool smoothNormals)
+{
+    MeshData mesh;
+    const float halfHeight = height * 0.5f;
+    const float step = glm::two_pi<float>() / segments;
+
+    // Sides. Smooth sides share one column of vertices between neighbouring faces (plus a duplicate
+    // column where the texture wraps around); flat sides need their own vertices for their face normal.
+    if (smoothNormals)
+    {
+        for (int i = 0; i <= segments; ++i)
+        {
+            float a = i * step;
+            glm::vec3 n(std::cos(a), 0.0f, -std::sin(a));
+            float u = (float)i / segments;
+            mesh.addVertex(n * radius + glm::vec3(0.0f, -halfHeight, 0.0f), n, glm::vec2(u, 0.0f));
+            mesh.addVertex(n * radius + glm::vec3(0.0f, halfHeight, 0.0f), n, glm::vec2(u, 1.0f));
+        }
+        for (unsigned int i = 0; i < (unsigned int)segments; ++i)
+        {
+            unsigned int b0 = i * 2, t0 = i * 2 + 1, b1 = i * 2 + 2, t1 = i * 2 + 3;
+            mesh.addTriangle(b0, b1, t1);
+            mesh.addTriangle(t1, t0, b0);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < segments; ++i)
+        {
+            float a0 = i * step;
+            float a1 = (i + 1) * step;
+            glm::vec3 p0(std::cos(a0) * radius, 0.0f, -std::sin(a0) * radius);
+            glm::vec3 p1(std::cos(a1) * radius, 0.0f, -std::sin(a1) * radius);
+            glm::vec3 n = glm::normalize(glm::vec3(std::cos((a0 + a1) * 0.5f), 0.0f, -std::sin((a0 + a1) * 0.5f)));
+
+            float u0 = (float)i / segments;
+            float u1 = (float)(i + 1) / segments;
+
+            unsigned int b0 = mesh.addVertex(p0 + glm::vec3(0.0f, -halfHeight, 0.0f), n, glm::vec2(u0, 0.0f));
+            unsigned int b1 = mesh.addVertex(p1 + glm::vec3(0.0f, -halfHeight, 0.0f), n, glm::vec2(u1, 0.0f));
+            unsigned int t1 = mesh.addVertex(p1 + glm::vec3(0.0f, halfHeight, 0.0f), n, glm::vec2(u1, 1.0f));
+            unsigned int t0 = mesh.addVertex(p0 + glm::vec3(0.0f, halfHeight, 0.0f), n, glm::vec2(u0, 1.0f));
+            mesh.addTriangle(b0, b1, t1);
+            mesh.addTriangle(t1, t0, b0);
+        }
+    }
+
+    // Caps, fanned around their first vertex
+    for (int side = 0; side < 2; ++side)
+    {
+        float y = side == 0 ? halfHeight : -halfHeight;
+        glm::vec3 normal(0.0f, side == 0 ? 1.0f : -1.0f, 0.0f);
+        unsigned int first = mesh.vertexCount();
+        for (int i = 0; i < segments; ++i)
+        {
+            float a = i * step;
+            glm::vec2 c(std::cos(a), -std::sin(a));
+            mesh.addVertex(glm::vec3(c.x * radius, y, c.y * radius), normal, c * 0.5f + glm::vec2(0.5f));
+        }
+        for (int i = 1; i + 1 < segments; ++i)
+        {
+            if (side == 0)
+                mesh.addTriangle(first, first + i, first + i + 1);
+            else
+                mesh.addTriangle(first, first + i + 1, first + i);
+        }
+    }
+
+    return mesh;
+}
+
+
+// Generates a cone along the Y axis with its apex at +height/2 and a closed base at -height/2
+inline MeshData UGenerateCone(int segments, float radius, float height)
+{
+    MeshData mesh;
+    const float halfHeight = height * 0.5f;
+    const float step = glm::two_pi<float>() / segments;
+    const float slope = radius / height; // y component of the (unnormalized) side normal
+
+    // Sides, one apex vertex per segment so every facet gets its own texture column. Neighbouring facets
+    // share their base vertex, whose normal and texture coordinate they agree on.
+    for (int i = 0; i <= segments; ++i)
+    {
+        float a = i * step;
+        glm::vec3 n = glm::normalize(glm::vec3(std::cos(a), slope, -std::sin(a)));
+        mesh.addVertex(glm::vec3(std::cos(a) * radius, -halfHeight, -std::sin(a) * radius), n, glm::vec2((float)i / segments, 0.0f));
+    }
+    for (int i = 0; i < segments; ++i)
+    {
+        float am = (i + 0.5f) * step;
+        glm::vec3 nm = glm::normalize(glm::vec3(std::cos(am), slope, -std::sin(am)));
+        unsigned int apex = mesh.addVertex(glm::vec3(0.0f, halfHeight, 0.0f), nm, glm::vec2((i + 0.5f) / segments, 1.0f));
+        mesh.addTriangle((unsigned int)i, (unsigned int)i + 1, apex);
+    }
+
+    // Base
+    glm::vec3 normal(0.0f, -1.0f, 0.0f);
+    unsigned int first = mesh.vertexCount();
+    for (int i = 0; i < segments; ++i)
+    {
+        float a = i * step;
+        glm::vec2 c(std::cos(a), -std::sin(a));
+        mesh.addVertex(glm::vec3(c.x * radius, -halfHeight, c.y * radius), normal, c * 0.5f + glm::vec2(0.5f));
+    }
+    for (int i = 1; i + 1 < segments; ++i)
+        mesh.addTriangle(first, first + i + 1, first + i);
+
+    return mesh;
+}
+
+
+// Radius in pixels of a bounding sphere seen through a perspective camera
+inline float UProjectedRadius(float radius, float distance, float fovyDegrees, float viewportHeight)
+{
+    // The camera is inside the sphere: treat it as covering the whole viewport
+    if (distance <= radius)
+        return viewportHeight;
+
+    float halfFov = glm::radians(fovyDegrees) * 0.5f;
+    return radius / (distance * std::tan(halfFov)) * (viewportHeight * 0.5f);
+}
+
+
+// Number of pixels one world unit covers at the given distance from a perspective camera
+inline float UPixelsPerUnit(float distance, float fovyDegrees, float viewportHeight)
+{
+    float halfFov = glm::radians(fovyDegrees) * 0.5f;
+    return viewportHeight * 0.5f / (glm::max(distance, 1e-4f) * std::tan(halfFov));
+}
+
+
+// Picks a level of detail given the projected radius of an object in pixels.
+// minRadius holds, finest level first, the smallest radius each level is used at.
+inline int USelectLod(float projectedRadius, const float* minRadius, int levelCount)
+{
+    for (int level = 0; level < levelCount - 1; ++level)
+    {
+        if (projectedRadius >= minRadius[level])
+            return level;
+    }
+    return levelCount - 1;
+}
+
+#endif
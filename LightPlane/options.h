@@ -0,0 +1,130 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+
+// Settings given as "key = value" lines of a config file ('#' starts a comment) and on the command line
+// as --key value, --key=value or a bare --key meaning true. The command line overrides the file.
+class Options
+{
+public:
+    // Reads the config file named by --config, or defaultConfig when there is no such argument and the
+    // file exists, then the command line on top of it
+    void parse(int argc, char* argv[], const std::string& defaultConfig)
+    {
+        std::map<std::string, std::string> commandLine;
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string argument = argv[i];
+            if (argument.compare(0, 2, "--") != 0)
+            {
+                std::cerr << "Ignoring argument " << argument << std::endl;
+                continue;
+            }
+
+            std::string key = argument.substr(2), value = "true";
+            size_t equals = key.find('=');
+            if (equals != std::string::npos)
+            {
+                value = key.substr(equals + 1);
+                key = key.substr(0, equals);
+            }
+            else if (i + 1 < argc && std::string(argv[i + 1]).compare(0, 2, "--") != 0)
+                value = argv[++i];
+            commandLine[key] = value;
+        }
+
+        auto config = commandLine.find("config");
+        if (config != commandLine.end())
+        {
+            if (!loadFile(config->second))
+                std::cerr << "Failed to read config file " << config->second << std::endl;
+        }
+        else
+            loadFile(defaultConfig);
+
+        for (const auto& option : commandLine)
+            mValues[option.first] = option.second;
+    }
+
+    // Adds the options of a config file; false when it cannot be read
+    bool loadFile(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            return false;
+
+        std::string line;
+        while (std::getline(file, line))
+        {
+            line = line.substr(0, line.find('#'));
+            size_t equals = line.find('=');
+            if (equals == std::string::npos)
+                continue;
+
+            std::string key = trim(line.substr(0, equals));
+            if (!key.empty())
+                mValues[key] = trim(line.substr(equals + 1));
+        }
+        return true;
+    }
+
+    void set(const std::string& key, const std::string& value) { mValues[key] = value; }
+    bool has(const std::string& key) const { return mValues.count(key) != 0; }
+
+    std::string getString(const std::string& key, const std::string& fallback) const
+    {
+        auto found = mValues.find(key);
+        return found != mValues.end() ? found->second : fallback;
+    }
+
+    double getNumber(const std::string& key, double fallback) const
+    {
+        auto found = mValues.find(key);
+        if (found == mValues.end())
+            return fallback;
+
+        char* end = nullptr;
+        double value = std::strtod(found->second.c_str(), &end);
+        if (end == found->second.c_str() || *end != '\0')
+        {
+            std::cerr << "Option " << key << " is not a number: " << found->second << std::endl;
+            return fallback;
+        }
+        return value;
+    }
+
+    // Accepts true/false, on/off, yes/no and 1/0
+    bool getBool(const std::string& key, bool fallback) const
+    {
+        auto found = mValues.find(key);
+        if (found == mValues.end())
+            return fallback;
+
+        const std::string& value = found->second;
+        if (value == "true" || value == "on" || value == "yes" || value == "1")
+            return true;
+        if (value == "false" || value == "off" || value == "no" || value == "0")
+            return false;
+
+        std::cerr << "Option " << key << " is not a boolean: " << value << std::endl;
+        return fallback;
+    }
+
+private:
+    static std::string trim(const std::string& text)
+    {
+        size_t first = text.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            return std::string();
+        return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    std::map<std::string, std::string> mValues;
+};
+
+#endif
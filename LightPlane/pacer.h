@@ -0,0 +1,156 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+// Sleep granularity is 15.6 ms on Windows unless the timer resolution is raised
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#pragma comment(lib, "winmm.lib")
+#endif
+
+const double PACER_LATENCY_MARGIN = 0.001;  // Time kept free before the deadline in low-latency mode, for the swap
+const double PACER_MIN_SPIN = 0.0002;       // Bounds of the final stretch of a wait that spins instead of sleeping
+const double PACER_MAX_SPIN = 0.004;
+
+// Holds the render loop to a target frame rate without keeping a core busy. Each frame has a deadline
+// one period after the previous one; the loop waits for its start time by sleeping while the deadline is
+// far, then spinning through the last stretch that a sleep could overshoot.
+// In low-latency mode a frame starts as late as its expected duration allows instead of right at the
+// start of its period, so the input it samples is as recent as possible when the frame is shown.
+class FramePacer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::duration<double> Seconds;
+
+    FramePacer()
+    {
+#if defined(_WIN32)
+        timeBeginPeriod(1);
+#endif
+        mDeadline = mFrameStart = mWorkEnd = mLastFrameEnd = mWindowStart = Clock::now();
+    }
+
+    ~FramePacer()
+    {
+#if defined(_WIN32)
+        timeEndPeriod(1);
+#endif
+    }
+
+    // 0 leaves the frame rate uncapped
+    void setTargetFps(double fps)
+    {
+        mPeriod = fps > 0.0 ? 1.0 / fps : 0.0;
+        mDeadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(Seconds(mPeriod));
+    }
+
+    double targetFps() const { return mPeriod > 0.0 ? 1.0 / mPeriod : 0.0; }
+
+    void setLowLatency(bool lowLatency) { mLowLatency = lowLatency; }
+    bool lowLatency() const { return mLowLatency; }
+
+    // Returns when the next frame should start
+    void waitForFrame()
+    {
+        if (mPeriod > 0.0)
+        {
+            // The frame's work, padded for its variation, has to fit before the deadline
+            double lead = mLowLatency ? std::min(mPeriod, mWorkEstimate * 1.25 + PACER_LATENCY_MARGIN) : mPeriod;
+            waitUntil(mDeadline - std::chrono::duration_cast<Clock::duration>(Seconds(lead)));
+        }
+        mFrameStart = mWorkEnd = Clock::now();
+    }
+
+    // Marks the end of the frame's work, right before the buffers are swapped. The swap can block on the
+    // display; counting that as work would make low-latency mode start frames ever earlier.
+    void endWork()
+    {
+        mWorkEnd = Clock::now();
+    }
+
+    // Marks the end of the frame, after the buffers are swapped
+    void endFrame()
+    {
+        Clock::time_point now = Clock::now();
+
+        // The estimate follows a longer frame at once and a shorter one gradually. Without an endWork
+        // call the whole frame counts.
+        Clock::time_point workEnd = mWorkEnd > mFrameStart ? mWorkEnd : now;
+        double work = Seconds(workEnd - mFrameStart).count();
+        mWorkEstimate = work > mWorkEstimate ? work : mWorkEstimate + (work - mWorkEstimate) * 0.05;
+
+        // A missed deadline starts a fresh schedule instead of rushing the following frames
+        Clock::duration period = std::chrono::duration_cast<Clock::duration>(Seconds(mPeriod));
+        mDeadline += period;
+        if (mDeadline < now)
+            mDeadline = now + period;
+
+        // Frame-to-frame intervals, summarized once per second
+        double interval = Seconds(now - mLastFrameEnd).count();
+        mLastFrameEnd = now;
+        ++mWindowFrames;
+        mWindowSum += interval;
+        mWindowSumSquares += interval * interval;
+        if (Seconds(now - mWindowStart).count() >= 1.0)
+        {
+            double mean = mWindowSum / mWindowFrames;
+            mFps = 1.0 / mean;
+            mJitter = std::sqrt(std::max(0.0, mWindowSumSquares / mWindowFrames - mean * mean));
+            mWindowStart = now;
+            mWindowFrames = 0;
+            mWindowSum = mWindowSumSquares = 0.0;
+        }
+    }
+
+    // Frame rate achieved over the last full second
+    double fps() const { return mFps; }
+    // Standard deviation of the frame intervals over the last full second, in seconds
+    double jitter() const { return mJitter; }
+
+private:
+    void waitUntil(Clock::time_point target)
+    {
+        while (true)
+        {
+            Clock::time_point before = Clock::now();
+            double remaining = Seconds(target - before).count();
+            if (remaining <= mSpinThreshold)
+                break;
+
+            // How much the sleep overshoots decides how early the next ones hand over to spinning
+            double requested = remaining - mSpinThreshold;
+            std::this_thread::sleep_for(Seconds(requested));
+            double overshoot = Seconds(Clock::now() - before).count() - requested;
+            mSpinThreshold = std::min(PACER_MAX_SPIN, std::max(PACER_MIN_SPIN, mSpinThreshold + (overshoot * 1.5 - mSpinThreshold) * 0.1));
+        }
+
+        while (Clock::now() < target)
+            std::this_thread::yield();
+    }
+
+    double mPeriod = 0.0;                   // Seconds per frame, 0 when uncapped
+    bool mLowLatency = false;
+    double mWorkEstimate = 0.0;             // Seconds from a frame's start to the end of its work
+    double mSpinThreshold = 0.002;          // Remaining time below which waiting spins rather than sleeps
+    Clock::time_point mDeadline;            // When the current frame should be done
+    Clock::time_point mFrameStart;
+    Clock::time_point mWorkEnd;
+    Clock::time_point mLastFrameEnd;
+
+    Clock::time_point mWindowStart;
+    unsigned int mWindowFrames = 0;
+    double mWindowSum = 0.0;
+    double mWindowSumSquares = 0.0;
+    double mFps = 0.0;
+    double mJitter = 0.0;
+};
+
+#endif
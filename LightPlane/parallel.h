@@ -0,0 +1,348 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One range of a parallel loop: function(context, begin, end) runs on whichever thread takes the job
+struct Job
+{
+    void (*function)(const void* context, unsigned int begin, unsigned int end);
+    const void* context;
+    unsigned int begin;
+    unsigned int end;
+    std::atomic<unsigned int>* remaining;   // Jobs of the loop not finished yet
+};
+
+
+// Chase-Lev work-stealing deque of a fixed capacity. The owning thread pushes and pops at the bottom
+// without locking; the other threads steal from the top, the only end where they compete.
+class JobDeque
+{
+public:
+    static const int64_t CAPACITY = 4096;
+
+    JobDeque()
+    {
+        for (std::atomic<Job*>& job : mJobs)
+            job.store(nullptr, std::memory_order_relaxed);
+    }
+
+    // Owner only. Fails when the deque is full.
+    bool push(Job* job)
+    {
+        int64_t bottom = mBottom.load(std::memory_order_relaxed);
+        int64_t top = mTop.load(std::memory_order_acquire);
+        if (bottom - top >= CAPACITY)
+            return false;
+
+        // Released with the new bottom, so a thief that sees the job also sees its contents
+        mJobs[bottom & (CAPACITY - 1)].store(job, std::memory_order_relaxed);
+        mBottom.store(bottom + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only. Takes the most recently pushed job, or nullptr when empty.
+    Job* pop()
+    {
+        int64_t bottom = mBottom.load(std::memory_order_relaxed) - 1;
+        mBottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = mTop.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+            mBottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        Job* job = mJobs[bottom & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (top == bottom)
+        {
+            // Last job: a thief may be taking it at the same time, and the top decides who gets it
+            if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                job = nullptr;
+            mBottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    // Any thread. Takes the oldest job, or nullptr when empty or lost to another thread.
+    Job* steal()
+    {
+        int64_t top = mTop.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = mBottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return nullptr;
+
+        Job* job = mJobs[top & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return job;
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> mTop{ 0 };
+    alignas(64) std::atomic<int64_t> mBottom{ 0 };
+    std::atomic<Job*> mJobs[CAPACITY];
+};
+
+
+// Worker threads kept for the whole run, one deque per thread. The thread that creates the system is
+// thread 0 and takes part in the loops it starts; idle workers steal, then sleep until jobs are queued.
+class JobSystem
+{
+public:
+    JobSystem()
+    {
+        mThreadCount = std::max(1u, std::thread::hardware_concurrency());
+        mDeques = std::vector<JobDeque>(mThreadCount);
+        threadIndex() = 0;
+        for (unsigned int thread = 1; thread < mThreadCount; ++thread)
+            mWorkers.emplace_back(&JobSystem::workerLoop, this, thread);
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWakeUp.notify_all();
+        for (std::thread& worker : mWorkers)
+            worker.join();
+    }
+
+    unsigned int threadCount() const { return mThreadCount; }
+
+    // Runs every job and returns once they have all finished. The calling thread works on them too;
+    // a thread that is not part of the system runs them itself, one after the other.
+    void run(Job* jobs, unsigned int count)
+    {
+        const int thread = threadIndex();
+        if (thread < 0)
+        {
+            for (unsigned int j = 0; j < count; ++j)
+                execute(&jobs[j]);
+            return;
+        }
+
+        std::atomic<unsigned int>& remaining = *jobs[0].remaining;
+        for (unsigned int j = 0; j < count; ++j)
+        {
+            if (mDeques[thread].push(&jobs[j]))
+                mQueued.fetch_add(1, std::memory_order_release);
+            else
+                execute(&jobs[j]);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+        }
+        mWakeUp.notify_all();
+
+        while (remaining.load(std::memory_order_acquire) > 0)
+        {
+            if (!runOne((unsigned int)thread))
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    // Index of the calling thread in the system, -1 for other threads
+    static int& threadIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    static void execute(Job* job)
+    {
+        job->function(job->context, job->begin, job->end);
+        job->remaining->fetch_sub(1, std::memory_order_release);
+    }
+
+    // Runs one job from the thread's own deque or, failing that, one stolen from another thread
+    bool runOne(unsigned int thread)
+    {
+        Job* job = mDeques[thread].pop();
+        for (unsigned int offset = 1; !job && offset < mThreadCount; ++offset)
+            job = mDeques[(thread + offset) % mThreadCount].steal();
+        if (!job)
+            return false;
+
+        mQueued.fetch_sub(1, std::memory_order_relaxed);
+        execute(job);
+        return true;
+    }
+
+    void workerLoop(unsigned int thread)
+    {
+        threadIndex() = (int)thread;
+        while (true)
+        {
+            if (runOne(thread))
+                continue;
+
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWakeUp.wait(lock, [this]() { return mStop || mQueued.load(std::memory_order_acquire) > 0; });
+            if (mStop)
+                return;
+        }
+    }
+
+    unsigned int mThreadCount;
+    std::vector<JobDeque> mDeques;
+    std::vector<std::thread> mWorkers;
+    std::atomic<int> mQueued{ 0 };      // Jobs pushed and not taken yet, what idle workers wait for
+    std::mutex mMutex;
+    std::condition_variable mWakeUp;
+    bool mStop = false;
+};
+
+
+// The job system shared by every parallel loop, started by the first loop
+inline JobSystem& UJobSystem()
+{
+    static JobSystem system;
+    return system;
+}
+
+
+// Calls function(begin, end) over [0, count) cut into ranges of grain items, spread over the job system.
+// A loop that fits in one range runs right away on the calling thread. Returns once every range is done.
+template <typename Function>
+void UParallelForRange(unsigned int count, unsigned int grain, Function function)
+{
+    if (count == 0)
+        return;
+
+    const unsigned int jobCount = (count + grain - 1) / grain;
+    if (jobCount == 1)
+    {
+        function(0u, count);
+        return;
+    }
+
+    std::atomic<unsigned int> remaining(jobCount);
+    std::vector<Job> jobs(jobCount);
+    for (unsigned int j = 0; j < jobCount; ++j)
+    {
+        jobs[j].function = [](const void* context, unsigned int begin, unsigned int end)
+        {
+            (*(const Function*)context)(begin, end);
+        };
+        jobs[j].context = &function;
+        jobs[j].begin = j * grain;
+        jobs[j].end = std::min(count, (j + 1) * grain);
+        jobs[j].remaining = &remaining;
+    }
+    UJobSystem().run(jobs.data(), jobCount);
+}
+
+
+// Jobs per thread UParallelFor aims for: enough for stealing to even out uneven items, few enough that
+// the per-job overhead stays small and the jobs fit the deques
+const unsigned int PARALLEL_FOR_JOBS_PER_THREAD = 4;
+
+// Calls function(i) for every i in [0, count) on the job system, in ranges sized from the count and the
+// number of threads. The calling thread takes part in the work; returns once every call has finished.
+template <typename Function>
+void UParallelFor(unsigned int count, Function function)
+{
+    const unsigned int jobs = UJobSystem().threadCount() * PARALLEL_FOR_JOBS_PER_THREAD;
+    const unsigned int grain = std::max(1u, (count + jobs - 1) / jobs);
+    UParallelForRange(count, grain, [&](unsigned int begin, unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; ++i)
+            function(i);
+    });
+}
+
+
+// Threads running tasks in the background, for work the frame does not wait for, such as encoding
+// images. Tasks start in the order they were pushed; wait() returns once every one of them has finished.
+class TaskQueue
+{
+public:
+    explicit TaskQueue(unsigned int threadCount)
+    {
+        for (unsigned int thread = 0; thread < std::max(1u, threadCount); ++thread)
+            mThreads.emplace_back(&TaskQueue::workerLoop, this);
+    }
+
+    // Finishes the queued tasks first
+    ~TaskQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWakeUp.notify_all();
+        for (std::thread& thread : mThreads)
+            thread.join();
+    }
+
+    void push(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push_back(std::move(task));
+            ++mUnfinished;
+        }
+        mWakeUp.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mFinished.wait(lock, [this]() { return mUnfinished == 0; });
+    }
+
+    // Tasks queued or running
+    unsigned int unfinished()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mUnfinished;
+    }
+
+private:
+    void workerLoop()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mWakeUp.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+                if (mTasks.empty())
+                    return;
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (--mUnfinished == 0)
+                mFinished.notify_all();
+        }
+    }
+
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mTasks;
+    unsigned int mUnfinished = 0;
+    std::mutex mMutex;
+    std::condition_variable mWakeUp;
+    std::condition_variable mFinished;
+    bool mStop = false;
+};
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+const int PNG_WINDOW = 32768;           // Deflate match window
+const int PNG_HASH_SIZE = 1 << 15;
+const int PNG_MAX_CHAIN = 16;           // Earlier matches tried per position, trading size for speed
+const int PNG_MIN_MATCH = 3;
+const int PNG_MAX_MATCH = 258;
+
+// Writes the bits of a deflate stream, least significant first
+class PngBitWriter
+{
+public:
+    explicit PngBitWriter(std::vector<unsigned char>& out) : mOut(out) {}
+
+    void write(uint32_t bits, int count)
+    {
+        mBuffer |= bits << mCount;
+        mCount += count;
+        while (mCount >= 8)
+        {
+            mOut.push_back((unsigned char)mBuffer);
+            mBuffer >>= 8;
+            mCount -= 8;
+        }
+    }
+
+    // Huffman codes are defined most significant bit first
+    void writeCode(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; ++i)
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        write(reversed, length);
+    }
+
+    void flush()
+    {
+        if (mCount > 0)
+            mOut.push_back((unsigned char)mBuffer);
+        mBuffer = 0;
+        mCount = 0;
+    }
+
+private:
+    std::vector<unsigned char>& mOut;
+    uint32_t mBuffer = 0;
+    int mCount = 0;
+};
+
+
+// Literal or length symbol of the fixed Huffman code of deflate
+inline void UPngWriteSymbol(PngBitWriter& bits, int symbol)
+{
+    if (symbol < 144)
+        bits.writeCode(0x30 + symbol, 8);
+    else if (symbol < 256)
+        bits.writeCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        bits.writeCode(symbol - 256, 7);
+    else
+        bits.writeCode(0xc0 + symbol - 280, 8);
+}
+
+
+inline void UPngWriteMatch(PngBitWriter& bits, int length, int distance)
+{
+    static const int LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const int DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const int DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    int code = 28;
+    while (LENGTH_BASE[code] > length)
+        --code;
+    UPngWriteSymbol(bits, 257 + code);
+    bits.write(length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+    code = 29;
+    while (DISTANCE_BASE[code] > distance)
+        --code;
+    bits.writeCode(code, 5);
+    bits.write(distance - DISTANCE_BASE[code], DISTANCE_EXTRA[code]);
+}
+
+
+// Compresses data into a zlib stream: one deflate block with the fixed Huffman code, matches found
+// through hash chains over the last 32 KB
+inline void UPngDeflate(const std::vector<unsigned char>& data, std::vector<unsigned char>& out)
+{
+    out.push_back(0x78);    // 32 KB window, no dictionary
+    out.push_back(0x01);
+
+    PngBitWriter bits(out);
+    bits.write(1, 1);       // Final block
+    bits.write(1, 2);       // Fixed Huffman code
+
+    const int size = (int)data.size();
+    std::vector<int> head(PNG_HASH_SIZE, -1);
+    std::vector<int> previous(PNG_WINDOW, -1);
+    auto hash = [&](int position)
+    {
+        return (int)(((data[position] << 10) ^ (data[position + 1] << 5) ^ data[position + 2]) & (PNG_HASH_SIZE - 1));
+    };
+    auto insert = [&](int position)
+    {
+        int h = hash(position);
+        previous[position & (PNG_WINDOW - 1)] = head[h];
+        head[h] = position;
+    };
+
+    int position = 0;
+    while (position < size)
+    {
+        int bestLength = 0;
+        int bestDistance = 0;
+        if (position + PNG_MIN_MATCH <= size)
+        {
+            const int maxLength = std::min(PNG_MAX_MATCH, size - position);
+            int candidate = head[hash(position)];
+            for (int chain = 0; chain < PNG_MAX_CHAIN && candidate >= 0 && position - candidate <= PNG_WINDOW; ++chain)
+            {
+                if (data[candidate + bestLength] == data[position + bestLength])
+                {
+                    int length = 0;
+                    while (length < maxLength && data[candidate + length] == data[position + length])
+                        ++length;
+                    if (length > bestLength)
+                    {
+                        bestLength = length;
+                        bestDistance = position - candidate;
+                        if (length == maxLength)
+                            break;
+                    }
+                }
+                candidate = previous[candidate & (PNG_WINDOW - 1)];
+            }
+        }
+
+        if (bestLength >= PNG_MIN_MATCH)
+        {
+            UPngWriteMatch(bits, bestLength, bestDistance);
+            for (int i = 0; i < bestLength; ++i, ++position)
+            {
+                if (position + PNG_MIN_MATCH <= size)
+                    insert(position);
+            }
+        }
+        else
+        {
+            UPngWriteSymbol(bits, data[position]);
+            if (position + PNG_MIN_MATCH <= size)
+                insert(position);
+            ++position;
+        }
+    }
+    UPngWriteSymbol(bits, 256);     // End of block
+    bits.flush();
+
+    uint32_t a = 1, b = 0;          // Adler-32 of the uncompressed data
+    for (int i = 0; i < size; ++i)
+    {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((unsigned char)(((b << 16) | a) >> shift));
+}
+
+
+inline uint32_t UPngCrc(const unsigned char* data, size_t size, uint32_t crc = 0)
+{
+    // Built once, safely when several threads encode at the same time
+    static const std::array<uint32_t, 256> table = []()
+    {
+        std::array<uint32_t, 256> entries;
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+        return entries;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+inline void UPngWriteChunk(std::vector<unsigned char>& file, const char* type, const std::vector<unsigned char>& data)
+{
+    const uint32_t size = (uint32_t)data.size();
+    for (int shift = 24; shift >= 0; shift -= 8)
+        file.push_back((unsigned char)(size >> shift));
+
+    const size_t start = file.size();
+    file.insert(file.end(), type, type + 4);
+    file.insert(file.end(), data.begin(), data.end());
+    const uint32_t crc = UPngCrc(&file[start], file.size() - start);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        file.push_back((unsigned char)(crc >> shift));
+}
+
+
+// Encodes an opaque RGBA image as an RGB PNG. Rows are stride bytes apart, from the top of the image down;
+// a negative stride with the last row as pixels stores a bottom-up image, as read back from OpenGL.
+// Each row is filtered with whichever PNG filter leaves the smallest differences, then deflated.
+inline bool UWritePng(const std::string& path, const unsigned char* pixels, int width, int height, ptrdiff_t stride)
+{
+    const int rowSize = width * 3;
+    std::vector<unsigned char> filtered((size_t)(rowSize + 1) * height);
+    std::vector<unsigned char> row(rowSize), above(rowSize, 0), candidate(rowSize), best(rowSize);
+
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char* source = pixels + stride * y;
+        for (int x = 0; x < width; ++x)
+            memcpy(&row[x * 3], &source[x * 4], 3);
+
+        int bestFilter = 0;
+        long bestCost = -1;
+        for (int filter = 0; filter < 5; ++filter)
+        {
+            long cost = 0;
+            for (int i = 0; i < rowSize; ++i)
+            {
+                const int left = i >= 3 ? row[i - 3] : 0;
+                const int up = above[i];
+                const int upLeft = i >= 3 ? above[i - 3] : 0;
+                int predicted = 0;
+                switch (filter)
+                {
+                case 1: predicted = left; break;
+                case 2: predicted = up; break;
+                case 3: predicted = (left + up) / 2; break;
+                case 4:
+                {
+                    const int p = left + up - upLeft;
+                    const int pa = std::abs(p - left), pb = std::abs(p - up), pc = std::abs(p - upLeft);
+                    predicted = pa <= pb && pa <= pc ? left : pb <= pc ? up : upLeft;
+                    break;
+                }
+                }
+                candidate[i] = (unsigned char)(row[i] - predicted);
+                cost += std::abs((int)(signed char)candidate[i]);
+            }
+            if (bestCost < 0 || cost < bestCost)
+            {
+                bestCost = cost;
+                bestFilter = filter;
+                best.swap(candidate);
+            }
+        }
+
+        unsigned char* out = &filtered[(size_t)(rowSize + 1) * y];
+        out[0] = (unsigned char)bestFilter;
+        memcpy(out + 1, best.data(), rowSize);
+        above.swap(row);
+    }
+
+    std::vector<unsigned char> header(13), compressed;
+    for (int i = 0; i < 4; ++i)
+    {
+        header[i] = (unsigned char)(width >> (24 - 8 * i));
+        header[4 + i] = (unsigned char)(height >> (24 - 8 * i));
+    }
+    header[8] = 8;      // Bits per channel
+    header[9] = 2;      // RGB
+    UPngDeflate(filtered, compressed);
+
+    static const unsigned char SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::vector<unsigned char> file(SIGNATURE, SIGNATURE + 8);
+    UPngWriteChunk(file, "IHDR", header);
+    UPngWriteChunk(file, "IDAT", compressed);
+    UPngWriteChunk(file, "IEND", std::vector<unsigned char>());
+
+    std::ofstream stream(path, std::ios::binary);
+    stream.write((const char*)file.data(), file.size());
+    return (bool)stream;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+#include <algorithm>
+#include <cmath>
+
+const float RESOLUTION_DEADBAND = 0.02f;    // Scale differences too small to act on
+const float RESOLUTION_MAX_STEP_UP = 0.01f; // Largest increase of the scale per frame
+
+// Picks the resolution scale of the scene from measured GPU frame times so they stay within a budget.
+// The scale applies to both axes; GPU time is taken to grow with the pixel count, the square of the scale.
+// Over budget the scale drops at once to what the measurement says fits; under budget it creeps back up,
+// so a single cheap frame cannot make the next ones overshoot. Small differences are ignored, which keeps
+// the scale steady instead of wobbling from frame to frame.
+class ResolutionController
+{
+public:
+    ResolutionController(float minScale = 0.5f, float maxScale = 1.0f) : mMinScale(minScale), mMaxScale(maxScale), mScale(maxScale) {}
+
+    void setBudget(double seconds) { mBudget = seconds; }
+    double budget() const { return mBudget; }
+
+    void setRange(float minScale, float maxScale)
+    {
+        mMinScale = minScale;
+        mMaxScale = std::max(minScale, maxScale);
+        mScale = std::min(std::max(mScale, mMinScale), mMaxScale);
+    }
+
+    // Feeds the GPU time of a frame rendered at scale measuredScale, which lags the current scale when
+    // timer results arrive a few frames late. Returns the scale for the next frame.
+    float update(double gpuSeconds, float measuredScale)
+    {
+        if (gpuSeconds <= 0.0 || mBudget <= 0.0)
+            return mScale;
+
+        // Scale at which the measured frame would have just met the budget. A drop follows it straight
+        // away; a rise follows it smoothed over a few frames.
+        float ideal = measuredScale * (float)std::sqrt(mBudget / gpuSeconds);
+        mIdeal = mIdeal > 0.0f ? mIdeal + (ideal - mIdeal) * 0.25f : ideal;
+
+        if (ideal < mScale - RESOLUTION_DEADBAND)
+        {
+            mScale = ideal;
+            mIdeal = ideal;
+        }
+        else if (mIdeal > mScale + RESOLUTION_DEADBAND)
+            mScale += std::min(mIdeal - mScale, RESOLUTION_MAX_STEP_UP);
+
+        mScale = std::min(std::max(mScale, mMinScale), mMaxScale);
+        return mScale;
+    }
+
+    float scale() const { return mScale; }
+
+    // Back to full resolution, as when scaling is turned off and on again
+    void reset()
+    {
+        mScale = mMaxScale;
+        mIdeal = 0.0f;
+    }
+
+private:
+    float mMinScale;
+    float mMaxScale;
+    float mScale;
+    float mIdeal = 0.0f;
+    double mBudget = 1.0 / 60.0;
+};
+
+#endif
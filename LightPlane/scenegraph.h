@@ -0,0 +1,113 @@
+#ifndef SCENEGRAPH_H
+#define SCENEGRAPH_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <vector>
+
+// Hierarchy of transforms kept in arrays ordered so that every parent comes before its children.
+// A node's world matrix is its parent's world position and orientation combined with its own local
+// translation, rotation and scale. Scale is not passed down, so a stretched pencil body does not
+// stretch the nib attached to it.
+// World matrices are only recomputed for nodes whose local transform changed or whose ancestor moved,
+// in a single pass over the arrays; a frame where nothing changed only reads the dirty flags.
+class SceneGraph
+{
+public:
+    // Adds a node under parent (-1 for a root) with a transform relative to the parent, and returns its index.
+    // Parents must be added before their children.
+    int addNode(int parent, glm::vec3 translation, glm::quat rotation, glm::vec3 scale)
+    {
+        int node = (int)mParent.size();
+        mParent.push_back(parent < node ? parent : -1);
+        mTranslation.push_back(translation);
+        mRotation.push_back(rotation);
+        mScale.push_back(scale);
+        mWorldTranslation.push_back(glm::vec3(0.0f));
+        mWorldRotation.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+        mWorld.push_back(glm::mat4(1.0f));
+        mDirty.push_back(1);
+        mChanged.push_back(0);
+
+        // Computed right away so children can be placed relative to it before the next update
+        computeWorld(node);
+        return node;
+    }
+
+    // Adds a node given its placement in world space, converted to a transform relative to the parent
+    int addNodeAtWorld(int parent, glm::vec3 translation, glm::quat rotation, glm::vec3 scale)
+    {
+        if (parent < 0)
+            return addNode(parent, translation, rotation, scale);
+
+        glm::quat toParent = glm::conjugate(mWorldRotation[parent]);
+        return addNode(parent, toParent * (translation - mWorldTranslation[parent]), toParent * rotation, scale);
+    }
+
+    void setTranslation(int node, glm::vec3 translation) { mTranslation[node] = translation; mDirty[node] = 1; }
+    void setRotation(int node, glm::quat rotation) { mRotation[node] = rotation; mDirty[node] = 1; }
+    void setScale(int node, glm::vec3 scale) { mScale[node] = scale; mDirty[node] = 1; }
+
+    glm::vec3 translation(int node) const { return mTranslation[node]; }
+    glm::quat rotation(int node) const { return mRotation[node]; }
+    glm::vec3 scale(int node) const { return mScale[node]; }
+
+    // Recomputes the world matrices that are out of date and returns how many were.
+    // changed() then tells which nodes got a new world matrix.
+    unsigned int update()
+    {
+        unsigned int updated = 0;
+        for (size_t node = 0; node < mParent.size(); ++node)
+        {
+            int parent = mParent[node];
+            bool dirty = mDirty[node] || (parent >= 0 && mChanged[parent]);
+            mChanged[node] = dirty;
+            if (!dirty)
+                continue;
+
+            computeWorld((int)node);
+            mDirty[node] = 0;
+            ++updated;
+        }
+        return updated;
+    }
+
+    size_t size() const { return mParent.size(); }
+    int parent(int node) const { return mParent[node]; }
+    bool changed(int node) const { return mChanged[node] != 0; }
+    const glm::mat4& world(int node) const { return mWorld[node]; }
+    // Parts of the world matrix, as world(node) = translate(worldTranslation) * worldRotation * scale(scale)
+    glm::vec3 worldTranslation(int node) const { return mWorldTranslation[node]; }
+    glm::quat worldRotation(int node) const { return mWorldRotation[node]; }
+
+private:
+    void computeWorld(int node)
+    {
+        glm::vec3 translation = mTranslation[node];
+        glm::quat rotation = mRotation[node];
+        int parent = mParent[node];
+        if (parent >= 0)
+        {
+            translation = mWorldTranslation[parent] + mWorldRotation[parent] * translation;
+            rotation = mWorldRotation[parent] * rotation;
+        }
+
+        mWorldTranslation[node] = translation;
+        mWorldRotation[node] = rotation;
+        mWorld[node] = glm::scale(glm::translate(glm::mat4(1.0f), translation) * glm::mat4_cast(rotation), mScale[node]);
+    }
+
+    std::vector<int> mParent;
+    std::vector<glm::vec3> mTranslation;        // Local transform, relative to the parent
+    std::vector<glm::quat> mRotation;
+    std::vector<glm::vec3> mScale;
+    std::vector<glm::vec3> mWorldTranslation;   // World translation and rotation, passed down to the children
+    std::vector<glm::quat> mWorldRotation;
+    std::vector<glm::mat4> mWorld;              // World matrix including the node's own scale
+    std::vector<unsigned char> mDirty;          // Local transform changed since the last update
+    std::vector<unsigned char> mChanged;        // World matrix recomputed by the last update
+};
+
+#endif
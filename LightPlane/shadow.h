@@ -0,0 +1,121 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "culling.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <vector>
+
+// Shadows of a point light: its surroundings are split into six spot frusta, one around each cube face
+// direction, and each face gets a tile of a shadow atlas. The atlas is a grid of SHADOW_ATLAS_COLUMNS by
+// SHADOW_ATLAS_ROWS tiles in two layers: the static layer holds the faces with only the immovable casters,
+// the combined layer the same faces with the movable casters drawn over them, which the shaders sample.
+const int SHADOW_FACES = 6;
+const int SHADOW_ATLAS_COLUMNS = 3;
+const int SHADOW_ATLAS_ROWS = 4;
+const float SHADOW_FACE_FOV = 95.0f;    // Degrees; wider than 90 so filtering near a face edge stays inside its tile
+const float SHADOW_NEAR = 0.05f;
+const float SHADOW_FAR = 40.0f;
+const unsigned int SHADOW_ALL_FACES = (1u << SHADOW_FACES) - 1;
+
+enum ShadowLayer
+{
+    SHADOW_STATIC,
+    SHADOW_COMBINED
+};
+
+
+// Column and row of the tile of a face in a layer
+inline glm::ivec2 UShadowTile(int face, ShadowLayer layer)
+{
+    const int layerRow = layer == SHADOW_COMBINED ? SHADOW_FACES / SHADOW_ATLAS_COLUMNS : 0;
+    return glm::ivec2(face % SHADOW_ATLAS_COLUMNS, face / SHADOW_ATLAS_COLUMNS + layerRow);
+}
+
+
+// View-projection of a face as seen from the light
+inline glm::mat4 UShadowFaceViewProjection(const glm::vec3& light, int face)
+{
+    static const glm::vec3 DIRECTIONS[SHADOW_FACES] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+    static const glm::vec3 UPS[SHADOW_FACES] = { glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0) };
+
+    const glm::mat4 projection = glm::perspective(glm::radians(SHADOW_FACE_FOV), 1.0f, SHADOW_NEAR, SHADOW_FAR);
+    return projection * glm::lookAt(light, light + DIRECTIONS[face], UPS[face]);
+}
+
+
+// Maps the clip space of a face onto its tile of the combined layer, in atlas texture coordinates, with
+// depth in [0, 1] as it is stored
+inline glm::mat4 UShadowTileMatrix(int face)
+{
+    const glm::vec2 size(1.0f / SHADOW_ATLAS_COLUMNS, 1.0f / SHADOW_ATLAS_ROWS);
+    const glm::vec2 origin = glm::vec2(UShadowTile(face, SHADOW_COMBINED)) * size;
+
+    glm::mat4 tile(1.0f);
+    tile[0][0] = 0.5f * size.x;
+    tile[1][1] = 0.5f * size.y;
+    tile[2][2] = 0.5f;
+    tile[3] = glm::vec4(origin + 0.5f * size, 0.5f, 1.0f);
+    return tile;
+}
+
+
+// Bit per face whose frustum a box reaches into
+inline unsigned int UShadowFacesOfBox(const Frustum faces[SHADOW_FACES], glm::vec3 center, glm::vec3 extent)
+{
+    unsigned int mask = 0;
+    for (int face = 0; face < SHADOW_FACES; ++face)
+    {
+        if (UBoxInFrustum(faces[face], center, extent))
+            mask |= 1u << face;
+    }
+    return mask;
+}
+
+
+// Decides which parts of the atlas are out of date. The static layer is only drawn again when the light
+// moved or the cache was reset. A face of the combined layer is drawn again when a movable caster moved
+// into it or out of it; otherwise the atlas is left alone and shadows cost nothing but their lookups.
+class ShadowCache
+{
+public:
+    void reset() { mValid = false; }
+
+    // Starts a frame with the light at light, for casters indexed up to casterCount. Returns whether the
+    // static layer has to be drawn, which makes every face of the combined layer out of date too.
+    bool begin(const glm::vec3& light, size_t casterCount)
+    {
+        mDirty = 0;
+        if (mValid && light == mLight && casterCount == mCasterFaces.size())
+            return false;
+
+        mValid = true;
+        mLight = light;
+        mCasterFaces.assign(casterCount, 0);
+        mDirty = SHADOW_ALL_FACES;
+        return true;
+    }
+
+    // A movable caster with a new box, reaching into the faces of mask. The faces it was drawn into
+    // before need drawing too, without it.
+    void casterMoved(size_t caster, unsigned int mask)
+    {
+        mDirty |= mask | mCasterFaces[caster];
+        mCasterFaces[caster] = mask;
+    }
+
+    // Faces of the combined layer to draw again this frame
+    unsigned int dirtyFaces() const { return mDirty; }
+    // Faces a movable caster is drawn into
+    unsigned int casterFaces(size_t caster) const { return mCasterFaces[caster]; }
+
+private:
+    bool mValid = false;
+    glm::vec3 mLight;
+    std::vector<unsigned int> mCasterFaces;
+    unsigned int mDirty = 0;
+};
+
+#endif
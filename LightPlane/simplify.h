@@ -0,0 +1,473 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "mesh.h"
+#include "parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+// Triangle ratios of the automatically generated levels, relative to the source mesh
+const int LOD_CHAIN_RATIO_COUNT = 3;
+const float LOD_CHAIN_RATIOS[LOD_CHAIN_RATIO_COUNT] = { 0.5f, 0.25f, 0.1f };
+
+// A level stops the chain when it removes less than this share of the previous level's triangles
+const float LOD_CHAIN_MIN_REDUCTION = 0.1f;
+
+// One level of an LOD chain
+struct MeshLod
+{
+    MeshData mesh;
+    float error;    // Deviation from the source surface in object units, used by the runtime selector
+};
+
+// Levels of detail of one mesh, finest (the source mesh itself) first
+typedef std::vector<MeshLod> LodChain;
+
+
+// Symmetric 4x4 error quadric of Garland and Heckbert, stored as its 10 unique coefficients
+struct Quadric
+{
+    double q[10];
+
+    Quadric() { std::fill(q, q + 10, 0.0); }
+
+    // quadric measuring the squared distance to the plane a*x + b*y + c*z + d = 0
+    static Quadric fromPlane(double a, double b, double c, double d)
+    {
+        Quadric k;
+        k.q[0] = a * a; k.q[1] = a * b; k.q[2] = a * c; k.q[3] = a * d;
+        k.q[4] = b * b; k.q[5] = b * c; k.q[6] = b * d;
+        k.q[7] = c * c; k.q[8] = c * d;
+        k.q[9] = d * d;
+        return k;
+    }
+
+    void add(const Quadric& other)
+    {
+        for (int i = 0; i < 10; ++i)
+            q[i] += other.q[i];
+    }
+
+    double evaluate(glm::vec3 p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+             + q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+             + q[7] * z * z + 2.0 * q[8] * z
+             + q[9];
+    }
+};
+
+
+// Quadric error metric simplifier using half-edge collapses: a vertex is always merged onto one of its
+// neighbours, so surviving vertices keep their original attributes and texture coordinates stay valid.
+// Vertices sharing a position are welded and move together. On an attribute seam (a UV seam, a hard normal
+// edge) each copy of the vertex has to follow an edge of its own side onto a copy of the same target, so
+// seams only slide along themselves. Vertices on open borders are never moved.
+class MeshSimplifier
+{
+public:
+    explicit MeshSimplifier(const MeshData& source) : mSource(source), mMaxCost(0.0)
+    {
+        const unsigned int vertexCount = source.vertexCount();
+        mPositions.resize(vertexCount);
+        for (unsigned int v = 0; v < vertexCount; ++v)
+        {
+            const float* p = &source.vertices[v * MESH_FLOATS_PER_VERTEX];
+            mPositions[v] = glm::vec3(p[0], p[1], p[2]);
+        }
+
+        mTriangles = source.indices;
+        mTriangleAlive.assign(source.triangleCount(), true);
+        mAliveTriangles = source.triangleCount();
+
+        mVertexTriangles.assign(vertexCount, std::vector<unsigned int>());
+        for (unsigned int t = 0; t < mAliveTriangles; ++t)
+        {
+            for (int corner = 0; corner < 3; ++corner)
+                mVertexTriangles[mTriangles[t * 3 + corner]].push_back(t);
+        }
+
+        computeGroups();
+        computeQuadrics();
+        computeLockedGroups();
+
+        for (unsigned int g : mGroupIds)
+            pushCollapses(g);
+    }
+
+    unsigned int triangleCount() const { return mAliveTriangles; }
+
+    // Largest collapse error so far, as a distance in object units
+    float error() const { return (float)std::sqrt(std::max(mMaxCost, 0.0)); }
+
+    // Collapses the cheapest valid edges until at most targetTriangles remain or nothing can collapse
+    void simplify(unsigned int targetTriangles)
+    {
+        std::vector<unsigned int> targets;
+        while (mAliveTriangles > targetTriangles && !mHeap.empty())
+        {
+            Collapse collapse = mHeap.top();
+            mHeap.pop();
+
+            if (!mGroupAlive[collapse.from] || !mGroupAlive[collapse.to])
+                continue;
+            if (collapse.fromVersion != mVersion[collapse.from] || collapse.toVersion != mVersion[collapse.to])
+                continue;
+            if (!isValid(collapse.from, collapse.to, targets))
+                continue;
+
+            apply(collapse, targets);
+        }
+    }
+
+    // Returns the current mesh with unreferenced vertices removed
+    MeshData extract() const
+    {
+        MeshData mesh;
+        std::vector<unsigned int> remap(mPositions.size(), ~0u);
+
+        for (size_t t = 0; t < mTriangleAlive.size(); ++t)
+        {
+            if (!mTriangleAlive[t])
+                continue;
+
+            for (int corner = 0; corner < 3; ++corner)
+            {
+                unsigned int v = mTriangles[t * 3 + corner];
+                if (remap[v] == ~0u)
+                {
+                    remap[v] = mesh.vertexCount();
+                    const float* attributes = &mSource.vertices[v * MESH_FLOATS_PER_VERTEX];
+                    mesh.vertices.insert(mesh.vertices.end(), attributes, attributes + MESH_FLOATS_PER_VERTEX);
+                }
+                mesh.indices.push_back(remap[v]);
+            }
+        }
+        return mesh;
+    }
+
+private:
+    // Collapse of every copy of the vertex at position group from onto a copy at group to
+    struct Collapse
+    {
+        double cost;
+        unsigned int from;
+        unsigned int to;
+        unsigned int fromVersion;
+        unsigned int toVersion;
+
+        bool operator>(const Collapse& other) const { return cost > other.cost; }
+    };
+
+    // Positions are welded by their exact bit pattern
+    struct PositionHash
+    {
+        size_t operator()(const glm::vec3& p) const
+        {
+            unsigned int bits[3];
+            std::memcpy(bits, &p.x, sizeof(bits));
+            return (size_t)bits[0] * 73856093u ^ (size_t)bits[1] * 19349663u ^ (size_t)bits[2] * 83492791u;
+        }
+    };
+
+    struct PositionEqual
+    {
+        bool operator()(const glm::vec3& a, const glm::vec3& b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+    };
+
+    glm::vec3 triangleNormal(unsigned int a, unsigned int b, unsigned int c) const
+    {
+        return glm::cross(mPositions[b] - mPositions[a], mPositions[c] - mPositions[a]);
+    }
+
+    // A group is named after its first vertex and lists every vertex at its position
+    void computeGroups()
+    {
+        const unsigned int vertexCount = (unsigned int)mPositions.size();
+        mGroup.resize(vertexCount);
+        mWedges.assign(vertexCount, std::vector<unsigned int>());
+        std::unordered_map<glm::vec3, unsigned int, PositionHash, PositionEqual> first;
+        for (unsigned int v = 0; v < vertexCount; ++v)
+        {
+            auto found = first.emplace(mPositions[v], v).first;
+            mGroup[v] = found->second;
+            mWedges[found->second].push_back(v);
+            if (found->second == v)
+                mGroupIds.push_back(v);
+        }
+        mGroupAlive.assign(vertexCount, false);
+        for (unsigned int g : mGroupIds)
+            mGroupAlive[g] = true;
+        mVersion.assign(vertexCount, 0);
+    }
+
+    // Planes of every triangle around a position, whichever copy of the vertex the triangle uses
+    void computeQuadrics()
+    {
+        mQuadrics.assign(mPositions.size(), Quadric());
+        for (unsigned int t = 0; t < mAliveTriangles; ++t)
+        {
+            const unsigned int* tri = &mTriangles[t * 3];
+            glm::vec3 normal = triangleNormal(tri[0], tri[1], tri[2]);
+            float length = glm::length(normal);
+            if (length > 0.0f)
+            {
+                normal /= length;
+                Quadric plane = Quadric::fromPlane(normal.x, normal.y, normal.z, -glm::dot(normal, mPositions[tri[0]]));
+                for (int corner = 0; corner < 3; ++corner)
+                    mQuadrics[mGroup[tri[corner]]].add(plane);
+            }
+        }
+    }
+
+    // Edges between positions used by a single triangle are open borders
+    void computeLockedGroups()
+    {
+        mLocked.assign(mPositions.size(), false);
+        std::unordered_map<unsigned long long, int> edgeUses;
+        for (unsigned int t = 0; t < mAliveTriangles; ++t)
+        {
+            for (int corner = 0; corner < 3; ++corner)
+                ++edgeUses[edgeKey(mGroup[mTriangles[t * 3 + corner]], mGroup[mTriangles[t * 3 + (corner + 1) % 3]])];
+        }
+        for (unsigned int t = 0; t < mAliveTriangles; ++t)
+        {
+            for (int corner = 0; corner < 3; ++corner)
+            {
+                unsigned int a = mGroup[mTriangles[t * 3 + corner]];
+                unsigned int b = mGroup[mTriangles[t * 3 + (corner + 1) % 3]];
+                if (edgeUses[edgeKey(a, b)] == 1)
+                    mLocked[a] = mLocked[b] = true;
+            }
+        }
+    }
+
+    static unsigned long long edgeKey(unsigned int a, unsigned int b)
+    {
+        if (a > b)
+            std::swap(a, b);
+        return ((unsigned long long)a << 32) | b;
+    }
+
+    // Copy of the vertex of group g in a triangle, or ~0u
+    unsigned int cornerOfGroup(const unsigned int* tri, unsigned int g) const
+    {
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            if (mGroup[tri[corner]] == g)
+                return tri[corner];
+        }
+        return ~0u;
+    }
+
+    void neighbours(unsigned int g, std::vector<unsigned int>& result) const
+    {
+        result.clear();
+        for (unsigned int v : mWedges[g])
+        {
+            for (unsigned int t : mVertexTriangles[v])
+            {
+                if (!mTriangleAlive[t])
+                    continue;
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    unsigned int w = mGroup[mTriangles[t * 3 + corner]];
+                    if (w != g && std::find(result.begin(), result.end(), w) == result.end())
+                        result.push_back(w);
+                }
+            }
+        }
+    }
+
+    void pushCollapse(unsigned int from, unsigned int to)
+    {
+        if (mLocked[from])
+            return;
+        Quadric sum = mQuadrics[from];
+        sum.add(mQuadrics[to]);
+        Collapse collapse = { sum.evaluate(mPositions[to]), from, to, mVersion[from], mVersion[to] };
+        mHeap.push(collapse);
+    }
+
+    void pushCollapses(unsigned int from)
+    {
+        std::vector<unsigned int> adjacent;
+        neighbours(from, adjacent);
+        for (unsigned int to : adjacent)
+            pushCollapse(from, to);
+    }
+
+    // Checks a collapse and finds the copy of to that each copy of from (in mWedges[from] order) lands on:
+    // the one sharing a collapsing triangle with it. A copy with no such triangle, or with two different
+    // ones, would leave the seam it lies on.
+    bool isValid(unsigned int from, unsigned int to, std::vector<unsigned int>& targets) const
+    {
+        // Link condition: an interior edge may share at most two neighbours, or the surface pinches
+        std::vector<unsigned int> fromAdjacent, toAdjacent;
+        neighbours(from, fromAdjacent);
+        neighbours(to, toAdjacent);
+        int shared = 0;
+        for (unsigned int w : fromAdjacent)
+        {
+            if (std::find(toAdjacent.begin(), toAdjacent.end(), w) != toAdjacent.end())
+                ++shared;
+        }
+        if (shared > 2)
+            return false;
+
+        targets.clear();
+        for (unsigned int v : mWedges[from])
+        {
+            unsigned int target = ~0u;
+            bool used = false;
+            for (unsigned int t : mVertexTriangles[v])
+            {
+                if (!mTriangleAlive[t])
+                    continue;
+                used = true;
+
+                const unsigned int* tri = &mTriangles[t * 3];
+                const unsigned int corner = cornerOfGroup(tri, to);
+                if (corner == ~0u)
+                {
+                    // Reject collapses that flip or degenerate a surviving triangle
+                    unsigned int moved[3];
+                    for (int k = 0; k < 3; ++k)
+                        moved[k] = tri[k] == v ? to : tri[k];
+                    glm::vec3 before = triangleNormal(tri[0], tri[1], tri[2]);
+                    glm::vec3 after = triangleNormal(moved[0], moved[1], moved[2]);
+                    if (glm::dot(before, after) <= 0.1f * glm::length(before) * glm::length(after) || glm::length(after) == 0.0f)
+                        return false;
+                }
+                else if (target == ~0u)
+                    target = corner;
+                else if (target != corner)
+                    return false;
+            }
+            if (used && target == ~0u)
+                return false;
+            targets.push_back(target);
+        }
+        return true;
+    }
+
+    void apply(const Collapse& collapse, const std::vector<unsigned int>& targets)
+    {
+        const unsigned int from = collapse.from;
+        const unsigned int to = collapse.to;
+
+        for (size_t w = 0; w < mWedges[from].size(); ++w)
+        {
+            const unsigned int v = mWedges[from][w];
+            for (unsigned int t : mVertexTriangles[v])
+            {
+                if (!mTriangleAlive[t])
+                    continue;
+
+                unsigned int* tri = &mTriangles[t * 3];
+                if (cornerOfGroup(tri, to) != ~0u)
+                {
+                    mTriangleAlive[t] = false;
+                    --mAliveTriangles;
+                    continue;
+                }
+
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    if (tri[corner] == v)
+                        tri[corner] = targets[w];
+                }
+                mVertexTriangles[targets[w]].push_back(t);
+            }
+            mVertexTriangles[v].clear();
+        }
+
+        mGroupAlive[from] = false;
+        mQuadrics[to].add(mQuadrics[from]);
+        mMaxCost = std::max(mMaxCost, collapse.cost);
+
+        // Only the collapses with to at one end changed cost, through its quadric. Those starting from to
+        // are dropped by its version and queued again; those ending on it are queued again from each
+        // neighbour, whose other collapses stay queued as they were.
+        ++mVersion[to];
+        pushCollapses(to);
+
+        std::vector<unsigned int> adjacent;
+        neighbours(to, adjacent);
+        for (unsigned int w : adjacent)
+            pushCollapse(w, to);
+    }
+
+    const MeshData& mSource;
+    std::vector<glm::vec3> mPositions;
+    std::vector<unsigned int> mTriangles;
+    std::vector<bool> mTriangleAlive;
+    unsigned int mAliveTriangles;
+    std::vector<std::vector<unsigned int>> mVertexTriangles;
+    std::vector<unsigned int> mGroup;                   // Group of each vertex
+    std::vector<std::vector<unsigned int>> mWedges;     // Vertices of each group
+    std::vector<unsigned int> mGroupIds;
+    std::vector<bool> mGroupAlive;
+    std::vector<bool> mLocked;
+    std::vector<unsigned int> mVersion;
+    std::vector<Quadric> mQuadrics;
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> mHeap;
+    double mMaxCost;
+};
+
+
+// Triangle counts of the levels LOD_CHAIN_RATIOS asks for
+inline std::vector<unsigned int> ULodChainTargets(const MeshData& source)
+{
+    std::vector<unsigned int> targets;
+    for (int i = 0; i < LOD_CHAIN_RATIO_COUNT; ++i)
+        targets.push_back((unsigned int)(source.triangleCount() * LOD_CHAIN_RATIOS[i]));
+    return targets;
+}
+
+
+// Builds the LOD chain of a mesh: the source itself followed by one level per target triangle count.
+// The levels come from a single simplification run, so each one refines the previous level's collapses.
+inline LodChain UBuildLodChain(const MeshData& source, const std::vector<unsigned int>& targets)
+{
+    LodChain chain;
+    chain.push_back({ source, 0.0f });
+
+    MeshSimplifier simplifier(source);
+    for (unsigned int target : targets)
+    {
+        simplifier.simplify(target);
+
+        // Seams and borders can stop the simplifier early; a level that barely changes is not worth keeping
+        unsigned int previous = chain.back().mesh.triangleCount();
+        if (simplifier.triangleCount() > previous * (1.0f - LOD_CHAIN_MIN_REDUCTION))
+            break;
+
+        chain.push_back({ simplifier.extract(), simplifier.error() });
+    }
+    return chain;
+}
+
+
+// Builds the LOD chains of several meshes in parallel, one mesh per task, with the target triangle counts
+// of each mesh
+inline std::vector<LodChain> UBuildLodChains(const std::vector<MeshData>& meshes, const std::vector<std::vector<unsigned int>>& targets)
+{
+    std::vector<LodChain> chains(meshes.size());
+    UParallelFor((unsigned int)meshes.size(), [&](unsigned int i)
+    {
+        chains[i] = UBuildLodChain(meshes[i], targets[i]);
+    });
+    return chains;
+}
+
+#endif
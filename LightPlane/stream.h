@@ -0,0 +1,208 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+const uint32_t STREAM_SHM_MAGIC = 0x4d48534c;       // "LSHM" in memory order
+const uint32_t STREAM_SHM_VERSION = 1;
+const size_t STREAM_SHM_HEADER_SIZE = 4096;         // Frames start page aligned
+
+// Start of the shared-memory ring, for consumers. Frames follow the header, slotCount of them frameSize
+// bytes apart, the first at STREAM_SHM_HEADER_SIZE; frame n is in slot n % slotCount. Pixels are RGBA
+// rows, the bottom row first as OpenGL reads them.
+// The renderer advances written once a frame is in its slot, and the consumer advances read when it is
+// done with a frame, which frees the slot. Frames are read in place, without copying them out.
+struct StreamShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slotCount;
+    std::atomic<uint32_t> closed;       // Set when the renderer stops; no frames come after written
+    uint64_t frameSize;
+    std::atomic<uint64_t> written;      // Frames published by the renderer
+    std::atomic<uint64_t> read;         // Frames released by the consumer
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Counters shared between processes have to be lock-free");
+
+// Sink for raw video frames: the standard input of an encoder process, such as ffmpeg reading rawvideo,
+// or a ring of frames in POSIX shared memory that another process consumes.
+// Writing to a pipe blocks while the encoder is behind. The ring lets the writer choose: a frame that
+// finds every slot taken is either dropped or waits for the consumer, for up to the timeout. A consumer
+// that frees no slot for that long is taken for gone, and the stream fails.
+class FrameStream
+{
+public:
+    FrameStream() {}
+    FrameStream(const FrameStream&) = delete;
+    FrameStream& operator=(const FrameStream&) = delete;
+    ~FrameStream() { close(); }
+
+    // Starts command through the shell with the frames on its standard input
+    bool openPipe(const std::string& command, int width, int height)
+    {
+#if defined(_WIN32)
+        mPipe = _popen(command.c_str(), "wb");
+#else
+        // An encoder that quits must fail the writes, not end the renderer with SIGPIPE
+        signal(SIGPIPE, SIG_IGN);
+        mPipe = popen(command.c_str(), "w");
+#endif
+        if (!mPipe)
+            return false;
+
+        mWidth = width;
+        mHeight = height;
+        mFailed = false;
+        return true;
+    }
+
+    // Creates the ring under name, replacing one left behind by an earlier run
+    bool openSharedMemory(const std::string& name, int width, int height, unsigned int slots)
+    {
+#if defined(_WIN32)
+        (void)name; (void)width; (void)height; (void)slots;
+        return false;
+#else
+        const std::string path = name.empty() || name[0] != '/' ? "/" + name : name;
+        const uint64_t frameSize = (uint64_t)width * height * 4;
+        const size_t size = STREAM_SHM_HEADER_SIZE + (size_t)frameSize * slots;
+
+        shm_unlink(path.c_str());
+        int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            return false;
+        void* mapping = MAP_FAILED;
+        if (ftruncate(fd, (off_t)size) == 0)
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            shm_unlink(path.c_str());
+            return false;
+        }
+
+        mShm = new (mapping) StreamShmHeader();
+        mShm->version = STREAM_SHM_VERSION;
+        mShm->width = (uint32_t)width;
+        mShm->height = (uint32_t)height;
+        mShm->slotCount = slots;
+        mShm->frameSize = frameSize;
+        mShm->written.store(0);
+        mShm->read.store(0);
+        mShm->closed.store(0);
+        // A consumer checks the magic number before anything else, so it goes in last
+        std::atomic_thread_fence(std::memory_order_release);
+        mShm->magic = STREAM_SHM_MAGIC;
+
+        mShmName = path;
+        mShmSize = size;
+        mWidth = width;
+        mHeight = height;
+        mFailed = false;
+        return true;
+#endif
+    }
+
+    // Longest a blocking write waits for the ring to free a slot
+    void setTimeout(double seconds) { mTimeout = seconds; }
+
+    bool isOpen() const { return mPipe != nullptr || mShm != nullptr; }
+    // Whether frames go to an encoder process, which takes them at a constant rate
+    bool isPipe() const { return mPipe != nullptr; }
+    // Whether the consumer stopped taking frames: an encoder that quit or never started, or a ring
+    // left full past the timeout
+    bool failed() const { return mFailed; }
+
+    // Sends a frame: RGBA, the bottom row first, width * 4 bytes per row. Returns false when the frame was
+    // dropped, because the ring was full and block not set, or because the sink failed.
+    bool write(const unsigned char* pixels, bool block)
+    {
+        if (mFailed)
+            return false;
+
+        const size_t size = (size_t)mWidth * mHeight * 4;
+        if (mPipe)
+        {
+            if (fwrite(pixels, 1, size, mPipe) != size)
+                mFailed = true;
+            return !mFailed;
+        }
+#if !defined(_WIN32)
+        if (mShm)
+        {
+            const uint64_t frame = mShm->written.load(std::memory_order_relaxed);
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(mTimeout);
+            while (frame - mShm->read.load(std::memory_order_acquire) >= mShm->slotCount)
+            {
+                if (!block)
+                    return false;
+                if (std::chrono::steady_clock::now() >= deadline)
+                {
+                    mFailed = true;
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+            }
+
+            unsigned char* slot = (unsigned char*)mShm + STREAM_SHM_HEADER_SIZE + (size_t)(frame % mShm->slotCount) * mShm->frameSize;
+            memcpy(slot, pixels, size);
+            mShm->written.store(frame + 1, std::memory_order_release);
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // Waits for an encoder to finish the file. The ring is marked closed and its name removed; a consumer
+    // that has it mapped can still read the frames it has not released.
+    void close()
+    {
+        if (mPipe)
+        {
+#if defined(_WIN32)
+            _pclose(mPipe);
+#else
+            pclose(mPipe);
+#endif
+            mPipe = nullptr;
+        }
+#if !defined(_WIN32)
+        if (mShm)
+        {
+            mShm->closed.store(1, std::memory_order_release);
+            munmap(mShm, mShmSize);
+            shm_unlink(mShmName.c_str());
+            mShm = nullptr;
+        }
+#endif
+    }
+
+private:
+    FILE* mPipe = nullptr;
+    StreamShmHeader* mShm = nullptr;
+    std::string mShmName;
+    size_t mShmSize = 0;
+    int mWidth = 0;
+    int mHeight = 0;
+    double mTimeout = 5.0;
+    bool mFailed = false;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef TRANSFORMS_H
+#define TRANSFORMS_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <cstring>
+#include <vector>
+
+// Width of the matrix composition: 8 objects per step with AVX (AVX2 builds included), otherwise scalar
+#if defined(__AVX__)
+#include <immintrin.h>
+#define TRANSFORMS_AVX 1
+#endif
+
+// Floats written per object by TransformStore::compose: the model matrix, then the normal matrix
+// padded to a 4x4 matrix, both column-major
+const int TRANSFORM_FLOATS_PER_OBJECT = 32;
+
+// World translations, rotations and scales of many objects in structure-of-arrays form, turned into
+// model and normal matrices several objects at a time
+class TransformStore
+{
+public:
+    void resize(size_t count)
+    {
+        // Padded to whole SIMD steps; the padding holds identity transforms that are never written out
+        size_t padded = (count + 7) & ~size_t(7);
+        mCount = count;
+        for (std::vector<float>* component : { &mTx, &mTy, &mTz, &mQx, &mQy, &mQz })
+            component->resize(padded, 0.0f);
+        for (std::vector<float>* component : { &mQw, &mSx, &mSy, &mSz })
+            component->resize(padded, 1.0f);
+    }
+
+    size_t size() const { return mCount; }
+
+    void set(size_t i, glm::vec3 translation, glm::quat rotation, glm::vec3 scale)
+    {
+        mTx[i] = translation.x; mTy[i] = translation.y; mTz[i] = translation.z;
+        mQx[i] = rotation.x; mQy[i] = rotation.y; mQz[i] = rotation.z; mQw[i] = rotation.w;
+        mSx[i] = scale.x; mSy[i] = scale.y; mSz[i] = scale.z;
+    }
+
+    // Writes TRANSFORM_FLOATS_PER_OBJECT floats for each object of [first, first + count) to out, the record
+    // of object first + k starting k * stride bytes in. Suits a mapped GPU buffer: every byte of the
+    // matrices is written once, in order, and nothing is read back.
+    void compose(size_t first, size_t count, void* out, size_t stride) const
+    {
+        char* record = (char*)out;
+        size_t i = first;
+        const size_t end = first + count;
+
+#if defined(TRANSFORMS_AVX)
+        for (; i + 8 <= end; i += 8, record += 8 * stride)
+        {
+            __m256 qx = _mm256_loadu_ps(&mQx[i]), qy = _mm256_loadu_ps(&mQy[i]), qz = _mm256_loadu_ps(&mQz[i]), qw = _mm256_loadu_ps(&mQw[i]);
+            __m256 sx = _mm256_loadu_ps(&mSx[i]), sy = _mm256_loadu_ps(&mSy[i]), sz = _mm256_loadu_ps(&mSz[i]);
+            const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), zero = _mm256_setzero_ps();
+
+            __m256 xx = _mm256_mul_ps(qx, qx), yy = _mm256_mul_ps(qy, qy), zz = _mm256_mul_ps(qz, qz);
+            __m256 xy = _mm256_mul_ps(qx, qy), xz = _mm256_mul_ps(qx, qz), yz = _mm256_mul_ps(qy, qz);
+            __m256 wx = _mm256_mul_ps(qw, qx), wy = _mm256_mul_ps(qw, qy), wz = _mm256_mul_ps(qw, qz);
+
+            // Rotation matrix, column by column
+            __m256 r[9] = {
+                _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))),
+                _mm256_mul_ps(two, _mm256_add_ps(xy, wz)),
+                _mm256_mul_ps(two, _mm256_sub_ps(xz, wy)),
+                _mm256_mul_ps(two, _mm256_sub_ps(xy, wz)),
+                _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))),
+                _mm256_mul_ps(two, _mm256_add_ps(yz, wx)),
+                _mm256_mul_ps(two, _mm256_add_ps(xz, wy)),
+                _mm256_mul_ps(two, _mm256_sub_ps(yz, wx)),
+                _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy)))
+            };
+
+            // Model = R * S scales the columns; the normal matrix, inverse(transpose(R * S)) = R * inverse(S), divides them
+            __m256 scale[3] = { sx, sy, sz };
+            __m256 model[16], normal[16];
+            for (int column = 0; column < 3; ++column)
+            {
+                __m256 inverseScale = _mm256_div_ps(one, scale[column]);
+                for (int row = 0; row < 3; ++row)
+                {
+                    model[column * 4 + row] = _mm256_mul_ps(r[column * 3 + row], scale[column]);
+                    normal[column * 4 + row] = _mm256_mul_ps(r[column * 3 + row], inverseScale);
+                }
+                model[column * 4 + 3] = zero;
+                normal[column * 4 + 3] = zero;
+                normal[12 + column] = zero;
+            }
+            model[12] = _mm256_loadu_ps(&mTx[i]);
+            model[13] = _mm256_loadu_ps(&mTy[i]);
+            model[14] = _mm256_loadu_ps(&mTz[i]);
+            model[15] = one;
+            normal[15] = one;
+
+            // Each 8x8 transpose turns eight registers of one value per object into eight rows of one object's values
+            storeTransposed(model, record, stride);
+            storeTransposed(model + 8, record + 8 * sizeof(float), stride);
+            storeTransposed(normal, record + 16 * sizeof(float), stride);
+            storeTransposed(normal + 8, record + 24 * sizeof(float), stride);
+        }
+#endif
+
+        // Remaining objects that do not fill a whole SIMD register
+        for (; i < end; ++i, record += stride)
+        {
+            glm::mat3 rotation = glm::mat3_cast(glm::quat(mQw[i], mQx[i], mQy[i], mQz[i]));
+            glm::vec3 scale(mSx[i], mSy[i], mSz[i]);
+
+            glm::mat4 model(1.0f), normal(1.0f);
+            for (int column = 0; column < 3; ++column)
+            {
+                model[column] = glm::vec4(rotation[column] * scale[column], 0.0f);
+                normal[column] = glm::vec4(rotation[column] / scale[column], 0.0f);
+            }
+            model[3] = glm::vec4(mTx[i], mTy[i], mTz[i], 1.0f);
+
+            std::memcpy(record, &model[0][0], 16 * sizeof(float));
+            std::memcpy(record + 16 * sizeof(float), &normal[0][0], 16 * sizeof(float));
+        }
+    }
+
+private:
+#if defined(TRANSFORMS_AVX)
+    // Writes v[0..7] lane by lane: the eight values of lane k go to out + k * stride
+    static void storeTransposed(const __m256* v, char* out, size_t stride)
+    {
+        __m256 t0 = _mm256_unpacklo_ps(v[0], v[1]), t1 = _mm256_unpackhi_ps(v[0], v[1]);
+        __m256 t2 = _mm256_unpacklo_ps(v[2], v[3]), t3 = _mm256_unpackhi_ps(v[2], v[3]);
+        __m256 t4 = _mm256_unpacklo_ps(v[4], v[5]), t5 = _mm256_unpackhi_ps(v[4], v[5]);
+        __m256 t6 = _mm256_unpacklo_ps(v[6], v[7]), t7 = _mm256_unpackhi_ps(v[6], v[7]);
+
+        __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+        _mm256_storeu_ps((float*)(out + 0 * stride), _mm256_permute2f128_ps(u0, u4, 0x20));
+        _mm256_storeu_ps((float*)(out + 1 * stride), _mm256_permute2f128_ps(u1, u5, 0x20));
+        _mm256_storeu_ps((float*)(out + 2 * stride), _mm256_permute2f128_ps(u2, u6, 0x20));
+        _mm256_storeu_ps((float*)(out + 3 * stride), _mm256_permute2f128_ps(u3, u7, 0x20));
+        _mm256_storeu_ps((float*)(out + 4 * stride), _mm256_permute2f128_ps(u0, u4, 0x31));
+        _mm256_storeu_ps((float*)(out + 5 * stride), _mm256_permute2f128_ps(u1, u5, 0x31));
+        _mm256_storeu_ps((float*)(out + 6 * stride), _mm256_permute2f128_ps(u2, u6, 0x31));
+        _mm256_storeu_ps((float*)(out + 7 * stride), _mm256_permute2f128_ps(u3, u7, 0x31));
+    }
+#endif
+
+    size_t mCount = 0;
+    std::vector<float> mTx, mTy, mTz;       // Translation
+    std::vector<float> mQx, mQy, mQz, mQw;  // Rotation quaternion
+    std::vector<float> mSx, mSy, mSz;       // Scale
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+
+// Hands values from one writer thread to one reader thread without locks or waiting. The writer fills
+// back() and publishes it; the reader picks up the latest published value with fetch() and reads front().
+// Three slots let both sides work at their own pace: the writer never touches the slot being read, and
+// values the reader was too slow to pick up are simply replaced by newer ones.
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Writer side: the slot to fill next
+    T& back() { return mSlots[mBack]; }
+
+    // Writer side: makes back() the latest value and takes over the slot it replaces
+    void publish()
+    {
+        unsigned int previous = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel);
+        mBack = previous & INDEX;
+    }
+
+    // Reader side: moves to the latest published value, if there is one newer than front().
+    // Returns whether front() changed.
+    bool fetch()
+    {
+        if (!(mMiddle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+
+        unsigned int latest = mMiddle.exchange(mFront, std::memory_order_acq_rel);
+        mFront = latest & INDEX;
+        return true;
+    }
+
+    // Reader side: the value picked up by the last fetch()
+    const T& front() const { return mSlots[mFront]; }
+
+private:
+    static const unsigned int INDEX = 3;    // Slot index bits of mMiddle
+    static const unsigned int FRESH = 4;    // Set when the middle slot was published and not fetched yet
+
+    T mSlots[3];
+    unsigned int mBack = 0;                 // Owned by the writer
+    unsigned int mFront = 1;                // Owned by the reader
+    std::atomic<unsigned int> mMiddle{ 2 }; // Exchanged between them
+};
+
+#endif